@@ -25,6 +25,7 @@ const InputHistory = 1024
 const PlayerDataSize = 1024
 
 const PlayerStateSize = 1000
+const PlayerStateHotSize = 56
 
 const InputPacketSize = 1 + 8 + 8 + 8 + (8 + InputSize) * InputsPerPacket
 const JoinRequestPacketSize = 1 + 8 + 8 + PlayerDataSize
@@ -32,6 +33,7 @@ const JoinResponsePacketSize = 1 + 8 + 8 + 8
 const StatsRequestPacketSize = 1 + 8 + 8
 const StatsResponsePacketSize = 1 + 8 + 8
 const PlayerStatePacketSize = 1 + 8 + PlayerStateSize
+const PlayerStateHotPacketSize = 1 + 8 + PlayerStateHotSize
 
 const JoinRequestPacket = 1
 const JoinResponsePacket = 2
@@ -39,6 +41,7 @@ const InputPacket = 3
 const StatsRequestPacket = 4
 const StatsResponsePacket = 5
 const PlayerStatePacket = 6
+const PlayerStateHotPacket = 7
 
 var numClients int
 
@@ -270,6 +273,10 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 				atomic.AddUint64(&playerStatePacketsReceived, 1)
 
+			} else if packetType == PlayerStateHotPacket && packetBytes == PlayerStateHotPacketSize {
+
+				atomic.AddUint64(&playerStatePacketsReceived, 1)
+
 			}
 
 			atomic.AddUint64(&packetsReceived, 1)
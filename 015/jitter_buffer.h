@@ -0,0 +1,297 @@
+
+#include "shared.h"
+
+/*
+    Per-player jitter buffer.
+
+    Inputs go into a fixed ring of JITTER_BUFFER_SIZE slots keyed by input sequence, and are released on the server
+    timeline, one per-tick. A player starts releasing once JITTER_BUFFER_TARGET_DEPTH inputs are buffered, so network
+    jitter up to the target depth is absorbed instead of turning into uneven steps.
+
+    Over-run: when the buffer is deeper than JITTER_BUFFER_MAX_DEPTH, two inputs are released in one tick and their dt
+    merged, until it's back under. If an input arrives so far ahead that it doesn't fit in the ring, the oldest inputs
+    are merged into the next release to make room.
+
+    Under-run: with JITTER_BUFFER_POLICY_DUPLICATE, the missing input is replaced by a duplicate of the last dt, up to
+    JITTER_BUFFER_MAX_DUPLICATES in a row. If the real input turns up later, the difference between its dt and the
+    duplicated dt is reconciled on the next release, so the player's t ends up where the client put it. With
+    JITTER_BUFFER_POLICY_HOLD nothing is released for the missing input. Either way, a lost input with later inputs
+    behind it is skipped once it can't be duplicated, and a player that runs dry goes back to buffering.
+
+    A player that stops sending input with fewer than JITTER_BUFFER_TARGET_DEPTH inputs buffered would never start
+    releasing them, so after JITTER_BUFFER_MAX_BUFFERING_TICKS it plays out whatever it has. A negative correction
+    still owed when a player runs dry has no dt left to come out of, so it's dropped and the player goes idle.
+
+    Buffers are stored inline in a slab indexed by session table slab index, so there are no allocations after create.
+*/
+
+#define JITTER_BUFFER_SIZE                                                                  8          // power of two
+
+#define JITTER_BUFFER_TARGET_DEPTH                                                          2
+
+#define JITTER_BUFFER_MAX_DEPTH                                                             4
+
+#define JITTER_BUFFER_MAX_DUPLICATES                                                        2
+
+#define JITTER_BUFFER_MAX_BUFFERING_TICKS                                                   8
+
+#define JITTER_BUFFER_POLICY_HOLD                                                           0
+#define JITTER_BUFFER_POLICY_DUPLICATE                                                      1
+
+#define JITTER_BUFFER_IDLE                                                                  0          // not on the active list
+#define JITTER_BUFFER_BUFFERING                                                             1
+#define JITTER_BUFFER_PLAYING                                                               2
+
+#define JITTER_BUFFER_SLOT_EMPTY                                                            0
+#define JITTER_BUFFER_SLOT_QUEUED                                                           1
+#define JITTER_BUFFER_SLOT_DUPLICATED                                                       2
+
+#define JITTER_BUFFER_PUSH_QUEUED                                                           0
+#define JITTER_BUFFER_PUSH_LATE                                                             1          // dropped
+#define JITTER_BUFFER_PUSH_RECONCILED                                                       2
+#define JITTER_BUFFER_PUSH_OVERFLOW                                                         3          // queued, after merging the oldest inputs
+
+#define JITTER_BUFFER_RELEASED                                                              1
+#define JITTER_BUFFER_MERGED                                                                2
+#define JITTER_BUFFER_DUPLICATED                                                            4
+#define JITTER_BUFFER_SKIPPED                                                               8
+#define JITTER_BUFFER_WENT_IDLE                                                            16
+
+struct jitter_buffer_t
+{
+    uint64_t session_id;
+    uint64_t next_sequence;              // next input to release
+    uint64_t end_sequence;               // one past the newest input pushed
+    uint64_t last_dt;                    // repeated on under-run
+    uint64_t carry_dt;                   // merged on overflow, released next tick
+    int64_t correction_dt;               // owed to the player by late inputs that were duplicated
+    uint8_t state;
+    uint8_t num_duplicates;              // in a row
+    uint8_t buffering_ticks;             // since it last started buffering
+    uint8_t slot_state[JITTER_BUFFER_SIZE];
+    uint64_t slot_sequence[JITTER_BUFFER_SIZE];
+    uint64_t slot_dt[JITTER_BUFFER_SIZE];
+};
+
+struct jitter_buffer_set_t
+{
+    int capacity;
+    int policy;
+    struct jitter_buffer_t * buffers;    // by slab index
+    int num_active;
+    uint32_t * active_slab_index;        // players that are buffering or playing
+};
+
+static struct jitter_buffer_set_t * jitter_buffer_set_create( int capacity, int policy )
+{
+    assert( capacity > 0 );
+
+    struct jitter_buffer_set_t * set = (struct jitter_buffer_set_t*) malloc( sizeof(struct jitter_buffer_set_t) );
+    assert( set );
+    memset( set, 0, sizeof(struct jitter_buffer_set_t) );
+    set->capacity = capacity;
+    set->policy = policy;
+    set->buffers = (struct jitter_buffer_t*) malloc( sizeof(struct jitter_buffer_t) * capacity );
+    set->active_slab_index = (uint32_t*) malloc( sizeof(uint32_t) * capacity );
+    assert( set->buffers );
+    assert( set->active_slab_index );
+    memset( set->buffers, 0, sizeof(struct jitter_buffer_t) * capacity );
+    return set;
+}
+
+static void jitter_buffer_set_destroy( struct jitter_buffer_set_t * set )
+{
+    assert( set );
+    free( set->buffers );
+    free( set->active_slab_index );
+    free( set );
+}
+
+static inline uint64_t jitter_buffer_depth( const struct jitter_buffer_t * buffer )
+{
+    // in ticks of input, counting gaps
+
+    return buffer->end_sequence > buffer->next_sequence ? buffer->end_sequence - buffer->next_sequence : 0;
+}
+
+// reset when a session is deleted, and again when a new session reuses its slab index. the server only deletes idle players
+
+static void jitter_buffer_reset_player( struct jitter_buffer_set_t * set, int index, uint64_t session_id )
+{
+    assert( index >= 0 && index < set->capacity );
+    struct jitter_buffer_t * buffer = set->buffers + index;
+    assert( buffer->state == JITTER_BUFFER_IDLE );
+    memset( buffer, 0, sizeof(struct jitter_buffer_t) );
+    buffer->session_id = session_id;
+}
+
+static int jitter_buffer_push( struct jitter_buffer_set_t * set, int index, uint64_t sequence, uint64_t dt )
+{
+    assert( index >= 0 && index < set->capacity );
+
+    struct jitter_buffer_t * buffer = set->buffers + index;
+
+    if ( buffer->state == JITTER_BUFFER_IDLE )
+    {
+        buffer->state = JITTER_BUFFER_BUFFERING;
+        buffer->num_duplicates = 0;
+        buffer->buffering_ticks = 0;
+        if ( sequence >= buffer->next_sequence )
+        {
+            buffer->next_sequence = sequence;
+            buffer->end_sequence = sequence;
+        }
+        set->active_slab_index[set->num_active++] = index;
+    }
+
+    if ( sequence < buffer->next_sequence )
+    {
+        // already played out. if a duplicate stood in for it, pay back the difference
+
+        const int slot = sequence & ( JITTER_BUFFER_SIZE - 1 );
+        if ( buffer->slot_state[slot] == JITTER_BUFFER_SLOT_DUPLICATED && buffer->slot_sequence[slot] == sequence )
+        {
+            buffer->correction_dt += (int64_t) dt - (int64_t) buffer->slot_dt[slot];
+            buffer->slot_state[slot] = JITTER_BUFFER_SLOT_EMPTY;
+            return JITTER_BUFFER_PUSH_RECONCILED;
+        }
+        return JITTER_BUFFER_PUSH_LATE;
+    }
+
+    int result = JITTER_BUFFER_PUSH_QUEUED;
+
+    if ( sequence >= buffer->next_sequence + JITTER_BUFFER_SIZE )
+    {
+        // doesn't fit. merge everything older than the new window into the next release
+
+        const uint64_t window_start = sequence - JITTER_BUFFER_SIZE + 1;
+        for ( uint64_t i = buffer->next_sequence; i < window_start && i < buffer->next_sequence + JITTER_BUFFER_SIZE; i++ )
+        {
+            const int slot = i & ( JITTER_BUFFER_SIZE - 1 );
+            if ( buffer->slot_state[slot] == JITTER_BUFFER_SLOT_QUEUED && buffer->slot_sequence[slot] == i )
+            {
+                buffer->carry_dt += buffer->slot_dt[slot];
+                buffer->last_dt = buffer->slot_dt[slot];
+            }
+            buffer->slot_state[slot] = JITTER_BUFFER_SLOT_EMPTY;
+        }
+        buffer->next_sequence = window_start;
+        result = JITTER_BUFFER_PUSH_OVERFLOW;
+    }
+
+    const int slot = sequence & ( JITTER_BUFFER_SIZE - 1 );
+    if ( buffer->slot_state[slot] == JITTER_BUFFER_SLOT_QUEUED && buffer->slot_sequence[slot] == sequence )
+    {
+        return JITTER_BUFFER_PUSH_LATE;
+    }
+
+    buffer->slot_state[slot] = JITTER_BUFFER_SLOT_QUEUED;
+    buffer->slot_sequence[slot] = sequence;
+    buffer->slot_dt[slot] = dt;
+
+    if ( sequence + 1 > buffer->end_sequence )
+    {
+        buffer->end_sequence = sequence + 1;
+    }
+
+    return result;
+}
+
+/*
+    Release the input due this tick. The dt to add to the player is written to *dt, and the return value is a mask
+    of JITTER_BUFFER_RELEASED etc. A player that returns JITTER_BUFFER_WENT_IDLE must be removed from the active list.
+*/
+
+static int jitter_buffer_release( struct jitter_buffer_set_t * set, int index, uint64_t * dt )
+{
+    assert( index >= 0 && index < set->capacity );
+
+    struct jitter_buffer_t * buffer = set->buffers + index;
+
+    assert( buffer->state != JITTER_BUFFER_IDLE );
+
+    uint64_t depth = jitter_buffer_depth( buffer );
+
+    int result = 0;
+
+    int64_t total = (int64_t) buffer->carry_dt + buffer->correction_dt;
+    buffer->carry_dt = 0;
+    buffer->correction_dt = 0;
+
+    if ( buffer->state == JITTER_BUFFER_BUFFERING && ( depth >= JITTER_BUFFER_TARGET_DEPTH || ( depth > 0 && ++buffer->buffering_ticks >= JITTER_BUFFER_MAX_BUFFERING_TICKS ) ) )
+    {
+        buffer->state = JITTER_BUFFER_PLAYING;
+    }
+
+    if ( buffer->state == JITTER_BUFFER_PLAYING )
+    {
+        const int count = depth > JITTER_BUFFER_MAX_DEPTH ? 2 : 1;
+
+        for ( int i = 0; i < count; i++ )
+        {
+            const int slot = buffer->next_sequence & ( JITTER_BUFFER_SIZE - 1 );
+
+            if ( buffer->slot_state[slot] == JITTER_BUFFER_SLOT_QUEUED && buffer->slot_sequence[slot] == buffer->next_sequence )
+            {
+                total += buffer->slot_dt[slot];
+                buffer->last_dt = buffer->slot_dt[slot];
+                buffer->slot_state[slot] = JITTER_BUFFER_SLOT_EMPTY;
+                buffer->num_duplicates = 0;
+                buffer->next_sequence++;
+                result |= ( result & JITTER_BUFFER_RELEASED ) ? JITTER_BUFFER_MERGED : JITTER_BUFFER_RELEASED;
+                continue;
+            }
+
+            // under-run
+
+            if ( set->policy == JITTER_BUFFER_POLICY_DUPLICATE && buffer->num_duplicates < JITTER_BUFFER_MAX_DUPLICATES )
+            {
+                total += buffer->last_dt;
+                buffer->slot_state[slot] = JITTER_BUFFER_SLOT_DUPLICATED;
+                buffer->slot_sequence[slot] = buffer->next_sequence;
+                buffer->slot_dt[slot] = buffer->last_dt;
+                buffer->num_duplicates++;
+                buffer->next_sequence++;
+                if ( buffer->end_sequence < buffer->next_sequence )
+                {
+                    buffer->end_sequence = buffer->next_sequence;
+                }
+                result |= JITTER_BUFFER_DUPLICATED;
+                break;
+            }
+
+            if ( buffer->next_sequence < buffer->end_sequence )
+            {
+                // later inputs are waiting behind a lost one, and it's not being duplicated. skip it, and release on the next tick
+
+                buffer->slot_state[slot] = JITTER_BUFFER_SLOT_EMPTY;
+                buffer->next_sequence++;
+                result |= JITTER_BUFFER_SKIPPED;
+                break;
+            }
+
+            buffer->state = JITTER_BUFFER_BUFFERING;
+            buffer->buffering_ticks = 0;
+            break;
+        }
+    }
+
+    // a negative correction larger than this tick's dt is carried until it can be paid
+
+    if ( total < 0 )
+    {
+        buffer->correction_dt = total;
+        total = 0;
+    }
+
+    *dt = (uint64_t) total;
+
+    if ( buffer->state == JITTER_BUFFER_BUFFERING && jitter_buffer_depth( buffer ) == 0 )
+    {
+        buffer->correction_dt = 0;
+        buffer->state = JITTER_BUFFER_IDLE;
+        result |= JITTER_BUFFER_WENT_IDLE;
+    }
+
+    return result;
+}
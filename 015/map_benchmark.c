@@ -0,0 +1,246 @@
+/*
+    Microbenchmark for the player session lookup (map.h vs. session_table.h)
+
+    Set is a join. session_table.h runs with its slab on malloc'd 4KB pages, then on huge pages as the server has it.
+    dTLB read misses for set and get come from perf_event_open, and print n/a where the CPU doesn't expose them.
+
+    USAGE:
+
+        make map_benchmark && ./map_benchmark
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/types.h>
+#include "shared.h"
+#include "map.h"
+#include "session_table.h"
+
+#define NUM_LOOKUPS                                                                  10000000
+
+static double platform_time()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+    return ts.tv_sec + ( (double) ( ts.tv_nsec ) ) / 1000000000.0;
+}
+
+static uint64_t random_uint64()
+{
+    uint64_t value = 0;
+    for ( int i = 0; i < 4; i++ )
+    {
+        value = ( value << 16 ) | ( rand() & 0xFFFF );
+    }
+    return value;
+}
+
+static int dtlb_miss_fd = -1;
+
+static void dtlb_counter_open()
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 );
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    dtlb_miss_fd = (int) syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+static void dtlb_counter_start()
+{
+    if ( dtlb_miss_fd < 0 )
+        return;
+    ioctl( dtlb_miss_fd, PERF_EVENT_IOC_RESET, 0 );
+    ioctl( dtlb_miss_fd, PERF_EVENT_IOC_ENABLE, 0 );
+}
+
+static void dtlb_counter_stop( char * buffer, size_t size )
+{
+    uint64_t value = 0;
+    if ( dtlb_miss_fd < 0 )
+    {
+        snprintf( buffer, size, "n/a" );
+        return;
+    }
+    ioctl( dtlb_miss_fd, PERF_EVENT_IOC_DISABLE, 0 );
+    if ( read( dtlb_miss_fd, &value, sizeof(value) ) != sizeof(value) )
+    {
+        snprintf( buffer, size, "n/a" );
+        return;
+    }
+    snprintf( buffer, size, "%" PRId64, value );
+}
+
+static void benchmark( int num_players )
+{
+    uint64_t * session_ids = (uint64_t*) malloc( sizeof(uint64_t) * num_players );
+    for ( int i = 0; i < num_players; i++ )
+    {
+        session_ids[i] = random_uint64();
+    }
+
+    uint32_t * lookups = (uint32_t*) malloc( sizeof(uint32_t) * NUM_LOOKUPS );
+    for ( int i = 0; i < NUM_LOOKUPS; i++ )
+    {
+        lookups[i] = rand() % num_players;
+    }
+
+    // map.h
+
+    {
+        struct map_t * map = map_create();
+
+        int failed = 0;
+
+        char set_dtlb_misses[32];
+        char get_dtlb_misses[32];
+
+        dtlb_counter_start();
+
+        double start = platform_time();
+
+        for ( int i = 0; i < num_players; i++ )
+        {
+            struct player_state * state = malloc( sizeof(struct player_state) );
+            memset( state, 0, sizeof(struct player_state) );
+            if ( !map_set( map, session_ids[i], state ) )
+            {
+                free( state );
+                failed++;
+            }
+        }
+
+        double set_time = platform_time() - start;
+
+        dtlb_counter_stop( set_dtlb_misses, sizeof(set_dtlb_misses) );
+
+        uint64_t found = 0;
+
+        dtlb_counter_start();
+
+        start = platform_time();
+
+        for ( int i = 0; i < NUM_LOOKUPS; i++ )
+        {
+            struct player_state * state = map_get( map, session_ids[lookups[i]] );
+            if ( state )
+            {
+                state->t += 1;
+                found++;
+            }
+        }
+
+        double get_time = platform_time() - start;
+
+        dtlb_counter_stop( get_dtlb_misses, sizeof(get_dtlb_misses) );
+
+        printf( "map.h                  %6d players: set %7.1f ns, get %7.1f ns, set failed %d, found %" PRId64 "/%d, dTLB misses set %s get %s\n",
+            num_players, set_time * 1000000000.0 / num_players, get_time * 1000000000.0 / NUM_LOOKUPS, failed, found, NUM_LOOKUPS, set_dtlb_misses, get_dtlb_misses );
+
+        map_destroy( map );
+    }
+
+    // session_table.h, with the slab on malloc'd 4KB pages then on huge pages
+
+    for ( int huge_pages = 0; huge_pages <= 1; huge_pages++ )
+    {
+        struct session_table_t * table = session_table_create_with_pages( num_players, huge_pages );
+
+        int failed = 0;
+
+        char set_dtlb_misses[32];
+        char get_dtlb_misses[32];
+
+        dtlb_counter_start();
+
+        double start = platform_time();
+
+        for ( int i = 0; i < num_players; i++ )
+        {
+            if ( !session_table_insert( table, session_ids[i] ) )
+            {
+                failed++;
+            }
+        }
+
+        double set_time = platform_time() - start;
+
+        dtlb_counter_stop( set_dtlb_misses, sizeof(set_dtlb_misses) );
+
+        uint64_t found = 0;
+
+        dtlb_counter_start();
+
+        start = platform_time();
+
+        for ( int i = 0; i < NUM_LOOKUPS; i++ )
+        {
+            struct player_state * state = session_table_get( table, session_ids[lookups[i]] );
+            if ( state )
+            {
+                state->t += 1;
+                found++;
+            }
+        }
+
+        double get_time = platform_time() - start;
+
+        dtlb_counter_stop( get_dtlb_misses, sizeof(get_dtlb_misses) );
+
+        start = platform_time();
+
+        for ( int i = 0; i < num_players; i++ )
+        {
+            session_table_delete( table, session_ids[i] );
+        }
+
+        double delete_time = platform_time() - start;
+
+        char name[64];
+        snprintf( name, sizeof(name), "session_table (%s)", huge_pages ? "huge" : "4KB" );
+
+        printf( "%-22s %6d players: set %7.1f ns, get %7.1f ns, set failed %d, found %" PRId64 "/%d, delete %.1f ns, dTLB misses set %s get %s [%s]\n",
+            name, num_players, set_time * 1000000000.0 / num_players, get_time * 1000000000.0 / NUM_LOOKUPS, failed, found, NUM_LOOKUPS, delete_time * 1000000000.0 / num_players,
+            set_dtlb_misses, get_dtlb_misses, session_table_pages_name( table->slab_pages ) );
+
+        assert( table->size == 0 );
+
+        session_table_destroy( table );
+    }
+
+    free( session_ids );
+    free( lookups );
+}
+
+int main()
+{
+    dtlb_counter_open();
+
+    if ( dtlb_miss_fd < 0 )
+    {
+        printf( "note: perf_event_open failed, dTLB misses are not available\n" );
+    }
+
+    srand( (unsigned int) time( NULL ) );
+
+    benchmark( 500 );
+    benchmark( 6000 );
+    benchmark( 100000 );
+
+    return 0;
+}
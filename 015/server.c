@@ -19,14 +19,19 @@
 #include <bpf/libbpf.h>
 #include <xdp/libxdp.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <x86intrin.h>
 #include "shared.h"
-#include "map.h"
+#include "session_table.h"
+#include "metrics.h"
+#include "simulation.h"
+#include "jitter_buffer.h"
 
 struct bpf_t
 {
@@ -40,16 +45,782 @@ struct bpf_t
     int input_buffer_inner_fd[MAX_CPUS];
     int player_state_outer_fd;
     int player_state_inner_fd[MAX_CPUS];
+    int player_state_cold_fd;
     struct ring_buffer * input_buffer[MAX_CPUS];
     int ring_buffer_cpus[MAX_CPUS];
+#if PLAYER_STATE_ARENA
+    int session_map_fd;
+    int player_state_arena_fd;
+    struct player_state_slot * player_state_arena;
+    int player_state_free_list_fd;
+    struct player_state_free_list * player_state_free_list;
+#endif // #if PLAYER_STATE_ARENA
 };
 
 static struct bpf_t bpf;
 
-static uint64_t inputs_processed[MAX_CPUS];
-static uint64_t inputs_lost[MAX_CPUS];
+#define COUNTER_INPUTS_PROCESSED                                                            0
+#define COUNTER_INPUTS_LOST                                                                 1
+#define COUNTER_PLAYER_STATE_SYSCALLS                                                       2
+#define COUNTER_INPUT_BATCHES                                                               3
+#define COUNTER_INPUT_BATCH_INPUTS                                                          4
+#define COUNTER_INPUT_BATCH_CYCLES                                                          5
+#define COUNTER_SPIN_ITERATIONS                                                             6
+#define COUNTER_EMPTY_POLLS                                                                 7
+#define COUNTER_SLEEPS                                                                      8
+#define COUNTER_TICKS                                                                       9
+#define COUNTER_TICK_DEADLINE_MISSES                                                       10
+#define COUNTER_JITTER_BUFFER_MERGES                                                       11
+#define COUNTER_JITTER_BUFFER_DUPLICATES                                                   12
+#define COUNTER_JITTER_BUFFER_SKIPS                                                        13
+#define COUNTER_JITTER_BUFFER_LATE_INPUTS                                                  14
+#define COUNTER_JITTER_BUFFER_RECONCILED_INPUTS                                            15
+#define COUNTER_SESSIONS_EXPIRED                                                           16
+#define COUNTER_SESSION_TABLE_FULL                                                         17          // inputs dropped because a new player didn't fit
+
+#define GAUGE_SESSIONS                                                                      0
+#define GAUGE_DIRTY_PLAYER_STATE                                                            1
+#define GAUGE_JITTER_BUFFER_PLAYERS                                                         2
+#define GAUGE_JITTER_BUFFER_DEPTH                                                           3          // summed over players
+
+#define HISTOGRAM_INPUTS_PER_POLL                                                           0
+#define HISTOGRAM_TICK_DURATION                                                             1          // microseconds
+#define HISTOGRAM_JITTER_BUFFER_DEPTH                                                       2          // per-player, per-tick
+#define HISTOGRAM_JOIN_LATENCY                                                              3          // nanoseconds
+
+static struct metrics_t worker_metrics[MAX_CPUS];
+
+static struct session_table_t * cpu_session_table[MAX_CPUS];
+
+#if !PLAYER_STATE_ARENA
+static struct player_state_hot * cpu_player_state_hot[MAX_CPUS];              // by slab index. the slab holds the cold section
+#endif // #if !PLAYER_STATE_ARENA
+
+static int player_state_commit_interval_ms;
+
+double platform_time();
 
-static struct map_t * cpu_player_map[MAX_CPUS];
+/*
+    How the worker threads wait for input.
+
+    epoll blocks in ring_buffer__poll until XDP wakes the thread, so it's cheap on CPU but every wakeup costs latency.
+    spin calls ring_buffer__consume in a loop and never sleeps. adaptive spins while input is arriving, and goes back
+    to epoll once nothing has arrived for the idle budget, so a busy worker pays for CPU, not wakeups, and an idle
+    one pays for nothing.
+*/
+
+#define WORKER_POLL_EPOLL                                                                   0
+#define WORKER_POLL_SPIN                                                                    1
+#define WORKER_POLL_ADAPTIVE                                                                2
+
+#define WORKER_IDLE_BUDGET_US                                                              50          // default, override on the server command line
+
+static int worker_poll_mode = WORKER_POLL_EPOLL;
+
+static int worker_idle_budget_us = WORKER_IDLE_BUDGET_US;
+
+#define INPUT_BATCH                                                                         0
+
+#define INPUT_BATCH_SIZE                                                                   64
+
+#define SIMULATION_SOA                                                                      0           // step batched inputs with the simulation.h kernels. needs INPUT_BATCH
+
+#define TICK_SCHEDULER                                                                      0           // queue inputs per-player and simulate them all once per-tick, instead of per-input
+
+#define TICK_RATE                                                                         100           // HZ
+
+#define JITTER_BUFFER                                                                       0           // release each player's inputs one per-tick through jitter_buffer.h. needs TICK_SCHEDULER
+
+#define JITTER_BUFFER_POLICY                                           JITTER_BUFFER_POLICY_DUPLICATE           // on under-run. or JITTER_BUFFER_POLICY_HOLD
+
+#if SIMULATION_SOA && ( !INPUT_BATCH || PLAYER_STATE_ARENA )
+#error "SIMULATION_SOA needs INPUT_BATCH, and does not support PLAYER_STATE_ARENA"
+#endif // #if SIMULATION_SOA && ( !INPUT_BATCH || PLAYER_STATE_ARENA )
+
+#if PLAYER_STATE_ARENA && PLAYER_STATE_FREE_LIST_SIZE < PLAYERS_PER_CPU
+#error "PLAYER_STATE_FREE_LIST_SIZE must hold every slot on a cpu"
+#endif // #if PLAYER_STATE_ARENA && PLAYER_STATE_FREE_LIST_SIZE < PLAYERS_PER_CPU
+
+#if TICK_SCHEDULER && ( INPUT_BATCH || PLAYER_STATE_ARENA )
+#error "TICK_SCHEDULER replaces INPUT_BATCH, and does not support PLAYER_STATE_ARENA"
+#endif // #if TICK_SCHEDULER && ( INPUT_BATCH || PLAYER_STATE_ARENA )
+
+#if JITTER_BUFFER && !TICK_SCHEDULER
+#error "JITTER_BUFFER needs TICK_SCHEDULER"
+#endif // #if JITTER_BUFFER && !TICK_SCHEDULER
+
+#if SIMULATION_SOA || TICK_SCHEDULER
+static struct simulation_t * cpu_simulation[MAX_CPUS];
+#endif // #if SIMULATION_SOA || TICK_SCHEDULER
+
+#if JITTER_BUFFER
+static struct jitter_buffer_set_t * cpu_jitter_buffer[MAX_CPUS];
+#endif // #if JITTER_BUFFER
+
+#if PLAYER_STATE_ARENA
+#define INPUT_RECORD_SIZE               ( 8 + sizeof(struct input_header) + sizeof(struct input_data) )
+#else // #if PLAYER_STATE_ARENA
+#define INPUT_RECORD_SIZE                   ( sizeof(struct input_header) + sizeof(struct input_data) )
+#endif // #if PLAYER_STATE_ARENA
+
+static int simulate_player( struct player_state_hot * hot, struct player_state * state, struct input_data * input )
+{
+    // the hot section every input, the cold section only when it changes. returns true if it did
+
+    const uint64_t previous_t = hot->t;
+
+    hot->t += input->dt;
+
+    for ( int i = 0; i < PLAYER_STATE_HOT_SIZE; i++ )
+    {
+        hot->data[i] = (uint8_t) hot->t + (uint8_t) i;
+    }
+
+    if ( !player_state_cold_changed( previous_t, hot->t ) )
+        return 0;
+
+    player_state_pack_cold( state, hot->t );
+
+    return 1;
+}
+
+/*
+    Players that stop sending input are removed after PLAYER_TIMEOUT seconds, like PlayerTimeout in the Go worker, so
+    their slab index (or arena slot) goes back on the free list for the next player to join.
+
+    Nothing is tracked per-input. Once per-second the worker compares each player's t with the t it saw the second
+    before, and a player whose t hasn't moved, with no input waiting to be simulated, has been idle another second.
+*/
+
+#define PLAYER_TIMEOUT                                                                     15          // seconds
+
+struct session_expiry_t
+{
+    double next_check_time;
+    uint64_t * last_t;                                                  // by slab index, or slot on this cpu
+    uint8_t * idle_seconds;
+    uint64_t * expired_session_id;
+};
+
+static struct session_expiry_t * session_expiry[MAX_CPUS];
+
+struct session_expiry_t * session_expiry_create( int capacity )
+{
+    struct session_expiry_t * expiry = (struct session_expiry_t*) malloc( sizeof(struct session_expiry_t) );
+    assert( expiry );
+    memset( expiry, 0, sizeof(struct session_expiry_t) );
+    expiry->last_t = (uint64_t*) malloc( sizeof(uint64_t) * capacity );
+    expiry->idle_seconds = (uint8_t*) malloc( capacity );
+    expiry->expired_session_id = (uint64_t*) malloc( sizeof(uint64_t) * capacity );
+    assert( expiry->last_t );
+    assert( expiry->idle_seconds );
+    assert( expiry->expired_session_id );
+    memset( expiry->last_t, 0, sizeof(uint64_t) * capacity );
+    memset( expiry->idle_seconds, 0, capacity );
+    return expiry;
+}
+
+#if PLAYER_STATE_ARENA
+
+static void prefetch_player_state( void * state, int bytes )
+{
+    // the hot section of a slot starts after its session id and version, so prefetch every line the range touches
+
+    uintptr_t end = (uintptr_t) state + bytes;
+    for ( uintptr_t line = (uintptr_t) state & ~(uintptr_t) 63; line < end; line += 64 )
+    {
+        __builtin_prefetch( (void*) line, 1 );
+    }
+}
+
+static struct player_state_slot * find_player_state_slot( uint64_t player_state_index )
+{
+    if ( player_state_index >= MAX_CPUS * PLAYERS_PER_CPU )
+    {
+        printf( "error: player state index out of range: %" PRId64 "\n", player_state_index );
+        return NULL;
+    }
+
+    return bpf.player_state_arena + player_state_index;
+}
+
+static void update_player_state_slot( struct player_state_slot * slot, struct input_header * header, struct input_data * input )
+{
+    // xdp writes the session id when it hands out the slot. an input queued before the slot was released is dropped
+
+    if ( slot->session_id != header->session_id )
+        return;
+
+    // write the player state in place. xdp reads it directly from the arena, so no syscall is required
+
+    __atomic_store_n( &slot->version, slot->version + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+
+    // the arena keeps the whole player state in the slot, so the hot section is just the front of it
+
+    if ( simulate_player( (struct player_state_hot*) &slot->state, &slot->state, input ) )
+    {
+        slot->cold_version = slot->state.t;
+    }
+
+    __atomic_store_n( &slot->version, slot->version + 1, __ATOMIC_RELEASE );
+}
+
+static void release_player_state_slot( int cpu, uint32_t player_state_index )
+{
+    struct player_state_slot * slot = bpf.player_state_arena + player_state_index;
+
+    // delete the session first, so a join can't find it pointing at the slot after it's handed out again
+
+    uint64_t session_id = slot->session_id;
+    bpf_map_delete_elem( bpf.session_map_fd, &session_id );
+
+    __atomic_store_n( &slot->version, slot->version + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    slot->session_id = 0;
+    memset( &slot->state, 0, sizeof(struct player_state) );
+    slot->cold_version = 0;
+    __atomic_store_n( &slot->version, slot->version + 1, __ATOMIC_RELEASE );
+
+    struct player_state_free_list * free_list = bpf.player_state_free_list + cpu;
+    free_list->slot[free_list->tail & ( PLAYER_STATE_FREE_LIST_SIZE - 1 )] = player_state_index;
+    __atomic_store_n( &free_list->tail, free_list->tail + 1, __ATOMIC_RELEASE );
+
+    metrics_add( &worker_metrics[cpu], COUNTER_SESSIONS_EXPIRED, 1 );
+}
+
+static void expire_players( int cpu )
+{
+    // the session map is an LRU, so a session can also disappear without telling us. its slot times out the same way
+
+    struct session_expiry_t * expiry = session_expiry[cpu];
+
+    expiry->next_check_time = platform_time() + 1.0;
+
+    for ( int i = 0; i < PLAYERS_PER_CPU; i++ )
+    {
+        const uint32_t player_state_index = cpu * PLAYERS_PER_CPU + i;
+
+        const struct player_state_slot * slot = bpf.player_state_arena + player_state_index;
+        if ( __atomic_load_n( &slot->session_id, __ATOMIC_ACQUIRE ) == 0 )
+            continue;
+
+        const uint64_t t = slot->state.t;
+
+        if ( t != expiry->last_t[i] )
+        {
+            expiry->last_t[i] = t;
+            expiry->idle_seconds[i] = 0;
+            continue;
+        }
+
+        if ( ++expiry->idle_seconds[i] >= PLAYER_TIMEOUT )
+        {
+            release_player_state_slot( cpu, player_state_index );
+            expiry->last_t[i] = 0;
+            expiry->idle_seconds[i] = 0;
+        }
+    }
+}
+
+static int process_input( void * ctx, void * data, size_t data_sz )
+{
+    int cpu = *(int*) ctx;
+
+    uint64_t player_state_index = *(uint64_t*) data;
+
+    struct input_header * header = (struct input_header*) ( data + 8 );
+
+    struct input_data * input = (struct input_data*) ( data + 8 + sizeof(struct input_header) );
+
+    struct player_state_slot * slot = find_player_state_slot( player_state_index );
+    if ( !slot )
+    {
+        return 0;
+    }
+
+    update_player_state_slot( slot, header, input );
+
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUTS_PROCESSED, 1 );
+
+    return 0;
+}
+
+#else // #if PLAYER_STATE_ARENA
+
+static inline struct player_state_hot * find_player_state_hot( int cpu, struct player_state * state )
+{
+    return cpu_player_state_hot[cpu] + session_table_slab_index( cpu_session_table[cpu], state );
+}
+
+static struct player_state * find_player_state( int cpu, uint64_t session_id )
+{
+    struct player_state * state = session_table_get( cpu_session_table[cpu], session_id );
+    if ( !state )
+    {
+        // first player update
+        double join_start = platform_time();
+        state = session_table_insert( cpu_session_table[cpu], session_id );
+        if ( !state )
+        {
+            // printed once per-second by the main thread
+            metrics_add( &worker_metrics[cpu], COUNTER_SESSION_TABLE_FULL, 1 );
+            return NULL;
+        }
+        int slab_index = session_table_slab_index( cpu_session_table[cpu], state );
+        memset( cpu_player_state_hot[cpu] + slab_index, 0, sizeof(struct player_state_hot) );
+        session_expiry[cpu]->last_t[slab_index] = 0;
+        session_expiry[cpu]->idle_seconds[slab_index] = 0;
+#if SIMULATION_SOA || TICK_SCHEDULER
+        simulation_reset_player( cpu_simulation[cpu], slab_index );
+#endif // #if SIMULATION_SOA || TICK_SCHEDULER
+#if JITTER_BUFFER
+        jitter_buffer_reset_player( cpu_jitter_buffer[cpu], slab_index, session_id );
+#endif // #if JITTER_BUFFER
+        metrics_sample( &worker_metrics[cpu], HISTOGRAM_JOIN_LATENCY, (uint64_t) ( ( platform_time() - join_start ) * 1000000000.0 ) );
+    }
+    return state;
+}
+
+/*
+    With a commit interval, player state is not committed to the kernel per-input. Instead each session is
+    marked dirty, and once per-tick all dirty player state is pushed with a single bpf_map_update_batch.
+
+    The hot section goes to player_state_map on every commit. The cold section only goes to player_state_cold when
+    it changed, and before the hot section, so XDP never pairs a new t with an old cold section.
+*/
+
+#define PLAYER_STATE_COMMIT_BATCH_SIZE                                                   1024
+
+struct player_state_commit_t
+{
+    int num_dirty;
+    int32_t * dirty_index;                                              // slab index -> dirty entry, or -1
+    uint32_t slab_index[PLAYER_STATE_COMMIT_BATCH_SIZE];
+    uint64_t session_id[PLAYER_STATE_COMMIT_BATCH_SIZE];
+    struct player_state * state[PLAYER_STATE_COMMIT_BATCH_SIZE];
+    uint8_t cold_dirty[PLAYER_STATE_COMMIT_BATCH_SIZE];
+    struct player_state_hot values[PLAYER_STATE_COMMIT_BATCH_SIZE];
+    uint64_t cold_session_id[PLAYER_STATE_COMMIT_BATCH_SIZE];
+    struct player_state_cold cold_values[PLAYER_STATE_COMMIT_BATCH_SIZE];
+};
+
+static struct player_state_commit_t * player_state_commit[MAX_CPUS];
+
+struct player_state_commit_t * player_state_commit_create( int capacity )
+{
+    struct player_state_commit_t * commit = (struct player_state_commit_t*) malloc( sizeof(struct player_state_commit_t) );
+    assert( commit );
+    commit->num_dirty = 0;
+    commit->dirty_index = (int32_t*) malloc( sizeof(int32_t) * capacity );
+    assert( commit->dirty_index );
+    for ( int i = 0; i < capacity; i++ )
+    {
+        commit->dirty_index[i] = -1;
+    }
+    return commit;
+}
+
+static void flush_player_state( int cpu )
+{
+    struct player_state_commit_t * commit = player_state_commit[cpu];
+
+    if ( commit->num_dirty == 0 )
+        return;
+
+    uint32_t num_cold = 0;
+
+    for ( int i = 0; i < commit->num_dirty; i++ )
+    {
+        commit->values[i] = cpu_player_state_hot[cpu][commit->slab_index[i]];
+        commit->dirty_index[commit->slab_index[i]] = -1;
+        if ( commit->cold_dirty[i] )
+        {
+            commit->cold_session_id[num_cold] = commit->session_id[i];
+            commit->cold_values[num_cold].version = commit->values[i].t;
+            memcpy( commit->cold_values[num_cold].data, commit->state[i]->data + PLAYER_STATE_HOT_SIZE, PLAYER_STATE_COLD_SIZE );
+            num_cold++;
+        }
+    }
+
+    DECLARE_LIBBPF_OPTS( bpf_map_batch_opts, opts, .elem_flags = BPF_ANY );
+
+    uint32_t count = num_cold;
+
+    if ( num_cold > 0 )
+    {
+        int err = bpf_map_update_batch( bpf.player_state_cold_fd, commit->cold_session_id, commit->cold_values, &count, &opts );
+        if ( err != 0 )
+        {
+            printf( "error: failed to batch update cold player state (%d/%d): %s\n", count, num_cold, strerror(errno) );
+        }
+
+        metrics_add( &worker_metrics[cpu], COUNTER_PLAYER_STATE_SYSCALLS, 1 );
+    }
+
+    count = commit->num_dirty;
+
+    int err = bpf_map_update_batch( bpf.player_state_inner_fd[cpu], commit->session_id, commit->values, &count, &opts );
+    if ( err != 0 )
+    {
+        printf( "error: failed to batch update player state (%d/%d): %s\n", count, commit->num_dirty, strerror(errno) );
+    }
+
+    metrics_add( &worker_metrics[cpu], COUNTER_PLAYER_STATE_SYSCALLS, 1 );
+
+    commit->num_dirty = 0;
+}
+
+static int commit_player_state( int cpu, uint64_t session_id, struct player_state * state, int cold_changed )
+{
+    if ( player_state_commit_interval_ms == 0 )
+    {
+        if ( cold_changed )
+        {
+            struct player_state_cold cold;
+            cold.version = find_player_state_hot( cpu, state )->t;
+            memcpy( cold.data, state->data + PLAYER_STATE_HOT_SIZE, PLAYER_STATE_COLD_SIZE );
+
+            int err = bpf_map_update_elem( bpf.player_state_cold_fd, &session_id, &cold, BPF_ANY );
+
+            metrics_add( &worker_metrics[cpu], COUNTER_PLAYER_STATE_SYSCALLS, 1 );
+
+            if ( err != 0 )
+            {
+                printf( "error: failed to update cold player state: %s\n", strerror(errno) );
+                return 0;
+            }
+        }
+
+        int player_state_fd = bpf.player_state_inner_fd[cpu];
+
+        int err = bpf_map_update_elem( player_state_fd, &session_id, find_player_state_hot( cpu, state ), BPF_ANY );
+
+        metrics_add( &worker_metrics[cpu], COUNTER_PLAYER_STATE_SYSCALLS, 1 );
+
+        if ( err != 0 )
+        {
+            printf( "error: failed to update player state: %s\n", strerror(errno) );
+            return 0;
+        }
+
+        return 1;
+    }
+
+    struct player_state_commit_t * commit = player_state_commit[cpu];
+
+    int slab_index = session_table_slab_index( cpu_session_table[cpu], state );
+
+    if ( commit->dirty_index[slab_index] >= 0 )
+    {
+        commit->cold_dirty[commit->dirty_index[slab_index]] |= cold_changed;
+        return 1;
+    }
+
+    if ( commit->num_dirty == PLAYER_STATE_COMMIT_BATCH_SIZE )
+    {
+        flush_player_state( cpu );
+    }
+
+    int index = commit->num_dirty++;
+    commit->slab_index[index] = slab_index;
+    commit->session_id[index] = session_id;
+    commit->state[index] = state;
+    commit->cold_dirty[index] = cold_changed;
+    commit->dirty_index[slab_index] = index;
+
+    return 1;
+}
+
+// a deleted player must come off the dirty list, or the next flush would commit it again
+
+static void uncommit_player_state( int cpu, int slab_index )
+{
+    struct player_state_commit_t * commit = player_state_commit[cpu];
+
+    int index = commit->dirty_index[slab_index];
+    if ( index < 0 )
+        return;
+
+    int last = --commit->num_dirty;
+    if ( index != last )
+    {
+        commit->slab_index[index] = commit->slab_index[last];
+        commit->session_id[index] = commit->session_id[last];
+        commit->state[index] = commit->state[last];
+        commit->cold_dirty[index] = commit->cold_dirty[last];
+        commit->dirty_index[commit->slab_index[index]] = index;
+    }
+
+    commit->dirty_index[slab_index] = -1;
+}
+
+#if TICK_SCHEDULER
+
+/*
+    The ring buffer callback only queues input: its dt is added to the player in the simulation, and the player
+    goes on the pending list once per-tick. Every 1/TICK_RATE seconds, run_tick steps all pending players in one
+    pass, packs their player state and commits it, so the per-packet work is just a session lookup and an add.
+*/
+
+struct tick_scheduler_t
+{
+    double tick_interval;
+    double next_tick_time;
+    int num_pending;
+    int num_pending_inputs;
+    uint8_t * pending;                                                  // by slab index
+    uint32_t * pending_slab_index;
+    uint64_t * pending_session_id;
+};
+
+static struct tick_scheduler_t * tick_scheduler[MAX_CPUS];
+
+struct tick_scheduler_t * tick_scheduler_create( int capacity )
+{
+    struct tick_scheduler_t * scheduler = (struct tick_scheduler_t*) malloc( sizeof(struct tick_scheduler_t) );
+    assert( scheduler );
+    memset( scheduler, 0, sizeof(struct tick_scheduler_t) );
+    scheduler->tick_interval = 1.0 / TICK_RATE;
+    scheduler->pending = (uint8_t*) malloc( capacity );
+    scheduler->pending_slab_index = (uint32_t*) malloc( sizeof(uint32_t) * capacity );
+    scheduler->pending_session_id = (uint64_t*) malloc( sizeof(uint64_t) * capacity );
+    assert( scheduler->pending );
+    assert( scheduler->pending_slab_index );
+    assert( scheduler->pending_session_id );
+    memset( scheduler->pending, 0, capacity );
+    return scheduler;
+}
+
+static void schedule_player( struct tick_scheduler_t * scheduler, int slab_index, uint64_t session_id )
+{
+    if ( !scheduler->pending[slab_index] )
+    {
+        scheduler->pending[slab_index] = 1;
+        int index = scheduler->num_pending++;
+        scheduler->pending_slab_index[index] = slab_index;
+        scheduler->pending_session_id[index] = session_id;
+    }
+}
+
+static void queue_input( int cpu, struct input_header * header, struct player_state * state, struct input_data * input )
+{
+    struct tick_scheduler_t * scheduler = tick_scheduler[cpu];
+
+    int slab_index = session_table_slab_index( cpu_session_table[cpu], state );
+
+#if JITTER_BUFFER
+
+    // the input is simulated when the jitter buffer releases it, in run_tick
+
+    int result = jitter_buffer_push( cpu_jitter_buffer[cpu], slab_index, header->sequence, input->dt );
+    if ( result == JITTER_BUFFER_PUSH_LATE )
+    {
+        metrics_add( &worker_metrics[cpu], COUNTER_JITTER_BUFFER_LATE_INPUTS, 1 );
+        return;
+    }
+    if ( result == JITTER_BUFFER_PUSH_RECONCILED )
+    {
+        metrics_add( &worker_metrics[cpu], COUNTER_JITTER_BUFFER_RECONCILED_INPUTS, 1 );
+    }
+    if ( result == JITTER_BUFFER_PUSH_OVERFLOW )
+    {
+        metrics_add( &worker_metrics[cpu], COUNTER_JITTER_BUFFER_MERGES, 1 );
+    }
+
+    scheduler->num_pending_inputs++;
+
+#else // #if JITTER_BUFFER
+
+    simulation_add_input( cpu_simulation[cpu], slab_index, input->dt );
+
+    scheduler->num_pending_inputs++;
+
+    schedule_player( scheduler, slab_index, header->session_id );
+
+#endif // #if JITTER_BUFFER
+}
+
+#if JITTER_BUFFER
+
+// release the input due this tick for every buffering or playing player, and put the ones that moved on the pending list
+
+static void release_inputs( int cpu )
+{
+    struct tick_scheduler_t * scheduler = tick_scheduler[cpu];
+
+    struct jitter_buffer_set_t * set = cpu_jitter_buffer[cpu];
+
+    uint64_t total_depth = 0;
+
+    int i = 0;
+    while ( i < set->num_active )
+    {
+        uint32_t slab_index = set->active_slab_index[i];
+        struct jitter_buffer_t * buffer = set->buffers + slab_index;
+
+        uint64_t depth = jitter_buffer_depth( buffer );
+        metrics_sample( &worker_metrics[cpu], HISTOGRAM_JITTER_BUFFER_DEPTH, depth );
+        total_depth += depth;
+
+        uint64_t dt = 0;
+        int result = jitter_buffer_release( set, slab_index, &dt );
+
+        if ( dt > 0 || ( result & ( JITTER_BUFFER_RELEASED | JITTER_BUFFER_DUPLICATED ) ) )
+        {
+            simulation_add_input( cpu_simulation[cpu], slab_index, dt );
+            schedule_player( scheduler, slab_index, buffer->session_id );
+        }
+
+        if ( result & JITTER_BUFFER_MERGED )
+        {
+            metrics_add( &worker_metrics[cpu], COUNTER_JITTER_BUFFER_MERGES, 1 );
+        }
+        if ( result & JITTER_BUFFER_DUPLICATED )
+        {
+            metrics_add( &worker_metrics[cpu], COUNTER_JITTER_BUFFER_DUPLICATES, 1 );
+        }
+        if ( result & JITTER_BUFFER_SKIPPED )
+        {
+            metrics_add( &worker_metrics[cpu], COUNTER_JITTER_BUFFER_SKIPS, 1 );
+        }
+
+        if ( result & JITTER_BUFFER_WENT_IDLE )
+        {
+            set->active_slab_index[i] = set->active_slab_index[--set->num_active];
+            continue;
+        }
+
+        i++;
+    }
+
+    metrics_set( &worker_metrics[cpu], GAUGE_JITTER_BUFFER_PLAYERS, set->num_active );
+    metrics_set( &worker_metrics[cpu], GAUGE_JITTER_BUFFER_DEPTH, total_depth );
+}
+
+#endif // #if JITTER_BUFFER
+
+static void run_tick( int cpu )
+{
+    struct tick_scheduler_t * scheduler = tick_scheduler[cpu];
+
+    struct simulation_t * simulation = cpu_simulation[cpu];
+
+    double start = platform_time();
+
+#if JITTER_BUFFER
+    release_inputs( cpu );
+#endif // #if JITTER_BUFFER
+
+    simulation_step( simulation );
+
+    for ( int i = 0; i < scheduler->num_pending; i++ )
+    {
+        uint32_t slab_index = scheduler->pending_slab_index[i];
+        struct player_state * state = cpu_session_table[cpu]->slab + slab_index;
+        int cold_changed = simulation_pack( simulation, slab_index, cpu_player_state_hot[cpu] + slab_index, state );
+        commit_player_state( cpu, scheduler->pending_session_id[i], state, cold_changed );
+        scheduler->pending[slab_index] = 0;
+    }
+
+    double finish = platform_time();
+
+    metrics_add( &worker_metrics[cpu], COUNTER_TICKS, 1 );
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUTS_PROCESSED, scheduler->num_pending_inputs );
+    metrics_sample( &worker_metrics[cpu], HISTOGRAM_TICK_DURATION, (uint64_t) ( ( finish - start ) * 1000000.0 ) );
+
+    scheduler->num_pending = 0;
+    scheduler->num_pending_inputs = 0;
+
+    // ticks stay on a fixed grid. every tick that was due before this one finished is missed, and skipped
+
+    scheduler->next_tick_time += scheduler->tick_interval;
+    while ( scheduler->next_tick_time <= finish )
+    {
+        scheduler->next_tick_time += scheduler->tick_interval;
+        metrics_add( &worker_metrics[cpu], COUNTER_TICK_DEADLINE_MISSES, 1 );
+    }
+}
+
+#endif // #if TICK_SCHEDULER
+
+static void delete_player( int cpu, uint64_t session_id )
+{
+    struct session_table_t * table = cpu_session_table[cpu];
+
+    struct player_state * state = session_table_get( table, session_id );
+    if ( !state )
+        return;
+
+    int slab_index = session_table_slab_index( table, state );
+
+    uncommit_player_state( cpu, slab_index );
+
+#if SIMULATION_SOA || TICK_SCHEDULER
+    simulation_reset_player( cpu_simulation[cpu], slab_index );
+#endif // #if SIMULATION_SOA || TICK_SCHEDULER
+#if JITTER_BUFFER
+    jitter_buffer_reset_player( cpu_jitter_buffer[cpu], slab_index, 0 );
+#endif // #if JITTER_BUFFER
+
+    session_table_delete( table, session_id );
+
+    // so XDP stops replying with the old player state if the client comes back
+
+    bpf_map_delete_elem( bpf.player_state_inner_fd[cpu], &session_id );
+    bpf_map_delete_elem( bpf.player_state_cold_fd, &session_id );
+
+    metrics_add( &worker_metrics[cpu], COUNTER_SESSIONS_EXPIRED, 1 );
+}
+
+static void expire_players( int cpu )
+{
+    struct session_table_t * table = cpu_session_table[cpu];
+
+    struct session_expiry_t * expiry = session_expiry[cpu];
+
+    expiry->next_check_time = platform_time() + 1.0;
+
+    // collect first. deleting shifts entries back, so the scan would miss some
+
+    int num_expired = 0;
+
+    for ( uint64_t i = 0; i <= table->mask; i++ )
+    {
+        const struct session_table_entry_t * entry = table->entries + i;
+        if ( entry->distance == 0 )
+            continue;
+
+        const uint32_t slab_index = entry->slab_index;
+
+        bool queued = false;
+#if TICK_SCHEDULER
+        queued |= tick_scheduler[cpu]->pending[slab_index] != 0;
+#endif // #if TICK_SCHEDULER
+#if JITTER_BUFFER
+        queued |= cpu_jitter_buffer[cpu]->buffers[slab_index].state != JITTER_BUFFER_IDLE;
+#endif // #if JITTER_BUFFER
+
+        const uint64_t t = cpu_player_state_hot[cpu][slab_index].t;
+
+        if ( t != expiry->last_t[slab_index] || queued )
+        {
+            expiry->last_t[slab_index] = t;
+            expiry->idle_seconds[slab_index] = 0;
+            continue;
+        }
+
+        if ( ++expiry->idle_seconds[slab_index] >= PLAYER_TIMEOUT )
+        {
+            expiry->expired_session_id[num_expired++] = entry->session_id;
+        }
+    }
+
+    for ( int i = 0; i < num_expired; i++ )
+    {
+        delete_player( cpu, expiry->expired_session_id[i] );
+    }
+}
 
 static int process_input( void * ctx, void * data, size_t data_sz )
 {
@@ -57,39 +828,198 @@ static int process_input( void * ctx, void * data, size_t data_sz )
 
     struct input_header * header = (struct input_header*) data;
 
-    struct input_data * input = (struct input_data*) data + sizeof(struct input_header);
+    struct input_data * input = (struct input_data*) ( data + sizeof(struct input_header) );
 
-    struct player_state * state = map_get( cpu_player_map[cpu], header->session_id );
+    struct player_state * state = find_player_state( cpu, header->session_id );
     if ( !state )
     {
-        // first player update
-        state = malloc( sizeof(struct player_state) );
-        map_set( cpu_player_map[cpu], header->session_id, state );
+        return 0;
     }
 
+#if TICK_SCHEDULER
+
+    queue_input( cpu, header, state, input );
+
+    return 0;
+
+#endif // #if TICK_SCHEDULER
+
     // todo: handle multiple inputs
 
-    state->t += input->dt;
+    int cold_changed = simulate_player( find_player_state_hot( cpu, state ), state, input );
 
-    for ( int i = 0; i < PLAYER_STATE_SIZE; i++ )
+    if ( !commit_player_state( cpu, header->session_id, state, cold_changed ) )
     {
-        state->data[i] = (uint8_t) state->t + (uint8_t) i;
+        return 0;
     }
 
-    int player_state_fd = bpf.player_state_inner_fd[cpu];
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUTS_PROCESSED, 1 );
 
-    int err = bpf_map_update_elem( player_state_fd, &header->session_id, state, BPF_ANY );
-    if ( err != 0 )
+    return 0;
+}
+
+#endif // #if PLAYER_STATE_ARENA
+
+#if INPUT_BATCH
+
+/*
+    Batch mode drains up to INPUT_BATCH_SIZE records from the ring buffer into a local array, then prefetches
+    the player state for the whole batch before simulating any of it, so the DRAM latency of each random
+    player state access overlaps with the others instead of being paid one input at a time.
+*/
+
+struct input_batch_t
+{
+    int num_inputs;
+    uint8_t records[INPUT_BATCH_SIZE][INPUT_RECORD_SIZE];
+    void * state[INPUT_BATCH_SIZE];
+};
+
+static struct input_batch_t input_batch[MAX_CPUS];
+
+static void process_input_batch( int cpu )
+{
+    struct input_batch_t * batch = &input_batch[cpu];
+
+    if ( batch->num_inputs == 0 )
+        return;
+
+    uint64_t start = __rdtsc();
+
+    int processed = 0;
+
+#if PLAYER_STATE_ARENA
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        uint64_t player_state_index = *(uint64_t*) batch->records[i];
+        struct player_state_slot * slot = find_player_state_slot( player_state_index );
+        if ( slot )
+        {
+            prefetch_player_state( slot, 8 + 8 + 8 + PLAYER_STATE_HOT_SIZE );                  // session id, version, t and the hot section
+        }
+        batch->state[i] = slot;
+    }
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        struct player_state_slot * slot = (struct player_state_slot*) batch->state[i];
+        if ( !slot )
+            continue;
+        struct input_header * header = (struct input_header*) ( batch->records[i] + 8 );
+        struct input_data * input = (struct input_data*) ( batch->records[i] + 8 + sizeof(struct input_header) );
+        update_player_state_slot( slot, header, input );
+        processed++;
+    }
+
+#else // #if PLAYER_STATE_ARENA
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        struct input_header * header = (struct input_header*) batch->records[i];
+        session_table_prefetch( cpu_session_table[cpu], header->session_id );
+    }
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        struct input_header * header = (struct input_header*) batch->records[i];
+        struct player_state * state = find_player_state( cpu, header->session_id );
+        if ( state )
+        {
+            __builtin_prefetch( find_player_state_hot( cpu, state ), 1 );
+        }
+        batch->state[i] = state;
+    }
+
+#if SIMULATION_SOA
+
+    // accumulate the whole batch, step the blocks it touched, then pack the wire format player state for the commit
+
+    struct simulation_t * simulation = cpu_simulation[cpu];
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        struct player_state * state = (struct player_state*) batch->state[i];
+        if ( !state )
+            continue;
+        struct input_data * input = (struct input_data*) ( batch->records[i] + sizeof(struct input_header) );
+        simulation_add_input( simulation, session_table_slab_index( cpu_session_table[cpu], state ), input->dt );
+    }
+
+    simulation_step( simulation );
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        struct player_state * state = (struct player_state*) batch->state[i];
+        if ( !state )
+            continue;
+        struct input_header * header = (struct input_header*) batch->records[i];
+        int slab_index = session_table_slab_index( cpu_session_table[cpu], state );
+        int cold_changed = simulation_pack( simulation, slab_index, cpu_player_state_hot[cpu] + slab_index, state );
+        if ( commit_player_state( cpu, header->session_id, state, cold_changed ) )
+        {
+            processed++;
+        }
+    }
+
+#else // #if SIMULATION_SOA
+
+    for ( int i = 0; i < batch->num_inputs; i++ )
+    {
+        struct player_state * state = (struct player_state*) batch->state[i];
+        if ( !state )
+            continue;
+        struct input_header * header = (struct input_header*) batch->records[i];
+        struct input_data * input = (struct input_data*) ( batch->records[i] + sizeof(struct input_header) );
+        int cold_changed = simulate_player( find_player_state_hot( cpu, state ), state, input );
+        if ( commit_player_state( cpu, header->session_id, state, cold_changed ) )
+        {
+            processed++;
+        }
+    }
+
+#endif // #if SIMULATION_SOA
+
+#endif // #if PLAYER_STATE_ARENA
+
+    uint64_t finish = __rdtsc();
+
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUT_BATCHES, 1 );
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUT_BATCH_INPUTS, batch->num_inputs );
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUT_BATCH_CYCLES, finish - start );
+    metrics_add( &worker_metrics[cpu], COUNTER_INPUTS_PROCESSED, processed );
+
+    batch->num_inputs = 0;
+}
+
+static int batch_input( void * ctx, void * data, size_t data_sz )
+{
+    int cpu = *(int*) ctx;
+
+    struct input_batch_t * batch = &input_batch[cpu];
+
+    if ( data_sz != INPUT_RECORD_SIZE )
     {
-        printf( "error: failed to update player state: %s\n", strerror(errno) );
+        printf( "error: unexpected input record size: %d\n", (int) data_sz );
         return 0;
     }
 
-    __sync_fetch_and_add( &inputs_processed[cpu], 1 );
+    // the ring buffer record is released as soon as we return, so it must be copied into the batch
+
+    memcpy( batch->records[batch->num_inputs], data, INPUT_RECORD_SIZE );
+
+    batch->num_inputs++;
+
+    if ( batch->num_inputs == INPUT_BATCH_SIZE )
+    {
+        process_input_batch( cpu );
+    }
 
     return 0;
 }
 
+#endif // #if INPUT_BATCH
+
 static double time_start;
 
 void platform_init()
@@ -257,6 +1187,90 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
         printf( "player state for cpu %d = %d\n", i, bpf->player_state_inner_fd[i] );
     }
 
+    // get the file handle to the cold player state map
+
+    bpf->player_state_cold_fd = bpf_obj_get( "/sys/fs/bpf/player_state_cold" );
+    if ( bpf->player_state_cold_fd <= 0 )
+    {
+        printf( "\nerror: could not get cold player state map: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+#if PLAYER_STATE_ARENA
+
+    // map the player state arena into our address space
+
+    bpf->player_state_arena_fd = bpf_obj_get( "/sys/fs/bpf/player_state_arena" );
+    if ( bpf->player_state_arena_fd <= 0 )
+    {
+        printf( "\nerror: could not get player state arena: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    void * arena = mmap( NULL, sizeof(struct player_state_slot) * MAX_CPUS * PLAYERS_PER_CPU, PROT_READ | PROT_WRITE, MAP_SHARED, bpf->player_state_arena_fd, 0 );
+    if ( arena == MAP_FAILED )
+    {
+        printf( "\nerror: could not mmap player state arena: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bpf->player_state_arena = (struct player_state_slot*) arena;
+
+    printf( "player state arena mapped at %p\n", arena );
+
+    // map the free slot lists too. the worker returns slots to them when players time out
+
+    bpf->player_state_free_list_fd = bpf_obj_get( "/sys/fs/bpf/player_state_free_list" );
+    if ( bpf->player_state_free_list_fd <= 0 )
+    {
+        printf( "\nerror: could not get player state free list: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    void * free_list = mmap( NULL, sizeof(struct player_state_free_list) * MAX_CPUS, PROT_READ | PROT_WRITE, MAP_SHARED, bpf->player_state_free_list_fd, 0 );
+    if ( free_list == MAP_FAILED )
+    {
+        printf( "\nerror: could not mmap player state free list: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bpf->player_state_free_list = (struct player_state_free_list*) free_list;
+
+    bpf->session_map_fd = bpf_obj_get( "/sys/fs/bpf/session_map" );
+    if ( bpf->session_map_fd <= 0 )
+    {
+        printf( "\nerror: could not get session map: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    // start with every slot free. sessions left over from a previous run point at slots that are about to be handed out again, so delete them
+
+    for ( int i = 0; i < MAX_CPUS; i++ )
+    {
+        __atomic_store_n( &bpf->player_state_free_list[i].tail, 0, __ATOMIC_RELEASE );
+    }
+
+    uint64_t session_id;
+    while ( bpf_map_get_next_key( bpf->session_map_fd, NULL, &session_id ) == 0 )
+    {
+        bpf_map_delete_elem( bpf->session_map_fd, &session_id );
+    }
+
+    memset( bpf->player_state_arena, 0, sizeof(struct player_state_slot) * MAX_CPUS * PLAYERS_PER_CPU );
+
+    for ( int i = 0; i < MAX_CPUS; i++ )
+    {
+        struct player_state_free_list * cpu_free_list = bpf->player_state_free_list + i;
+        const uint64_t head = __atomic_load_n( &cpu_free_list->head, __ATOMIC_ACQUIRE );
+        for ( int j = 0; j < PLAYERS_PER_CPU; j++ )
+        {
+            cpu_free_list->slot[( head + j ) & ( PLAYER_STATE_FREE_LIST_SIZE - 1 )] = i * PLAYERS_PER_CPU + j;
+        }
+        __atomic_store_n( &cpu_free_list->tail, head + PLAYERS_PER_CPU, __ATOMIC_RELEASE );
+    }
+
+#endif // #if PLAYER_STATE_ARENA
+
     // get the file handle to the outer input buffer map
 
     bpf->input_buffer_outer_fd = bpf_obj_get( "/sys/fs/bpf/input_buffer_map" );
@@ -287,7 +1301,11 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
     for ( int i = 0; i < MAX_CPUS; i++ )
     {
         bpf->ring_buffer_cpus[i] = i;
+#if INPUT_BATCH
+        bpf->input_buffer[i] = ring_buffer__new( bpf->input_buffer_inner_fd[i], batch_input, bpf->ring_buffer_cpus + i, NULL );
+#else // #if INPUT_BATCH
         bpf->input_buffer[i] = ring_buffer__new( bpf->input_buffer_inner_fd[i], process_input, bpf->ring_buffer_cpus + i, NULL );
+#endif // #if INPUT_BATCH
         if ( !bpf->input_buffer[i] )
         {
             printf( "\nerror: could not create input buffer[%d]\n\n", i );
@@ -313,6 +1331,19 @@ void bpf_shutdown( struct bpf_t * bpf )
         }
     }
 
+#if PLAYER_STATE_ARENA
+    if ( bpf->player_state_arena )
+    {
+        munmap( bpf->player_state_arena, sizeof(struct player_state_slot) * MAX_CPUS * PLAYERS_PER_CPU );
+        bpf->player_state_arena = NULL;
+    }
+    if ( bpf->player_state_free_list )
+    {
+        munmap( bpf->player_state_free_list, sizeof(struct player_state_free_list) * MAX_CPUS );
+        bpf->player_state_free_list = NULL;
+    }
+#endif // #if PLAYER_STATE_ARENA
+
     if ( bpf->program != NULL )
     {
         if ( bpf->attached_native )
@@ -369,11 +1400,63 @@ void * worker_thread_function( void * context )
 
     pin_thread_to_cpu( cpu );
 
+#if !PLAYER_STATE_ARENA
+    double last_commit_time = platform_time();
+    int poll_timeout_ms = player_state_commit_interval_ms > 0 ? player_state_commit_interval_ms : 1000;
+#else // #if !PLAYER_STATE_ARENA
+    int poll_timeout_ms = 1000;
+#endif // #if !PLAYER_STATE_ARENA
+
+    bool spinning = worker_poll_mode != WORKER_POLL_EPOLL;
+    double last_input_time = platform_time();
+    const double idle_budget = worker_idle_budget_us / 1000000.0;
+
+#if TICK_SCHEDULER
+    tick_scheduler[cpu]->next_tick_time = platform_time() + tick_scheduler[cpu]->tick_interval;
+    const int max_poll_timeout_ms = poll_timeout_ms;
+#endif // #if TICK_SCHEDULER
+
     while ( !quit )
     {
+#if TICK_SCHEDULER
+        // don't sleep past the next tick. under a millisecond out, the poll doesn't block
+
+        int tick_timeout_ms = (int) ( ( tick_scheduler[cpu]->next_tick_time - platform_time() ) * 1000.0 );
+        poll_timeout_ms = tick_timeout_ms < 0 ? 0 : ( tick_timeout_ms < max_poll_timeout_ms ? tick_timeout_ms : max_poll_timeout_ms );
+#endif // #if TICK_SCHEDULER
+
         // poll ring buffer to drive input processing
 
-        int err = ring_buffer__poll( bpf.input_buffer[cpu], 1000 );
+        int err;
+        if ( spinning )
+        {
+            err = ring_buffer__consume( bpf.input_buffer[cpu] );
+            metrics_add( &worker_metrics[cpu], COUNTER_SPIN_ITERATIONS, 1 );
+            if ( err == 0 )
+            {
+                metrics_add( &worker_metrics[cpu], COUNTER_EMPTY_POLLS, 1 );
+                if ( worker_poll_mode == WORKER_POLL_ADAPTIVE && platform_time() - last_input_time >= idle_budget )
+                {
+                    spinning = false;
+                }
+                _mm_pause();
+            }
+        }
+        else
+        {
+            err = ring_buffer__poll( bpf.input_buffer[cpu], poll_timeout_ms );
+            metrics_add( &worker_metrics[cpu], COUNTER_SLEEPS, 1 );
+            if ( err > 0 && worker_poll_mode == WORKER_POLL_ADAPTIVE )
+            {
+                spinning = true;
+            }
+        }
+
+        if ( err > 0 && spinning )
+        {
+            last_input_time = platform_time();
+        }
+
         if ( err == -EINTR )
         {
             // ctrl-c
@@ -386,6 +1469,47 @@ void * worker_thread_function( void * context )
             quit = true;
             break;
         }    
+
+        if ( err > 0 || !spinning )
+        {
+            // empty spins are counted above, and would swamp the histogram
+            metrics_sample( &worker_metrics[cpu], HISTOGRAM_INPUTS_PER_POLL, err );
+        }
+
+#if INPUT_BATCH
+        // process whatever is left over after draining the ring buffer
+        process_input_batch( cpu );
+#endif // #if INPUT_BATCH
+
+#if TICK_SCHEDULER
+        if ( platform_time() >= tick_scheduler[cpu]->next_tick_time )
+        {
+            run_tick( cpu );
+        }
+#endif // #if TICK_SCHEDULER
+
+#if !PLAYER_STATE_ARENA
+        // commit dirty player state once per-tick
+
+        if ( player_state_commit_interval_ms > 0 )
+        {
+            double current_time = platform_time();
+            if ( current_time - last_commit_time >= player_state_commit_interval_ms / 1000.0 )
+            {
+                flush_player_state( cpu );
+                last_commit_time = current_time;
+            }
+        }
+
+        metrics_set( &worker_metrics[cpu], GAUGE_DIRTY_PLAYER_STATE, player_state_commit[cpu]->num_dirty );
+#endif // #if !PLAYER_STATE_ARENA
+
+        if ( platform_time() >= session_expiry[cpu]->next_check_time )
+        {
+            expire_players( cpu );
+        }
+
+        metrics_set( &worker_metrics[cpu], GAUGE_SESSIONS, cpu_session_table[cpu]->size );
     }
 
     return NULL;
@@ -397,17 +1521,105 @@ int main( int argc, char *argv[] )
     signal( SIGTERM, clean_shutdown_handler );
     signal( SIGHUP,  clean_shutdown_handler );
 
-    if ( argc != 2 )
+    if ( argc < 2 || argc > 5 )
     {
-        printf( "\nusage: server <interface name>\n\n" );
+        printf( "\nusage: server <interface name> [player state commit interval ms] [epoll|spin|adaptive] [idle budget us]\n\n" );
         return 1;
     }
 
+    if ( argc >= 3 )
+    {
+        player_state_commit_interval_ms = atoi( argv[2] );
+        if ( player_state_commit_interval_ms < 0 )
+        {
+            printf( "\nerror: player state commit interval must be >= 0\n\n" );
+            return 1;
+        }
+    }
+
+    if ( argc >= 4 )
+    {
+        if ( strcmp( argv[3], "spin" ) == 0 )
+        {
+            worker_poll_mode = WORKER_POLL_SPIN;
+        }
+        else if ( strcmp( argv[3], "adaptive" ) == 0 )
+        {
+            worker_poll_mode = WORKER_POLL_ADAPTIVE;
+        }
+        else if ( strcmp( argv[3], "epoll" ) != 0 )
+        {
+            printf( "\nerror: unknown poll mode '%s'\n\n", argv[3] );
+            return 1;
+        }
+    }
+
+    if ( argc >= 5 )
+    {
+        worker_idle_budget_us = atoi( argv[4] );
+        if ( worker_idle_budget_us <= 0 )
+        {
+            printf( "\nerror: idle budget must be > 0\n\n" );
+            return 1;
+        }
+    }
+
+    if ( worker_poll_mode == WORKER_POLL_SPIN )
+    {
+        printf( "workers spin on the input buffer\n" );
+    }
+    else if ( worker_poll_mode == WORKER_POLL_ADAPTIVE )
+    {
+        printf( "workers spin on the input buffer, back to epoll after %dus idle\n", worker_idle_budget_us );
+    }
+
+#if !PLAYER_STATE_ARENA
+    if ( player_state_commit_interval_ms > 0 )
+    {
+        printf( "committing player state every %dms\n", player_state_commit_interval_ms );
+    }
+    else
+    {
+        printf( "committing player state per-input\n" );
+    }
+#endif // #if !PLAYER_STATE_ARENA
+
     for ( int i = 0; i < MAX_CPUS; i++ )
     {
-        cpu_player_map[i] = map_create();
+        cpu_session_table[i] = session_table_create( MAX_SESSIONS / MAX_CPUS );
+#if !PLAYER_STATE_ARENA
+        player_state_commit[i] = player_state_commit_create( MAX_SESSIONS / MAX_CPUS );
+        cpu_player_state_hot[i] = (struct player_state_hot*) aligned_alloc( 64, sizeof(struct player_state_hot) * ( MAX_SESSIONS / MAX_CPUS ) );
+        assert( cpu_player_state_hot[i] );
+        memset( cpu_player_state_hot[i], 0, sizeof(struct player_state_hot) * ( MAX_SESSIONS / MAX_CPUS ) );
+#endif // #if !PLAYER_STATE_ARENA
+        session_expiry[i] = session_expiry_create( MAX_SESSIONS / MAX_CPUS );
+#if SIMULATION_SOA || TICK_SCHEDULER
+        cpu_simulation[i] = simulation_create( MAX_SESSIONS / MAX_CPUS );
+#endif // #if SIMULATION_SOA || TICK_SCHEDULER
+#if TICK_SCHEDULER
+        tick_scheduler[i] = tick_scheduler_create( MAX_SESSIONS / MAX_CPUS );
+#endif // #if TICK_SCHEDULER
+#if JITTER_BUFFER
+        cpu_jitter_buffer[i] = jitter_buffer_set_create( MAX_SESSIONS / MAX_CPUS, JITTER_BUFFER_POLICY );
+#endif // #if JITTER_BUFFER
     }
 
+    printf( "session slab: %.1fMB per-worker on %s\n", sizeof(struct player_state) * ( MAX_SESSIONS / MAX_CPUS ) / ( 1024.0 * 1024.0 ), session_table_pages_name( cpu_session_table[0]->slab_pages ) );
+
+#if SIMULATION_SOA || TICK_SCHEDULER
+    printf( "simulating with %s kernels\n", cpu_simulation[0]->kernel_name );
+#endif // #if SIMULATION_SOA || TICK_SCHEDULER
+
+#if TICK_SCHEDULER
+    printf( "simulating once per-tick at %dHZ\n", TICK_RATE );
+#endif // #if TICK_SCHEDULER
+
+#if JITTER_BUFFER
+    printf( "jitter buffer: target depth %d, max depth %d, %s on under-run, %d bytes per-player\n", JITTER_BUFFER_TARGET_DEPTH, JITTER_BUFFER_MAX_DEPTH,
+        JITTER_BUFFER_POLICY == JITTER_BUFFER_POLICY_DUPLICATE ? "duplicate" : "hold", (int) sizeof(struct jitter_buffer_t) );
+#endif // #if JITTER_BUFFER
+
     const char * interface_name = argv[1];
 
     if ( bpf_init( &bpf, interface_name ) != 0 )
@@ -437,6 +1649,36 @@ int main( int argc, char *argv[] )
     uint64_t previous_processed_inputs = 0;
     uint64_t previous_player_state_packets_sent = 0;
     uint64_t previous_lost_inputs = 0;
+    uint64_t previous_player_state_syscalls = 0;
+    uint64_t previous_spin_iterations = 0;
+    uint64_t previous_empty_polls = 0;
+    uint64_t previous_sleeps = 0;
+#if TICK_SCHEDULER
+    uint64_t previous_ticks = 0;
+    uint64_t previous_tick_deadline_misses = 0;
+    uint64_t previous_tick_duration[METRICS_HISTOGRAM_BUCKETS];
+    memset( previous_tick_duration, 0, sizeof(previous_tick_duration) );
+#endif // #if TICK_SCHEDULER
+#if JITTER_BUFFER
+    uint64_t previous_jitter_buffer_merges = 0;
+    uint64_t previous_jitter_buffer_duplicates = 0;
+    uint64_t previous_jitter_buffer_skips = 0;
+    uint64_t previous_jitter_buffer_late_inputs = 0;
+    uint64_t previous_jitter_buffer_reconciled_inputs = 0;
+    uint64_t previous_jitter_buffer_depth[METRICS_HISTOGRAM_BUCKETS];
+    memset( previous_jitter_buffer_depth, 0, sizeof(previous_jitter_buffer_depth) );
+#endif // #if JITTER_BUFFER
+    uint64_t previous_inputs_per_poll[METRICS_HISTOGRAM_BUCKETS];
+    memset( previous_inputs_per_poll, 0, sizeof(previous_inputs_per_poll) );
+    uint64_t previous_join_latency[METRICS_HISTOGRAM_BUCKETS];
+    memset( previous_join_latency, 0, sizeof(previous_join_latency) );
+    uint64_t previous_sessions_expired = 0;
+    uint64_t previous_session_table_full = 0;
+#if INPUT_BATCH
+    uint64_t previous_input_batches = 0;
+    uint64_t previous_input_batch_inputs = 0;
+    uint64_t previous_input_batch_cycles = 0;
+#endif // #if INPUT_BATCH
 
     while ( !quit )
     {
@@ -453,14 +1695,12 @@ int main( int argc, char *argv[] )
             break;
         }
 
-        uint64_t current_processed_inputs = 0;
+        uint64_t current_processed_inputs = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_INPUTS_PROCESSED );
+        uint64_t current_lost_inputs = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_INPUTS_LOST );
         uint64_t current_player_state_packets_sent = 0;
-        uint64_t current_lost_inputs = 0;
         for ( int i = 0; i < MAX_CPUS; i++ )
         {
-            current_processed_inputs += inputs_processed[i];
             current_player_state_packets_sent += values[i].player_state_packets_sent;
-            current_lost_inputs += inputs_lost[i];
         }
 
         // print out important stats
@@ -473,6 +1713,98 @@ int main( int argc, char *argv[] )
         previous_player_state_packets_sent = current_player_state_packets_sent;
         previous_lost_inputs = current_lost_inputs;
 
+        uint64_t current_player_state_syscalls = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_PLAYER_STATE_SYSCALLS );
+        printf( "player state syscall delta: %" PRId64 "\n", current_player_state_syscalls - previous_player_state_syscalls );
+        previous_player_state_syscalls = current_player_state_syscalls;
+
+        printf( "sessions: %" PRId64 ", dirty player state: %" PRId64 "\n", metrics_sum_gauge( worker_metrics, MAX_CPUS, GAUGE_SESSIONS ), metrics_sum_gauge( worker_metrics, MAX_CPUS, GAUGE_DIRTY_PLAYER_STATE ) );
+
+        uint64_t current_sessions_expired = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_SESSIONS_EXPIRED );
+        uint64_t current_session_table_full = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_SESSION_TABLE_FULL );
+        printf( "sessions expired: %" PRId64 "\n", current_sessions_expired - previous_sessions_expired );
+        if ( current_session_table_full != previous_session_table_full )
+        {
+            printf( "error: session table is full, dropped %" PRId64 " inputs from new players\n", current_session_table_full - previous_session_table_full );
+        }
+        previous_sessions_expired = current_sessions_expired;
+        previous_session_table_full = current_session_table_full;
+
+        uint64_t current_inputs_per_poll[METRICS_HISTOGRAM_BUCKETS];
+        metrics_sum_histogram( worker_metrics, MAX_CPUS, HISTOGRAM_INPUTS_PER_POLL, current_inputs_per_poll );
+        metrics_print_histogram( "inputs per poll", current_inputs_per_poll, previous_inputs_per_poll );
+        memcpy( previous_inputs_per_poll, current_inputs_per_poll, sizeof(previous_inputs_per_poll) );
+
+        uint64_t current_join_latency[METRICS_HISTOGRAM_BUCKETS];
+        metrics_sum_histogram( worker_metrics, MAX_CPUS, HISTOGRAM_JOIN_LATENCY, current_join_latency );
+        metrics_print_histogram( "join latency (ns)", current_join_latency, previous_join_latency );
+        memcpy( previous_join_latency, current_join_latency, sizeof(previous_join_latency) );
+
+        uint64_t current_spin_iterations = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_SPIN_ITERATIONS );
+        uint64_t current_empty_polls = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_EMPTY_POLLS );
+        uint64_t current_sleeps = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_SLEEPS );
+        printf( "spin iterations: %" PRId64 ", empty polls: %" PRId64 ", sleeps: %" PRId64 "\n",
+            current_spin_iterations - previous_spin_iterations, current_empty_polls - previous_empty_polls, current_sleeps - previous_sleeps );
+        previous_spin_iterations = current_spin_iterations;
+        previous_empty_polls = current_empty_polls;
+        previous_sleeps = current_sleeps;
+
+#if TICK_SCHEDULER
+        uint64_t current_ticks = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_TICKS );
+        uint64_t current_tick_deadline_misses = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_TICK_DEADLINE_MISSES );
+        printf( "ticks: %" PRId64 ", deadline misses: %" PRId64 "\n", current_ticks - previous_ticks, current_tick_deadline_misses - previous_tick_deadline_misses );
+        previous_ticks = current_ticks;
+        previous_tick_deadline_misses = current_tick_deadline_misses;
+
+        uint64_t current_tick_duration[METRICS_HISTOGRAM_BUCKETS];
+        metrics_sum_histogram( worker_metrics, MAX_CPUS, HISTOGRAM_TICK_DURATION, current_tick_duration );
+        metrics_print_histogram( "tick duration (us)", current_tick_duration, previous_tick_duration );
+        memcpy( previous_tick_duration, current_tick_duration, sizeof(previous_tick_duration) );
+#endif // #if TICK_SCHEDULER
+
+#if JITTER_BUFFER
+        uint64_t jitter_buffer_players = metrics_sum_gauge( worker_metrics, MAX_CPUS, GAUGE_JITTER_BUFFER_PLAYERS );
+        uint64_t jitter_buffer_total_depth = metrics_sum_gauge( worker_metrics, MAX_CPUS, GAUGE_JITTER_BUFFER_DEPTH );
+        printf( "jitter buffer players: %" PRId64 ", avg depth: %.2f\n", jitter_buffer_players, jitter_buffer_players ? jitter_buffer_total_depth / (double) jitter_buffer_players : 0.0 );
+
+        uint64_t current_jitter_buffer_merges = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_JITTER_BUFFER_MERGES );
+        uint64_t current_jitter_buffer_duplicates = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_JITTER_BUFFER_DUPLICATES );
+        uint64_t current_jitter_buffer_skips = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_JITTER_BUFFER_SKIPS );
+        uint64_t current_jitter_buffer_late_inputs = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_JITTER_BUFFER_LATE_INPUTS );
+        uint64_t current_jitter_buffer_reconciled_inputs = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_JITTER_BUFFER_RECONCILED_INPUTS );
+        printf( "jitter buffer merges: %" PRId64 ", duplicates: %" PRId64 ", skips: %" PRId64 ", late inputs: %" PRId64 ", reconciled: %" PRId64 "\n",
+            current_jitter_buffer_merges - previous_jitter_buffer_merges,
+            current_jitter_buffer_duplicates - previous_jitter_buffer_duplicates,
+            current_jitter_buffer_skips - previous_jitter_buffer_skips,
+            current_jitter_buffer_late_inputs - previous_jitter_buffer_late_inputs,
+            current_jitter_buffer_reconciled_inputs - previous_jitter_buffer_reconciled_inputs );
+        previous_jitter_buffer_merges = current_jitter_buffer_merges;
+        previous_jitter_buffer_duplicates = current_jitter_buffer_duplicates;
+        previous_jitter_buffer_skips = current_jitter_buffer_skips;
+        previous_jitter_buffer_late_inputs = current_jitter_buffer_late_inputs;
+        previous_jitter_buffer_reconciled_inputs = current_jitter_buffer_reconciled_inputs;
+
+        uint64_t current_jitter_buffer_depth[METRICS_HISTOGRAM_BUCKETS];
+        metrics_sum_histogram( worker_metrics, MAX_CPUS, HISTOGRAM_JITTER_BUFFER_DEPTH, current_jitter_buffer_depth );
+        metrics_print_histogram( "jitter buffer depth", current_jitter_buffer_depth, previous_jitter_buffer_depth );
+        memcpy( previous_jitter_buffer_depth, current_jitter_buffer_depth, sizeof(previous_jitter_buffer_depth) );
+#endif // #if JITTER_BUFFER
+
+#if INPUT_BATCH
+        uint64_t current_input_batches = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_INPUT_BATCHES );
+        uint64_t current_input_batch_inputs = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_INPUT_BATCH_INPUTS );
+        uint64_t current_input_batch_cycles = metrics_sum_counter( worker_metrics, MAX_CPUS, COUNTER_INPUT_BATCH_CYCLES );
+        uint64_t batch_delta = current_input_batches - previous_input_batches;
+        uint64_t batch_input_delta = current_input_batch_inputs - previous_input_batch_inputs;
+        uint64_t batch_cycles_delta = current_input_batch_cycles - previous_input_batch_cycles;
+        if ( batch_delta > 0 && batch_input_delta > 0 )
+        {
+            printf( "records per batch: %.1f, cycles per input: %.1f\n", batch_input_delta / (double) batch_delta, batch_cycles_delta / (double) batch_input_delta );
+        }
+        previous_input_batches = current_input_batches;
+        previous_input_batch_inputs = current_input_batch_inputs;
+        previous_input_batch_cycles = current_input_batch_cycles;
+#endif // #if INPUT_BATCH
+
         // upload stats to the xdp program to be sent down to clients
 
         struct server_stats stats;
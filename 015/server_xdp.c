@@ -32,6 +32,9 @@
 # error "Endianness detection needs to be set up for your compiler?!"
 #endif
 
+#define READ_ONCE(x)        ( *(volatile typeof(x) *) &(x) )
+#define WRITE_ONCE(x,v)     ( *(volatile typeof(x) *) &(x) = (v) )
+
 //#define DEBUG 1
 
 #if DEBUG
@@ -108,7 +111,7 @@ struct {
 struct inner_player_state_map {
     __uint( type, BPF_MAP_TYPE_LRU_HASH );
     __type( key, __u64 );
-    __type( value, struct player_state );
+    __type( value, struct player_state_hot );
     __uint( max_entries, PLAYERS_PER_CPU );
 } 
 player_state_0 SEC(".maps"),
@@ -155,6 +158,14 @@ struct {
     }
 };
 
+struct {
+    __uint( type, BPF_MAP_TYPE_LRU_HASH );
+    __type( key, __u64 );
+    __type( value, struct player_state_cold );
+    __uint( max_entries, MAX_SESSIONS );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} player_state_cold SEC(".maps");
+
 struct {
     __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
     __uint( max_entries, 1 );
@@ -163,6 +174,41 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } counters_map SEC(".maps");
 
+#if PLAYER_STATE_ARENA
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __uint( max_entries, MAX_CPUS * PLAYERS_PER_CPU );
+    __type( key, __u32 );
+    __type( value, struct player_state_slot );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} player_state_arena SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, struct player_state_free_list );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} player_state_free_list SEC(".maps");
+
+#endif // #if PLAYER_STATE_ARENA
+
+// the worker publishes a version with the cold section. a new version means the next few replies carry the cold section
+
+static __always_inline int send_full_player_state( struct session_data * session, __u64 cold_version, __u64 sequence )
+{
+    if ( cold_version != session->cold_version )
+    {
+        session->cold_version = cold_version;
+        session->full_state_replies = PLAYER_STATE_FULL_REPLIES;
+    }
+
+    return session->full_state_replies > 0 || ( sequence % PLAYER_STATE_COLD_REFRESH_INPUTS ) == 0;
+}
+
 static void reflect_packet( void * data, int payload_bytes )
 {
     struct ethhdr * eth = data;
@@ -244,9 +290,46 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                     struct session_data session;
                                     session.next_input_sequence = 1000;
+                                    session.player_state_index = 0;
+                                    session.full_state_replies = PLAYER_STATE_FULL_REPLIES;
+                                    session.cold_version = 0;
+
+#if PLAYER_STATE_ARENA
+
+                                    // assign the session a free player state slot on this cpu. the slot is only taken once the session is created
+
+                                    __u32 free_list_cpu = bpf_get_smp_processor_id();
+                                    struct player_state_free_list * free_list = (struct player_state_free_list*) bpf_map_lookup_elem( &player_state_free_list, &free_list_cpu );
+                                    if ( !free_list )
+                                    {
+                                        return XDP_DROP; // can't happen
+                                    }
+
+                                    __u64 free_list_head = free_list->head;
+                                    if ( free_list_head >= READ_ONCE( free_list->tail ) )
+                                    {
+                                        debug_printf( "no free player state slot for session 0x%llx", request->session_id );
+                                        return XDP_DROP;
+                                    }
+
+                                    session.player_state_index = free_list->slot[free_list_head & ( PLAYER_STATE_FREE_LIST_SIZE - 1 )];
+
+                                    __u32 player_state_index = session.player_state_index;
+                                    struct player_state_slot * slot = (struct player_state_slot*) bpf_map_lookup_elem( &player_state_arena, &player_state_index );
+                                    if ( !slot )
+                                    {
+                                        return XDP_DROP; // can't happen
+                                    }
+
+#endif // #if PLAYER_STATE_ARENA
+
                                     if ( bpf_map_update_elem( &session_map, &request->session_id, &session, BPF_NOEXIST ) == 0 )
                                     {
                                         debug_printf( "created session 0x%llx", request->session_id );
+#if PLAYER_STATE_ARENA
+                                        WRITE_ONCE( slot->session_id, request->session_id );
+                                        WRITE_ONCE( free_list->head, free_list_head + 1 );
+#endif // #if PLAYER_STATE_ARENA
                                     }
 
                                     reflect_packet( data, sizeof(struct join_response_packet) );
@@ -331,6 +414,26 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                         if ( n == 1 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) <= data_end )
                                         {
+#if PLAYER_STATE_ARENA
+
+                                            // the player state index goes down to the worker in front of the input
+
+                                            __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ), 0 );
+                                            if ( !event )
+                                            {
+                                                debug_printf( "dropped input :(" );
+                                                return XDP_DROP;
+                                            }
+
+                                            *( (__u64*) event ) = session->player_state_index;
+
+                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ); i++ )
+                                            {
+                                                event[8+i] = payload[1+i];
+                                            }
+
+#else // #if PLAYER_STATE_ARENA
+
                                             __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + ( 8 + INPUT_SIZE ), 0 );
                                             if ( !event )
                                             {
@@ -343,6 +446,8 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                                 event[i] = payload[1+i];
                                             }
 
+#endif // #if PLAYER_STATE_ARENA
+
                                             bpf_ringbuf_submit( event, 0 );
                                         }
                                         // todo: update these to ringbuf
@@ -436,7 +541,59 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                         return XDP_DROP;
                                     }
 
-                                    // respond with a player state packet for the client's local player
+                                    // respond with a player state packet for the client's local player. just t and the hot section,
+                                    // unless the cold section changed recently
+
+                                    int reply_bytes = PLAYER_STATE_HOT_PACKET_SIZE;
+
+#if PLAYER_STATE_ARENA
+
+                                    __u32 player_state_index = session->player_state_index;
+
+                                    struct player_state_slot * slot = (struct player_state_slot*) bpf_map_lookup_elem( &player_state_arena, &player_state_index );
+                                    if ( !slot || slot->session_id != session_id )
+                                    {
+                                        debug_printf( "could not find player state for session 0x%llx", session_id );
+                                        return XDP_DROP;
+                                    }
+
+                                    __u64 version = READ_ONCE( slot->version );
+                                    if ( version & 1 )
+                                    {
+                                        debug_printf( "player state for session 0x%llx is being written", session_id );
+                                        return XDP_DROP;
+                                    }
+
+                                    __u8 * player_state = (__u8*) &slot->state;
+
+                                    if ( send_full_player_state( session, slot->cold_version, sequence ) )
+                                    {
+                                        payload[0] = PLAYER_STATE_PACKET;
+
+                                        for ( int i = 0; i < 8 + PLAYER_STATE_SIZE; i++ )
+                                        {
+                                            payload[1+i] = player_state[i];
+                                        }
+
+                                        reply_bytes = PLAYER_STATE_PACKET_SIZE;
+                                    }
+                                    else
+                                    {
+                                        payload[0] = PLAYER_STATE_HOT_PACKET;
+
+                                        for ( int i = 0; i < 8 + PLAYER_STATE_HOT_SIZE; i++ )
+                                        {
+                                            payload[1+i] = player_state[i];
+                                        }
+                                    }
+
+                                    if ( READ_ONCE( slot->version ) != version )
+                                    {
+                                        debug_printf( "player state for session 0x%llx changed while it was read", session_id );
+                                        return XDP_DROP;
+                                    }
+
+#else // #if PLAYER_STATE_ARENA
 
                                     void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
                                     if ( !cpu_player_state_map )
@@ -445,20 +602,44 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                         return XDP_DROP;
                                     }
 
-                                    __u8 * player_state = (__u8*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
-                                    if ( !player_state )
+                                    struct player_state_hot * hot = (struct player_state_hot*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
+                                    if ( !hot )
                                     {
                                         debug_printf( "could not find player state for session 0x%llx", session_id );
                                         debug_printf( "whata the fuck 0x%llx", ( session_id >> 32 ) );
                                         return XDP_DROP;
                                     }
 
-                                    payload[0] = PLAYER_STATE_PACKET;
+                                    __u8 * player_state = (__u8*) hot;
+
+                                    payload[0] = PLAYER_STATE_HOT_PACKET;
 
-                                    for ( int i = 0; i < 8 + PLAYER_STATE_SIZE; i++ )
+                                    for ( int i = 0; i < 8 + PLAYER_STATE_HOT_SIZE; i++ )
                                     {
                                         payload[1+i] = player_state[i];
                                     }
+
+                                    // the worker commits the cold section before the hot section that goes with it
+
+                                    struct player_state_cold * cold = (struct player_state_cold*) bpf_map_lookup_elem( &player_state_cold, &session_id );
+                                    if ( cold && send_full_player_state( session, cold->version, sequence ) )
+                                    {
+                                        payload[0] = PLAYER_STATE_PACKET;
+
+                                        for ( int i = 0; i < PLAYER_STATE_COLD_SIZE; i++ )
+                                        {
+                                            payload[1+8+PLAYER_STATE_HOT_SIZE+i] = cold->data[i];
+                                        }
+
+                                        reply_bytes = PLAYER_STATE_PACKET_SIZE;
+                                    }
+
+#endif // #if PLAYER_STATE_ARENA
+
+                                    if ( reply_bytes == PLAYER_STATE_PACKET_SIZE && session->full_state_replies > 0 )
+                                    {
+                                        session->full_state_replies--;
+                                    }
   
                                     int zero = 0;
                                     struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
@@ -469,9 +650,9 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                     __sync_fetch_and_add( &counters->player_state_packets_sent, 1 );
 
-                                    reflect_packet( data, PLAYER_STATE_PACKET_SIZE );
+                                    reflect_packet( data, reply_bytes );
 
-                                    bpf_xdp_adjust_tail( ctx, -( INPUT_PACKET_SIZE - PLAYER_STATE_PACKET_SIZE ) );
+                                    bpf_xdp_adjust_tail( ctx, -( INPUT_PACKET_SIZE - reply_bytes ) );
 
                                     return XDP_TX;
                                 }
@@ -0,0 +1,311 @@
+
+#include "shared.h"
+#include <sys/mman.h>
+
+/*
+    Open addressing session table with robin hood hashing.
+
+    Player state is stored inline in a slab allocated up front, so there are no allocations after create.
+    The index is a separate array of (session id, probe distance, slab index) so probing stays within a few cache lines.
+    Deletes use backward shift instead of tombstones, so probe lengths don't degrade as players come and go.
+
+    The slab is mapped with 2MB huge pages if the system has them reserved (vm.nr_hugepages), otherwise with
+    transparent huge pages via madvise, and prefaulted at create. A join takes a slot off the free list without a
+    page fault, and the whole slab costs a handful of TLB entries instead of one per-4KB page.
+*/
+
+#define SESSION_TABLE_HUGE_PAGE_SIZE                                              ( 2 * 1024 * 1024 )
+
+#define SESSION_TABLE_PAGES_MALLOC                                                          0
+#define SESSION_TABLE_PAGES_HUGETLB                                                         1
+#define SESSION_TABLE_PAGES_THP                                                             2
+#define SESSION_TABLE_PAGES_SMALL                                                           3          // madvise failed, 4KB pages
+
+struct session_table_entry_t
+{
+    uint64_t session_id;
+    uint32_t distance;                   // probe distance + 1. zero means the entry is empty
+    uint32_t slab_index;
+};
+
+struct session_table_t
+{
+    int size;
+    int capacity;
+    uint64_t mask;
+    struct session_table_entry_t * entries;
+    struct player_state * slab;
+    uint32_t * free_list;
+    int num_free;
+    int slab_pages;
+    void * slab_mapping;
+    size_t slab_mapping_bytes;
+};
+
+static const char * session_table_pages_name( int pages )
+{
+    switch ( pages )
+    {
+        case SESSION_TABLE_PAGES_HUGETLB:
+            return "2MB huge pages";
+
+        case SESSION_TABLE_PAGES_THP:
+            return "transparent huge pages";
+
+        case SESSION_TABLE_PAGES_SMALL:
+            return "4KB pages";
+
+        default:
+            return "malloc";
+    }
+}
+
+static inline uint64_t session_table_hash( uint64_t session_id )
+{
+    // murmur3 fmix64
+
+    session_id ^= session_id >> 33;
+    session_id *= 0xff51afd7ed558ccdULL;
+    session_id ^= session_id >> 33;
+    session_id *= 0xc4ceb9fe1a85ec53ULL;
+    session_id ^= session_id >> 33;
+    return session_id;
+}
+
+static void session_table_reset( struct session_table_t * table )
+{
+    assert( table );
+    table->size = 0;
+    memset( table->entries, 0, sizeof(struct session_table_entry_t) * ( table->mask + 1 ) );
+    table->num_free = table->capacity;
+    for ( int i = 0; i < table->capacity; i++ )
+    {
+        table->free_list[i] = table->capacity - 1 - i;
+    }
+}
+
+static int session_table_map_slab( struct session_table_t * table, size_t bytes )
+{
+    const size_t slab_bytes = ( bytes + SESSION_TABLE_HUGE_PAGE_SIZE - 1 ) & ~( (size_t) SESSION_TABLE_HUGE_PAGE_SIZE - 1 );
+
+    void * mapping = mmap( NULL, slab_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0 );
+    if ( mapping != MAP_FAILED )
+    {
+        table->slab = (struct player_state*) mapping;
+        table->slab_pages = SESSION_TABLE_PAGES_HUGETLB;
+        table->slab_mapping = mapping;
+        table->slab_mapping_bytes = slab_bytes;
+        return 1;
+    }
+
+    // no huge pages reserved. over-allocate so the slab starts on a 2MB boundary, and ask for transparent huge pages
+
+    const size_t mapping_bytes = slab_bytes + SESSION_TABLE_HUGE_PAGE_SIZE;
+    mapping = mmap( NULL, mapping_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( mapping == MAP_FAILED )
+    {
+        return 0;
+    }
+
+    uint8_t * slab = (uint8_t*) ( ( (uintptr_t) mapping + SESSION_TABLE_HUGE_PAGE_SIZE - 1 ) & ~( (uintptr_t) SESSION_TABLE_HUGE_PAGE_SIZE - 1 ) );
+
+    table->slab_pages = madvise( slab, slab_bytes, MADV_HUGEPAGE ) == 0 ? SESSION_TABLE_PAGES_THP : SESSION_TABLE_PAGES_SMALL;
+
+    // prefault after madvise, so the faults are taken as huge pages. MAP_POPULATE would have faulted 4KB pages
+
+    int populated = 0;
+#if defined(MADV_POPULATE_WRITE)
+    populated = madvise( slab, slab_bytes, MADV_POPULATE_WRITE ) == 0;
+#endif // #if defined(MADV_POPULATE_WRITE)
+    if ( !populated )
+    {
+        memset( slab, 0, slab_bytes );
+    }
+
+    table->slab = (struct player_state*) slab;
+    table->slab_mapping = mapping;
+    table->slab_mapping_bytes = mapping_bytes;
+    return 1;
+}
+
+struct session_table_t * session_table_create_with_pages( int capacity, int huge_pages )
+{
+    assert( capacity > 0 );
+
+    // keep the load factor at or below 50% so probe sequences stay short
+
+    uint64_t num_entries = 1;
+    while ( num_entries < (uint64_t) capacity * 2 )
+    {
+        num_entries <<= 1;
+    }
+
+    struct session_table_t * table = (struct session_table_t*) malloc( sizeof( struct session_table_t ) );
+    assert( table );
+    memset( table, 0, sizeof(struct session_table_t) );
+    table->capacity = capacity;
+    table->mask = num_entries - 1;
+    table->entries = (struct session_table_entry_t*) malloc( sizeof(struct session_table_entry_t) * num_entries );
+    if ( !huge_pages || !session_table_map_slab( table, sizeof(struct player_state) * capacity ) )
+    {
+        table->slab = (struct player_state*) malloc( sizeof(struct player_state) * capacity );
+        table->slab_pages = SESSION_TABLE_PAGES_MALLOC;
+        assert( table->slab );
+        memset( table->slab, 0, sizeof(struct player_state) * capacity );
+    }
+    table->free_list = (uint32_t*) malloc( sizeof(uint32_t) * capacity );
+    assert( table->entries );
+    assert( table->free_list );
+    session_table_reset( table );
+    return table;
+}
+
+struct session_table_t * session_table_create( int capacity )
+{
+    return session_table_create_with_pages( capacity, 1 );
+}
+
+static void session_table_destroy( struct session_table_t * table )
+{
+    assert( table );
+    free( table->entries );
+    if ( table->slab_mapping )
+    {
+        munmap( table->slab_mapping, table->slab_mapping_bytes );
+    }
+    else
+    {
+        free( table->slab );
+    }
+    free( table->free_list );
+    free( table );
+}
+
+static struct player_state * session_table_get( struct session_table_t * table, uint64_t session_id )
+{
+    assert( table );
+    uint64_t index = session_table_hash( session_id ) & table->mask;
+    uint32_t distance = 1;
+    while ( 1 )
+    {
+        struct session_table_entry_t * entry = table->entries + index;
+        if ( entry->distance < distance )
+        {
+            // robin hood invariant: the session would have displaced this entry if it were in the table
+            return NULL;
+        }
+        if ( entry->session_id == session_id )
+        {
+            return table->slab + entry->slab_index;
+        }
+        index = ( index + 1 ) & table->mask;
+        distance++;
+    }
+}
+
+static int session_table_slab_index( struct session_table_t * table, struct player_state * state )
+{
+    assert( table );
+    assert( state >= table->slab && state < table->slab + table->capacity );
+    return (int) ( state - table->slab );
+}
+
+static void session_table_prefetch( struct session_table_t * table, uint64_t session_id )
+{
+    assert( table );
+    uint64_t index = session_table_hash( session_id ) & table->mask;
+    __builtin_prefetch( table->entries + index, 0 );
+}
+
+static struct player_state * session_table_insert( struct session_table_t * table, uint64_t session_id )
+{
+    assert( table );
+
+    struct player_state * existing = session_table_get( table, session_id );
+    if ( existing )
+    {
+        return existing;
+    }
+
+    if ( table->num_free == 0 )
+    {
+        return NULL;
+    }
+
+    uint32_t slab_index = table->free_list[--table->num_free];
+
+    struct player_state * state = table->slab + slab_index;
+    memset( state, 0, sizeof(struct player_state) );
+
+    struct session_table_entry_t insert;
+    insert.session_id = session_id;
+    insert.distance = 1;
+    insert.slab_index = slab_index;
+
+    uint64_t index = session_table_hash( session_id ) & table->mask;
+    while ( 1 )
+    {
+        struct session_table_entry_t * entry = table->entries + index;
+        if ( entry->distance == 0 )
+        {
+            *entry = insert;
+            break;
+        }
+        if ( entry->distance < insert.distance )
+        {
+            // take from the rich, give to the poor
+            struct session_table_entry_t temp = *entry;
+            *entry = insert;
+            insert = temp;
+        }
+        index = ( index + 1 ) & table->mask;
+        insert.distance++;
+    }
+
+    ++table->size;
+
+    return state;
+}
+
+static int session_table_delete( struct session_table_t * table, uint64_t session_id )
+{
+    assert( table );
+    uint64_t index = session_table_hash( session_id ) & table->mask;
+    uint32_t distance = 1;
+    while ( 1 )
+    {
+        struct session_table_entry_t * entry = table->entries + index;
+        if ( entry->distance < distance )
+        {
+            return 0;
+        }
+        if ( entry->session_id == session_id )
+        {
+            break;
+        }
+        index = ( index + 1 ) & table->mask;
+        distance++;
+    }
+
+    table->free_list[table->num_free++] = table->entries[index].slab_index;
+
+    // backward shift the following entries into the hole, so no tombstone is needed
+
+    while ( 1 )
+    {
+        uint64_t next_index = ( index + 1 ) & table->mask;
+        struct session_table_entry_t * next = table->entries + next_index;
+        if ( next->distance <= 1 )
+        {
+            memset( table->entries + index, 0, sizeof(struct session_table_entry_t) );
+            break;
+        }
+        table->entries[index] = *next;
+        table->entries[index].distance--;
+        index = next_index;
+    }
+
+    --table->size;
+
+    return 1;
+}
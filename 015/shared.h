@@ -11,6 +11,7 @@
 #define STATS_REQUEST_PACKET                                                                4
 #define STATS_RESPONSE_PACKET                                                               5
 #define PLAYER_STATE_PACKET                                                                 6
+#define PLAYER_STATE_HOT_PACKET                                                             7
 
 #define INPUT_SIZE                                                                        100
 #define INPUTS_PER_PACKET                                                                  10
@@ -20,6 +21,16 @@
 
 #define PLAYER_STATE_SIZE                                                                1000
 
+#define PLAYER_STATE_HOT_SIZE                                                              56          // position, velocity, orientation, health. one cache line with t
+
+#define PLAYER_STATE_COLD_SIZE                  ( PLAYER_STATE_SIZE - PLAYER_STATE_HOT_SIZE )
+
+#define PLAYER_STATE_COLD_INTERVAL                                                 1000000000          // player time (ns) between changes to the cold section
+
+#define PLAYER_STATE_FULL_REPLIES                                                          10          // replies after join, or after a cold change, that carry the cold section
+
+#define PLAYER_STATE_COLD_REFRESH_INPUTS                                                  100          // the reply to every 100th input carries the cold section anyway
+
 #define JOIN_REQUEST_PACKET_SIZE                             ( 1 + 8 + 8 + PLAYER_DATA_SIZE )
 #define JOIN_RESPONSE_PACKET_SIZE                                           ( 1 + 8 + 8 + 8 )
 #define STATS_REQUEST_PACKET_SIZE                                               ( 1 + 8 + 8 )
@@ -32,6 +43,9 @@
 #define PLAYERS_PER_CPU                                                                   500
 
 #define PLAYER_STATE_PACKET_SIZE                                ( 1 + 8 + PLAYER_STATE_SIZE )
+#define PLAYER_STATE_HOT_PACKET_SIZE                        ( 1 + 8 + PLAYER_STATE_HOT_SIZE )
+
+#define PLAYER_STATE_ARENA                                                                  0
 
 #pragma pack(push, 1)
 
@@ -67,14 +81,42 @@ struct server_stats
 struct session_data 
 {
     __u64 next_input_sequence;
+    __u32 player_state_index;
+    __u32 full_state_replies;
+    __u64 cold_version;                                                 // of the newest cold section XDP has seen
 };
 
+/*
+    Player state data is split into a hot section, the first PLAYER_STATE_HOT_SIZE bytes, which the simulation
+    writes every step, and a cold section (inventory and the like) that only changes once every PLAYER_STATE_COLD_INTERVAL
+    of player time.
+
+    t and the hot section are struct player_state_hot, one cache line. The worker keeps them in their own array and
+    commits them to player_state_map every step. The cold section goes to player_state_cold only when it changes,
+    with a version the worker changes every time it writes it. XDP replies with PLAYER_STATE_HOT_PACKET (t and the hot
+    section), and only sends the whole player state in a PLAYER_STATE_PACKET for the first PLAYER_STATE_FULL_REPLIES
+    replies after join or after it sees a new cold version, so a client that loses a few still gets it. Replies to
+    every PLAYER_STATE_COLD_REFRESH_INPUTS inputs carry it too, so a client that lost all of those catches up.
+*/
+
 struct player_state
 {
     __u64 t;
     __u8 data[PLAYER_STATE_SIZE];
 };
 
+struct player_state_hot
+{
+    __u64 t;
+    __u8 data[PLAYER_STATE_HOT_SIZE];
+};
+
+struct player_state_cold
+{
+    __u64 version;                                                      // player t when the worker wrote it
+    __u8 data[PLAYER_STATE_COLD_SIZE];
+};
+
 struct input_header
 {
     __u64 session_id;
@@ -95,4 +137,36 @@ struct counters
 
 #pragma pack(pop)
 
+/*
+    Player state arena entry (PLAYER_STATE_ARENA only).
+
+    The arena is an mmapable array with PLAYERS_PER_CPU slots per-CPU, written in place by the worker and read by XDP.
+    The version is odd while the worker is writing the player state, so XDP can avoid sending a torn player state.
+*/
+
+struct player_state_slot
+{
+    __u64 session_id;                                                   // zero when the slot is free
+    __u64 version;
+    struct player_state state;
+    __u64 cold_version;                                                 // player t when the cold section last changed
+};
+
+/*
+    Free player state slots (PLAYER_STATE_ARENA only).
+
+    One ring of free slot indices per-CPU, in an mmapable array shared by XDP and the worker. XDP on that CPU takes a
+    slot from the head when a session joins, and the worker for that CPU puts it back at the tail when the player times
+    out. Each index has exactly one writer, so no locks are needed.
+*/
+
+#define PLAYER_STATE_FREE_LIST_SIZE                                                       512          // power of two, at least PLAYERS_PER_CPU
+
+struct player_state_free_list
+{
+    __u64 head;                                                         // written by XDP
+    __u64 tail;                                                         // written by the worker
+    __u32 slot[PLAYER_STATE_FREE_LIST_SIZE];
+};
+
 #endif // #ifndef SHARED_H
@@ -0,0 +1,229 @@
+
+#include "shared.h"
+
+/*
+    Structure of arrays player simulation.
+
+    The only real field in player state is t. The 1000 bytes of data are derived from it, so the simulation
+    keeps t for every player in one array, indexed by session table slab index, and accumulates the dt of each
+    input against it. Players are stepped in blocks of SIMULATION_BLOCK_SIZE with one vectorized kernel, and
+    only packed into the player state the server commits when a reply needs it.
+
+    Packing writes t and the hot section into the player's struct player_state_hot every time, one aligned cache line
+    in an array of them. The cold section is derived from t / PLAYER_STATE_COLD_INTERVAL, so it is only written to the
+    cold section of struct player_state when that changes, and pack returns true so the server commits it.
+
+    The AVX2 kernels are compiled with a target attribute, so the server doesn't need -mavx2, and are picked
+    over the scalar ones at create time if CPUID says the cpu has AVX2.
+*/
+
+#define SIMULATION_BLOCK_SIZE                                                               8
+
+struct simulation_t
+{
+    int capacity;                        // players, rounded up to a whole number of blocks
+    int num_blocks;
+    uint64_t * t;
+    uint64_t * dt;                       // accumulated since the last step
+    uint8_t * block_dirty;
+    int num_dirty_blocks;
+    uint32_t * dirty_blocks;
+    void (*step_block)( uint64_t * t, uint64_t * dt );
+    int (*pack)( struct player_state_hot * hot, struct player_state * state, uint64_t t );
+    const char * kernel_name;
+};
+
+static void simulation_step_block_scalar( uint64_t * t, uint64_t * dt )
+{
+    for ( int i = 0; i < SIMULATION_BLOCK_SIZE; i++ )
+    {
+        t[i] += dt[i];
+        dt[i] = 0;
+    }
+}
+
+// a fresh player state is all zeros, so it always needs its cold section written
+
+static inline int player_state_cold_changed( uint64_t previous_t, uint64_t t )
+{
+    return previous_t == 0 || previous_t / PLAYER_STATE_COLD_INTERVAL != t / PLAYER_STATE_COLD_INTERVAL;
+}
+
+static void player_state_pack_cold( struct player_state * state, uint64_t t )
+{
+    const uint8_t version = (uint8_t) ( t / PLAYER_STATE_COLD_INTERVAL );
+    for ( int i = PLAYER_STATE_HOT_SIZE; i < PLAYER_STATE_SIZE; i++ )
+    {
+        state->data[i] = version + (uint8_t) i;
+    }
+}
+
+static int simulation_pack_scalar( struct player_state_hot * hot, struct player_state * state, uint64_t t )
+{
+    const uint64_t previous_t = hot->t;
+
+    hot->t = t;
+    for ( int i = 0; i < PLAYER_STATE_HOT_SIZE; i++ )
+    {
+        hot->data[i] = (uint8_t) t + (uint8_t) i;
+    }
+
+    if ( !player_state_cold_changed( previous_t, t ) )
+        return 0;
+
+    player_state_pack_cold( state, t );
+
+    return 1;
+}
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+__attribute__((target("avx2"))) static void simulation_step_block_avx2( uint64_t * t, uint64_t * dt )
+{
+    // t and dt are 32 byte aligned, and a block is exactly two registers of four players
+
+    __m256i t0 = _mm256_load_si256( (__m256i*) t );
+    __m256i t1 = _mm256_load_si256( (__m256i*) ( t + 4 ) );
+    __m256i dt0 = _mm256_load_si256( (__m256i*) dt );
+    __m256i dt1 = _mm256_load_si256( (__m256i*) ( dt + 4 ) );
+    _mm256_store_si256( (__m256i*) t, _mm256_add_epi64( t0, dt0 ) );
+    _mm256_store_si256( (__m256i*) ( t + 4 ), _mm256_add_epi64( t1, dt1 ) );
+    _mm256_store_si256( (__m256i*) dt, _mm256_setzero_si256() );
+    _mm256_store_si256( (__m256i*) ( dt + 4 ), _mm256_setzero_si256() );
+}
+
+__attribute__((target("avx2"))) static int simulation_pack_avx2( struct player_state_hot * hot, struct player_state * state, uint64_t t )
+{
+    // data[i] = (uint8_t) t + i, 32 bytes at a time. player state is packed, so the stores are unaligned
+
+    const uint64_t previous_t = hot->t;
+
+    hot->t = t;
+
+    const __m256i index = _mm256_setr_epi8( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                            16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 );
+
+    // the 56 byte hot section is two overlapping stores, [0,32) and [24,56)
+
+    const __m256i base = _mm256_add_epi8( _mm256_set1_epi8( (char) t ), index );
+    _mm256_storeu_si256( (__m256i*) hot->data, base );
+    _mm256_storeu_si256( (__m256i*) ( hot->data + PLAYER_STATE_HOT_SIZE - 32 ), _mm256_add_epi8( base, _mm256_set1_epi8( PLAYER_STATE_HOT_SIZE - 32 ) ) );
+
+    if ( !player_state_cold_changed( previous_t, t ) )
+        return 0;
+
+    const uint8_t version = (uint8_t) ( t / PLAYER_STATE_COLD_INTERVAL );
+    const __m256i step = _mm256_set1_epi8( 32 );
+    __m256i value = _mm256_add_epi8( _mm256_set1_epi8( (char) ( version + PLAYER_STATE_HOT_SIZE ) ), index );
+    int i = PLAYER_STATE_HOT_SIZE;
+    for ( ; i + 32 <= PLAYER_STATE_SIZE; i += 32 )
+    {
+        _mm256_storeu_si256( (__m256i*) ( state->data + i ), value );
+        value = _mm256_add_epi8( value, step );
+    }
+
+    for ( ; i < PLAYER_STATE_SIZE; i++ )
+    {
+        state->data[i] = version + (uint8_t) i;
+    }
+
+    return 1;
+}
+
+#endif // #if defined(__x86_64__)
+
+static struct simulation_t * simulation_create( int capacity )
+{
+    assert( capacity > 0 );
+
+    struct simulation_t * simulation = (struct simulation_t*) malloc( sizeof(struct simulation_t) );
+    assert( simulation );
+    memset( simulation, 0, sizeof(struct simulation_t) );
+
+    simulation->num_blocks = ( capacity + SIMULATION_BLOCK_SIZE - 1 ) / SIMULATION_BLOCK_SIZE;
+    simulation->capacity = simulation->num_blocks * SIMULATION_BLOCK_SIZE;
+
+    const size_t array_bytes = sizeof(uint64_t) * simulation->capacity;         // a multiple of 64, as aligned_alloc requires
+    simulation->t = (uint64_t*) aligned_alloc( 64, array_bytes );
+    simulation->dt = (uint64_t*) aligned_alloc( 64, array_bytes );
+    simulation->block_dirty = (uint8_t*) malloc( simulation->num_blocks );
+    simulation->dirty_blocks = (uint32_t*) malloc( sizeof(uint32_t) * simulation->num_blocks );
+    assert( simulation->t );
+    assert( simulation->dt );
+    assert( simulation->block_dirty );
+    assert( simulation->dirty_blocks );
+    memset( simulation->t, 0, array_bytes );
+    memset( simulation->dt, 0, array_bytes );
+    memset( simulation->block_dirty, 0, simulation->num_blocks );
+
+    simulation->step_block = simulation_step_block_scalar;
+    simulation->pack = simulation_pack_scalar;
+    simulation->kernel_name = "scalar";
+
+#if defined(__x86_64__)
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        simulation->step_block = simulation_step_block_avx2;
+        simulation->pack = simulation_pack_avx2;
+        simulation->kernel_name = "avx2";
+    }
+#endif // #if defined(__x86_64__)
+
+    return simulation;
+}
+
+static void simulation_destroy( struct simulation_t * simulation )
+{
+    assert( simulation );
+    free( simulation->t );
+    free( simulation->dt );
+    free( simulation->block_dirty );
+    free( simulation->dirty_blocks );
+    free( simulation );
+}
+
+// a new session reuses the slab index of an old one, so its t must start from zero like a freshly inserted player state
+
+static void simulation_reset_player( struct simulation_t * simulation, int index )
+{
+    assert( index >= 0 && index < simulation->capacity );
+    simulation->t[index] = 0;
+    simulation->dt[index] = 0;
+}
+
+static void simulation_add_input( struct simulation_t * simulation, int index, uint64_t dt )
+{
+    assert( index >= 0 && index < simulation->capacity );
+
+    simulation->dt[index] += dt;
+
+    uint32_t block = index / SIMULATION_BLOCK_SIZE;
+    if ( !simulation->block_dirty[block] )
+    {
+        simulation->block_dirty[block] = 1;
+        simulation->dirty_blocks[simulation->num_dirty_blocks++] = block;
+    }
+}
+
+// step every block with input since the last step
+
+static void simulation_step( struct simulation_t * simulation )
+{
+    for ( int i = 0; i < simulation->num_dirty_blocks; i++ )
+    {
+        uint32_t block = simulation->dirty_blocks[i];
+        simulation->step_block( simulation->t + block * SIMULATION_BLOCK_SIZE, simulation->dt + block * SIMULATION_BLOCK_SIZE );
+        simulation->block_dirty[block] = 0;
+    }
+    simulation->num_dirty_blocks = 0;
+}
+
+// returns true if the cold section changed
+
+static int simulation_pack( struct simulation_t * simulation, int index, struct player_state_hot * hot, struct player_state * state )
+{
+    assert( index >= 0 && index < simulation->capacity );
+    return simulation->pack( hot, state, simulation->t[index] );
+}
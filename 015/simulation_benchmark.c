@@ -0,0 +1,435 @@
+/*
+    Microbenchmark for player simulation (per-record simulate_player vs. simulation.h)
+
+    Runs each simulation with the monolithic player state layout (all 1000 bytes of data rewritten per-input) and the
+    hot/cold split layout from shared.h (hot section per-input in its own array of cache lines, cold section in the
+    session slab only when it changes). L1D and last level cache read miss rates come from perf_event_open, and print
+    n/a where the CPU doesn't expose them.
+
+    USAGE:
+
+        make simulation_benchmark && ./simulation_benchmark [monolithic|split]
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/types.h>
+#include "shared.h"
+#include "session_table.h"
+#include "simulation.h"
+
+#define NUM_INPUTS                                                                    10000000
+
+#define BATCH_SIZE                                                                         64          // INPUT_BATCH_SIZE in server.c
+
+#define INPUTS_PER_SECOND                                                                 100          // per-player
+
+#define LAYOUT_MONOLITHIC                                                                   0
+#define LAYOUT_SPLIT                                                                        1
+
+static double platform_time()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+    return ts.tv_sec + ( (double) ( ts.tv_nsec ) ) / 1000000000.0;
+}
+
+static uint64_t random_uint64()
+{
+    uint64_t value = 0;
+    for ( int i = 0; i < 4; i++ )
+    {
+        value = ( value << 16 ) | ( rand() & 0xFFFF );
+    }
+    return value;
+}
+
+// the monolithic layout, as simulate_player and simulation.h were before the hot/cold split
+
+static void simulate_player_monolithic( struct player_state * state, uint64_t dt )
+{
+    state->t += dt;
+
+    for ( int i = 0; i < PLAYER_STATE_SIZE; i++ )
+    {
+        state->data[i] = (uint8_t) state->t + (uint8_t) i;
+    }
+}
+
+static int pack_monolithic_scalar( struct player_state_hot * hot, struct player_state * state, uint64_t t )
+{
+    (void) hot;
+    state->t = t;
+    for ( int i = 0; i < PLAYER_STATE_SIZE; i++ )
+    {
+        state->data[i] = (uint8_t) t + (uint8_t) i;
+    }
+    return 1;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) static int pack_monolithic_avx2( struct player_state_hot * hot, struct player_state * state, uint64_t t )
+{
+    (void) hot;
+
+    state->t = t;
+
+    const __m256i step = _mm256_set1_epi8( 32 );
+    __m256i value = _mm256_add_epi8( _mm256_set1_epi8( (char) t ), _mm256_setr_epi8( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                                                     16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 ) );
+    int i = 0;
+    for ( ; i + 32 <= PLAYER_STATE_SIZE; i += 32 )
+    {
+        _mm256_storeu_si256( (__m256i*) ( state->data + i ), value );
+        value = _mm256_add_epi8( value, step );
+    }
+
+    for ( ; i < PLAYER_STATE_SIZE; i++ )
+    {
+        state->data[i] = (uint8_t) t + (uint8_t) i;
+    }
+
+    return 1;
+}
+
+#endif // #if defined(__x86_64__)
+
+// same as simulate_player in server.c
+
+static void simulate_player_split( struct player_state_hot * hot, struct player_state * state, uint64_t dt )
+{
+    const uint64_t previous_t = hot->t;
+
+    hot->t += dt;
+
+    for ( int i = 0; i < PLAYER_STATE_HOT_SIZE; i++ )
+    {
+        hot->data[i] = (uint8_t) hot->t + (uint8_t) i;
+    }
+
+    if ( player_state_cold_changed( previous_t, hot->t ) )
+    {
+        player_state_pack_cold( state, hot->t );
+    }
+}
+
+/*
+    Cache read misses over one run. Generic perf events only cover L1D and the last level cache. For L2, run one
+    layout at a time under perf stat with the CPU's own event, eg. l2_rqsts.miss on Intel.
+*/
+
+#define CACHE_L1D_ACCESS                                                                    0
+#define CACHE_L1D_MISS                                                                      1
+#define CACHE_LL_ACCESS                                                                     2
+#define CACHE_LL_MISS                                                                       3
+#define NUM_CACHE_COUNTERS                                                                  4
+
+static int cache_counter_fd[NUM_CACHE_COUNTERS];
+
+static void cache_counters_open()
+{
+    const uint64_t config[NUM_CACHE_COUNTERS] =
+    {
+        PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16 ),
+        PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ),
+        PERF_COUNT_HW_CACHE_LL | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16 ),
+        PERF_COUNT_HW_CACHE_LL | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ),
+    };
+
+    for ( int i = 0; i < NUM_CACHE_COUNTERS; i++ )
+    {
+        struct perf_event_attr attr;
+        memset( &attr, 0, sizeof(attr) );
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = config[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        cache_counter_fd[i] = (int) syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+    }
+}
+
+static void cache_counters_start()
+{
+    for ( int i = 0; i < NUM_CACHE_COUNTERS; i++ )
+    {
+        if ( cache_counter_fd[i] < 0 )
+            continue;
+        ioctl( cache_counter_fd[i], PERF_EVENT_IOC_RESET, 0 );
+        ioctl( cache_counter_fd[i], PERF_EVENT_IOC_ENABLE, 0 );
+    }
+}
+
+static void cache_counters_stop( uint64_t * values )
+{
+    for ( int i = 0; i < NUM_CACHE_COUNTERS; i++ )
+    {
+        values[i] = 0;
+        if ( cache_counter_fd[i] < 0 )
+            continue;
+        ioctl( cache_counter_fd[i], PERF_EVENT_IOC_DISABLE, 0 );
+        if ( read( cache_counter_fd[i], &values[i], sizeof(uint64_t) ) != sizeof(uint64_t) )
+        {
+            values[i] = 0;
+        }
+    }
+}
+
+static void format_miss_rate( char * buffer, size_t size, int access, int miss, const uint64_t * values )
+{
+    if ( cache_counter_fd[access] < 0 || cache_counter_fd[miss] < 0 || values[access] == 0 )
+    {
+        snprintf( buffer, size, "n/a" );
+        return;
+    }
+    snprintf( buffer, size, "%.2f%%", values[miss] * 100.0 / values[access] );
+}
+
+static void report( const char * name, const char * layout, int num_players, double time, const uint64_t * cache )
+{
+    double ns_per_input = time * 1000000000.0 / NUM_INPUTS;
+    double players_per_core = NUM_INPUTS / time / INPUTS_PER_SECOND;
+    char l1d[32];
+    char ll[32];
+    format_miss_rate( l1d, sizeof(l1d), CACHE_L1D_ACCESS, CACHE_L1D_MISS, cache );
+    format_miss_rate( ll, sizeof(ll), CACHE_LL_ACCESS, CACHE_LL_MISS, cache );
+    printf( "%-12s %-10s %6d players: %7.1f ns per-input, %9.0f players per-core, L1D miss %7s, LL miss %7s\n", name, layout, num_players, ns_per_input, players_per_core, l1d, ll );
+}
+
+static double benchmark_soa( struct session_table_t * table, struct player_state_hot * hot, struct simulation_t * simulation, const uint64_t * session_ids, const uint32_t * inputs, const uint64_t * dt )
+{
+    struct player_state * state[BATCH_SIZE];
+
+    double start = platform_time();
+
+    for ( int i = 0; i < NUM_INPUTS; i += BATCH_SIZE )
+    {
+        for ( int j = 0; j < BATCH_SIZE; j++ )
+        {
+            state[j] = session_table_get( table, session_ids[inputs[i+j]] );
+            simulation_add_input( simulation, session_table_slab_index( table, state[j] ), dt[i+j] );
+        }
+
+        simulation_step( simulation );
+
+        for ( int j = 0; j < BATCH_SIZE; j++ )
+        {
+            int slab_index = session_table_slab_index( table, state[j] );
+            simulation_pack( simulation, slab_index, hot + slab_index, state[j] );
+        }
+    }
+
+    return platform_time() - start;
+}
+
+static struct session_table_t * create_table( int num_players, const uint64_t * session_ids )
+{
+    struct session_table_t * table = session_table_create( num_players );
+    for ( int i = 0; i < num_players; i++ )
+    {
+        session_table_insert( table, session_ids[i] );
+    }
+    return table;
+}
+
+// the hot sections by slab index, one cache line each, as the server keeps them
+
+static struct player_state_hot * create_hot( int num_players )
+{
+    struct player_state_hot * hot = (struct player_state_hot*) aligned_alloc( 64, sizeof(struct player_state_hot) * num_players );
+    assert( hot );
+    memset( hot, 0, sizeof(struct player_state_hot) * num_players );
+    return hot;
+}
+
+// the player state as the client would see it. with the split layout, t and the hot section come from the hot array
+
+static void get_player_state( struct session_table_t * table, struct player_state_hot * hot, int layout, uint64_t session_id, struct player_state * output )
+{
+    struct player_state * state = session_table_get( table, session_id );
+    *output = *state;
+    if ( layout == LAYOUT_SPLIT )
+    {
+        memcpy( output, hot + session_table_slab_index( table, state ), sizeof(struct player_state_hot) );
+    }
+}
+
+static void benchmark( int num_players, int layout )
+{
+    const char * layout_name = layout == LAYOUT_SPLIT ? "split" : "monolithic";
+
+    uint64_t * session_ids = (uint64_t*) malloc( sizeof(uint64_t) * num_players );
+    for ( int i = 0; i < num_players; i++ )
+    {
+        session_ids[i] = random_uint64();
+    }
+
+    // 10ms of player time per-input, like the client, so the cold section changes every 100 inputs per-player
+
+    uint32_t * inputs = (uint32_t*) malloc( sizeof(uint32_t) * NUM_INPUTS );
+    uint64_t * dt = (uint64_t*) malloc( sizeof(uint64_t) * NUM_INPUTS );
+    for ( int i = 0; i < NUM_INPUTS; i++ )
+    {
+        inputs[i] = rand() % num_players;
+        dt[i] = 10000000 + rand() % 100;
+    }
+
+    uint64_t cache[NUM_CACHE_COUNTERS];
+
+    // per-record
+
+    struct session_table_t * table = create_table( num_players, session_ids );
+
+    struct player_state_hot * hot = create_hot( num_players );
+
+    cache_counters_start();
+
+    double start = platform_time();
+
+    for ( int i = 0; i < NUM_INPUTS; i++ )
+    {
+        struct player_state * state = session_table_get( table, session_ids[inputs[i]] );
+        if ( layout == LAYOUT_SPLIT )
+        {
+            simulate_player_split( hot + session_table_slab_index( table, state ), state, dt[i] );
+        }
+        else
+        {
+            simulate_player_monolithic( state, dt[i] );
+        }
+    }
+
+    double time = platform_time() - start;
+
+    cache_counters_stop( cache );
+
+    report( "per-record", layout_name, num_players, time, cache );
+
+    // keep the per-record result to check the batched simulation against
+
+    struct player_state * expected = (struct player_state*) malloc( sizeof(struct player_state) * num_players );
+    for ( int i = 0; i < num_players; i++ )
+    {
+        get_player_state( table, hot, layout, session_ids[i], &expected[i] );
+    }
+
+    session_table_destroy( table );
+
+    free( hot );
+
+    // structure of arrays, forced to the scalar kernels, then with the kernels picked from CPUID
+
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        struct simulation_t * simulation = simulation_create( num_players );
+        if ( pass == 0 )
+        {
+            simulation->step_block = simulation_step_block_scalar;
+            simulation->pack = simulation_pack_scalar;
+            simulation->kernel_name = "scalar";
+        }
+
+        if ( layout == LAYOUT_MONOLITHIC )
+        {
+            simulation->pack = pack_monolithic_scalar;
+#if defined(__x86_64__)
+            if ( strcmp( simulation->kernel_name, "avx2" ) == 0 )
+            {
+                simulation->pack = pack_monolithic_avx2;
+            }
+#endif // #if defined(__x86_64__)
+        }
+
+        // a fresh table per-pass, so every pass starts from the same player state
+
+        table = create_table( num_players, session_ids );
+
+        hot = create_hot( num_players );
+
+        cache_counters_start();
+
+        time = benchmark_soa( table, hot, simulation, session_ids, inputs, dt );
+
+        cache_counters_stop( cache );
+
+        for ( int i = 0; i < num_players; i++ )
+        {
+            struct player_state state;
+            get_player_state( table, hot, layout, session_ids[i], &state );
+            assert( memcmp( &state, &expected[i], sizeof(struct player_state) ) == 0 );
+        }
+
+        char name[64];
+        snprintf( name, sizeof(name), "soa (%s)", simulation->kernel_name );
+        report( name, layout_name, num_players, time, cache );
+
+        session_table_destroy( table );
+
+        free( hot );
+
+        simulation_destroy( simulation );
+    }
+
+    free( expected );
+    free( session_ids );
+    free( inputs );
+    free( dt );
+}
+
+int main( int argc, char * argv[] )
+{
+    int run_monolithic = 1;
+    int run_split = 1;
+
+    if ( argc == 2 && strcmp( argv[1], "monolithic" ) == 0 )
+    {
+        run_split = 0;
+    }
+    else if ( argc == 2 && strcmp( argv[1], "split" ) == 0 )
+    {
+        run_monolithic = 0;
+    }
+    else if ( argc != 1 )
+    {
+        printf( "\nusage: simulation_benchmark [monolithic|split]\n\n" );
+        return 1;
+    }
+
+    cache_counters_open();
+
+    if ( cache_counter_fd[CACHE_L1D_MISS] < 0 )
+    {
+        printf( "note: perf_event_open failed, cache miss rates are not available\n" );
+    }
+
+    srand( (unsigned int) time( NULL ) );
+
+    const int num_players[] = { 500, 6000 };
+
+    for ( int i = 0; i < 2; i++ )
+    {
+        if ( run_monolithic )
+        {
+            benchmark( num_players[i], LAYOUT_MONOLITHIC );
+        }
+        if ( run_split )
+        {
+            benchmark( num_players[i], LAYOUT_SPLIT );
+        }
+    }
+
+    return 0;
+}
@@ -2,6 +2,7 @@ package main
 
 import (
 	"fmt"
+	"math"
 	"net"
 	"sync"
 	"time"
@@ -19,19 +20,22 @@ const MaxPacketSize = 1384
 const SocketBufferSize = 2*1024*1024
 
 const InputSize = 100
-const InputsPerPacket = 10
+const MaxInputsPerPacket = 10
 const InputHistory = 1024
 
 const PlayerDataSize = 1024
 
 const PlayerStateSize = 1000
 
-const InputPacketSize = 1 + 8 + 8 + 8 + (8 + InputSize) * InputsPerPacket
+const InputPacketHeaderSize = 1 + 8 + 8 + 1 + 8 + 8
+const InputPacketSize = InputPacketHeaderSize + (8 + InputSize) * MaxInputsPerPacket
 const JoinRequestPacketSize = 1 + 8 + 8 + PlayerDataSize
-const JoinResponsePacketSize = 1 + 8 + 8 + 8
-const StatsRequestPacketSize = 1 + 8 + 8
-const StatsResponsePacketSize = 1 + 8 + 8
-const PlayerStatePacketSize = 1 + 8 + PlayerStateSize
+const JoinResponsePacketSize = 1 + 8 + 8 + 8 + 1
+const StatsRequestPacketSize = 1 + 8 + 8 + 8*9
+const StatsResponsePacketSize = 1 + 8 + 8 + 8*9
+const PlayerStatePacketSize = 1 + 8 + 8 + PlayerStateSize
+const PlayerStateDeltaHeaderSize = 1 + 8 + 8 + 8 + 2
+const PlayerStateHistory = 32
 
 const JoinRequestPacket = 1
 const JoinResponsePacket = 2
@@ -39,8 +43,17 @@ const InputPacket = 3
 const StatsRequestPacket = 4
 const StatsResponsePacket = 5
 const PlayerStatePacket = 6
+const PlayerStateDeltaPacket = 7
+const EncodedInputPacket = 8
+
+const FeatureEncodedInputs = 1
+const MaxEncodedInputBytes = 255
 
 var numClients int
+var packetLoss float64
+var deltaEnabled bool
+var acksEnabled bool
+var encodingEnabled bool
 
 var quit uint64
 var joined uint64
@@ -49,11 +62,20 @@ var packetsSent uint64
 var packetsReceived uint64
 var totalInputsProcessed uint64
 var playerStatePacketsReceived uint64
+var inputsDropped uint64
+var playerStateBytesReceived uint64
+var playerStateDeltasReceived uint64
+var inputBytesSent uint64
+var inputsSent uint64
+var queueWaitP99 uint64
+var simulationP99 uint64
+var playerStateAgeP99 uint64
 
 type Input struct {
 	sequence uint64
 	t        uint64
 	dt       uint64
+	sentTime time.Time
 	input    []byte	
 }
 
@@ -69,6 +91,18 @@ func GetInt(name string, defaultValue int) int {
 	return int(value)
 }
 
+func GetFloat(name string, defaultValue float64) float64 {
+	valueString, ok := os.LookupEnv(name)
+	if !ok {
+		return defaultValue
+	}
+	value, err := strconv.ParseFloat(valueString, 64)
+	if err != nil {
+		return defaultValue
+	}
+	return value
+}
+
 func GetAddress(name string, defaultValue string) net.UDPAddr {
 	valueString, ok := os.LookupEnv(name)
 	if !ok {
@@ -87,8 +121,32 @@ func main() {
 
 	numClients = GetInt("NUM_CLIENTS", 1)
 
+	packetLoss = GetFloat("PACKET_LOSS", 0.0)
+
+	deltaEnabled = GetInt("DELTA", 0) != 0
+
+	acksEnabled = GetInt("ACKS", 1) != 0
+
+	encodingEnabled = GetInt("INPUT_ENCODING", 1) != 0
+
 	fmt.Printf("starting %d clients\n", numClients)
 
+	if packetLoss > 0.0 {
+		fmt.Printf("simulating %.1f%% input packet loss\n", packetLoss)
+	}
+
+	if deltaEnabled {
+		fmt.Printf("acking player state baselines for delta compression\n")
+	}
+
+	if !encodingEnabled {
+		fmt.Printf("input encoding is disabled\n")
+	}
+
+	if !acksEnabled {
+		fmt.Printf("sending the last %d inputs in every packet\n", MaxInputsPerPacket)
+	}
+
 	fmt.Printf("server address is %s\n", serverAddress.String())
 
 	var wg sync.WaitGroup
@@ -110,6 +168,11 @@ func main() {
 	prev_sent := uint64(0)
 	prev_processed := uint64(0)
 	prev_player_states := uint64(0)
+	prev_dropped := uint64(0)
+	prev_player_state_bytes := uint64(0)
+	prev_player_state_deltas := uint64(0)
+	prev_input_bytes := uint64(0)
+	prev_inputs := uint64(0)
 
  	for {
 		select {
@@ -123,7 +186,37 @@ func main() {
 	 		sent_delta := sent - prev_sent
 	 		processed_delta := processed - prev_processed
 	 		player_state_delta := player_states - prev_player_states
-	 		fmt.Printf("inputs sent delta %d, inputs processed delta %d, player state delta %d\n", sent_delta, processed_delta, player_state_delta)
+	 		if packetLoss > 0.0 {
+	 			// each packet sent carries one new input, so inputs the server never processed are lost, and the rest of
+	 			// the inputs whose packet was dropped were recovered. this assumes the server has no other clients
+	 			dropped := atomic.LoadUint64(&inputsDropped)
+	 			dropped_delta := dropped - prev_dropped
+	 			lost_delta := uint64(0)
+	 			if processed_delta < sent_delta {
+	 				lost_delta = sent_delta - processed_delta
+	 			}
+	 			recovered_delta := uint64(0)
+	 			if lost_delta < dropped_delta {
+	 				recovered_delta = dropped_delta - lost_delta
+	 			}
+	 			fmt.Printf("inputs sent delta %d, inputs processed delta %d, player state delta %d, inputs dropped delta %d, inputs lost delta %d, inputs recovered delta %d\n", sent_delta, processed_delta, player_state_delta, dropped_delta, lost_delta, recovered_delta)
+	 			prev_dropped = dropped
+	 		} else {
+	 			fmt.Printf("inputs sent delta %d, inputs processed delta %d, player state delta %d\n", sent_delta, processed_delta, player_state_delta)
+	 		}
+			player_state_bytes := atomic.LoadUint64(&playerStateBytesReceived)
+			player_state_deltas := atomic.LoadUint64(&playerStateDeltasReceived)
+			fmt.Printf("player state bytes delta %d, player state deltas received %d\n", player_state_bytes-prev_player_state_bytes, player_state_deltas-prev_player_state_deltas)
+			fmt.Printf("server p99 queue wait %.1fus, simulation %.1fus, player state age %.1fus\n", float64(atomic.LoadUint64(&queueWaitP99))/1000.0, float64(atomic.LoadUint64(&simulationP99))/1000.0, float64(atomic.LoadUint64(&playerStateAgeP99))/1000.0)
+			input_bytes := atomic.LoadUint64(&inputBytesSent)
+			inputs := atomic.LoadUint64(&inputsSent)
+			if sent_delta > 0 {
+				fmt.Printf("input bytes delta %d (%.2f Mbit/s), inputs per packet %.2f\n", input_bytes-prev_input_bytes, float64(input_bytes-prev_input_bytes)*8/1000000.0, float64(inputs-prev_inputs)/float64(sent_delta))
+			}
+			prev_input_bytes = input_bytes
+			prev_inputs = inputs
+			prev_player_state_bytes = player_state_bytes
+			prev_player_state_deltas = player_state_deltas
 			prev_sent = sent
 			prev_processed = processed
 			prev_player_states = player_states
@@ -142,7 +235,9 @@ func main() {
 }
 
 func sampleInput(sequence uint64, t uint64, dt uint64) Input {
-	return Input{input: make([]byte, InputSize), sequence: sequence, t: t, dt: dt}
+	input := make([]byte, InputSize)
+	binary.LittleEndian.PutUint32(input, uint32(sequence))
+	return Input{input: input, sequence: sequence, t: t, dt: dt}
 }
 
 func addInput(sequence uint64, inputBuffer []Input, input Input) {
@@ -164,7 +259,7 @@ func writeJoinRequestPacket(sessionId uint64, sentTime uint64, playerData []byte
 	return packet[:packetIndex]
 }
 
-func writeInputPacket(sessionId uint64, sequence uint64, inputBuffer []Input) []byte {
+func writeInputPacket(sessionId uint64, sequence uint64, baseline uint64, numInputs int, inputBuffer []Input) []byte {
 	index := sequence % InputHistory
 	input := inputBuffer[index]
 	packet := make([]byte, InputPacketSize)
@@ -175,13 +270,19 @@ func writeInputPacket(sessionId uint64, sequence uint64, inputBuffer []Input) []
 	packetIndex += 8
 	binary.LittleEndian.PutUint64(packet[packetIndex:], sequence)
 	packetIndex += 8
+	numInputsIndex := packetIndex
+	packetIndex++
 	binary.LittleEndian.PutUint64(packet[packetIndex:], input.t)
 	packetIndex += 8
-	for i := 0; i < InputsPerPacket; i++ {
+	binary.LittleEndian.PutUint64(packet[packetIndex:], baseline)
+	packetIndex += 8
+	count := 0
+	for count < numInputs {
 		binary.LittleEndian.PutUint64(packet[packetIndex:], input.dt)
 		packetIndex += 8
 		copy(packet[packetIndex:], input.input)
 		packetIndex += InputSize
+		count++
 		sequence --
 		index = sequence % InputHistory
 		input = inputBuffer[index]
@@ -189,9 +290,139 @@ func writeInputPacket(sessionId uint64, sequence uint64, inputBuffer []Input) []
 			break
 		}
 	}
+	packet[numInputsIndex] = byte(count)
+	return packet[:packetIndex]
+}
+
+// encodeInput writes input as runs of [skip][length][bytes XOR newest]. returns -1 if it doesn't fit in MaxEncodedInputBytes
+
+func encodeInput(encoded []byte, input []byte, newest []byte) int {
+	bytes := 0
+	i := 0
+	for i < InputSize {
+		start := i
+		for i < InputSize && input[i] == newest[i] && i-start < 255 {
+			i++
+		}
+		if i == InputSize {
+			break
+		}
+		skip := i - start
+		length := 0
+		for i < InputSize && input[i] != newest[i] && length < 255 {
+			if bytes+2+length >= MaxEncodedInputBytes {
+				return -1
+			}
+			encoded[bytes+2+length] = input[i] ^ newest[i]
+			length++
+			i++
+		}
+		if bytes+2 > MaxEncodedInputBytes {
+			return -1
+		}
+		encoded[bytes] = byte(skip)
+		encoded[bytes+1] = byte(length)
+		bytes += 2 + length
+	}
+	return bytes
+}
+
+// writeEncodedInputPacket writes the same inputs as writeInputPacket, with the dts up front, the newest input in full and
+// older inputs XOR encoded against it. returns nil if that isn't smaller, so the caller sends the plain packet instead
+
+func writeEncodedInputPacket(sessionId uint64, sequence uint64, baseline uint64, numInputs int, inputBuffer []Input) []byte {
+	inputs := make([]Input, 0, MaxInputsPerPacket)
+	for len(inputs) < numInputs {
+		input := inputBuffer[sequence%InputHistory]
+		if input.sequence != sequence {
+			break
+		}
+		inputs = append(inputs, input)
+		sequence--
+	}
+	if len(inputs) == 0 {
+		return nil
+	}
+	newest := inputs[0]
+	packet := make([]byte, InputPacketSize)
+	packetIndex := 0
+	packet[0] = EncodedInputPacket
+	packetIndex++
+	binary.LittleEndian.PutUint64(packet[packetIndex:], sessionId)
+	packetIndex += 8
+	binary.LittleEndian.PutUint64(packet[packetIndex:], newest.sequence)
+	packetIndex += 8
+	packet[packetIndex] = byte(len(inputs))
+	packetIndex++
+	binary.LittleEndian.PutUint64(packet[packetIndex:], newest.t)
+	packetIndex += 8
+	binary.LittleEndian.PutUint64(packet[packetIndex:], baseline)
+	packetIndex += 8
+	for _, input := range inputs {
+		binary.LittleEndian.PutUint64(packet[packetIndex:], input.dt)
+		packetIndex += 8
+	}
+	copy(packet[packetIndex:], newest.input)
+	packetIndex += InputSize
+	for _, input := range inputs[1:] {
+		if packetIndex+1+MaxEncodedInputBytes > len(packet) {
+			return nil
+		}
+		encodedBytes := encodeInput(packet[packetIndex+1:packetIndex+1+MaxEncodedInputBytes], input.input, newest.input)
+		if encodedBytes < 0 {
+			return nil
+		}
+		packet[packetIndex] = byte(encodedBytes)
+		packetIndex += 1 + encodedBytes
+	}
+	if packetIndex >= InputPacketHeaderSize+(8+InputSize)*len(inputs) {
+		return nil
+	}
 	return packet[:packetIndex]
 }
 
+// inputRedundancy is the number of packets each input should be sent in so that the chance of losing all of them is under 0.1%
+
+func inputRedundancy(loss float64) int {
+	if loss <= 0.0 {
+		return 1
+	}
+	if loss >= 0.5 {
+		return MaxInputsPerPacket
+	}
+	redundancy := int(math.Ceil(math.Log(0.001) / math.Log(loss)))
+	if redundancy < 1 {
+		redundancy = 1
+	}
+	if redundancy > MaxInputsPerPacket {
+		redundancy = MaxInputsPerPacket
+	}
+	return redundancy
+}
+
+// applyDeltaPacket rebuilds the player state from a delta against a baseline state. returns false if the delta is malformed
+
+func applyDeltaPacket(state []byte, baselineState []byte, packetData []byte) bool {
+	copy(state, baselineState)
+	copy(state[0:8], packetData[9:17])
+	numRanges := int(binary.LittleEndian.Uint16(packetData[25:]))
+	index := PlayerStateDeltaHeaderSize
+	for i := 0; i < numRanges; i++ {
+		if index+4 > len(packetData) {
+			return false
+		}
+		offset := int(binary.LittleEndian.Uint16(packetData[index:]))
+		length := int(binary.LittleEndian.Uint16(packetData[index+2:]))
+		index += 4
+		if offset+length > len(state) || index+length > len(packetData) {
+			return false
+		}
+		copy(state[offset:offset+length], packetData[index:index+length])
+		index += length
+	}
+	return true
+}
+
 func writeStatsRequestPacket() []byte {
 	packet := make([]byte, StatsRequestPacketSize)
 	packet[0] = StatsRequestPacket
@@ -221,6 +452,44 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 	buffer := make([]byte, MaxPacketSize)
 
+	// the most recent player states received, so deltas can be applied against the baseline we acked
+
+	playerStateHistory := make([][]byte, PlayerStateHistory)
+	for i := range playerStateHistory {
+		playerStateHistory[i] = make([]byte, 8+PlayerStateSize)
+	}
+	playerStateHistoryIndex := 0
+
+	baseline := uint64(0)
+
+	storePlayerState := func(state []byte) {
+		copy(playerStateHistory[playerStateHistoryIndex%PlayerStateHistory], state)
+		playerStateHistoryIndex++
+		t := binary.LittleEndian.Uint64(state[0:8])
+		if deltaEnabled && t > atomic.LoadUint64(&baseline) {
+			atomic.StoreUint64(&baseline, t)
+		}
+	}
+
+	deltaState := make([]byte, 8+PlayerStateSize)
+
+	// the last input sequence the server has acked, and the number of player state packets received, for loss estimation
+
+	ackedSequence := uint64(0)
+
+	playerStatesReceived := uint64(0)
+
+	// set when the server advertises that it accepts encoded input packets in the join response
+
+	serverFeatures := uint64(0)
+
+	storeAck := func(ack uint64) {
+		if ack > atomic.LoadUint64(&ackedSequence) {
+			atomic.StoreUint64(&ackedSequence, ack)
+		}
+		atomic.AddUint64(&playerStatesReceived, 1)
+	}
+
 	go func() {
 		for {
 	
@@ -259,15 +528,46 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 				atomic.StoreUint64(&serverTime, startTime)
 
+				atomic.StoreUint64(&serverFeatures, uint64(packetData[1+8+8+8]))
+
 			} else if packetType == StatsResponsePacket && packetBytes == StatsResponsePacketSize {
 
 			packetInputsProcessed := binary.LittleEndian.Uint64(packetData[1:])
 
 				atomic.StoreUint64(&totalInputsProcessed, packetInputsProcessed)
 
+				// latency percentiles are p50, p99, p999 in nanoseconds for queue wait, simulation and player state age
+
+				atomic.StoreUint64(&queueWaitP99, binary.LittleEndian.Uint64(packetData[17+8:]))
+				atomic.StoreUint64(&simulationP99, binary.LittleEndian.Uint64(packetData[17+24+8:]))
+				atomic.StoreUint64(&playerStateAgeP99, binary.LittleEndian.Uint64(packetData[17+48+8:]))
+
 			} else if packetType == PlayerStatePacket && packetBytes == PlayerStatePacketSize {
 
+				storeAck(binary.LittleEndian.Uint64(packetData[1:]))
+
+				storePlayerState(packetData[9:])
+
 				atomic.AddUint64(&playerStatePacketsReceived, 1)
+				atomic.AddUint64(&playerStateBytesReceived, uint64(packetBytes))
+
+			} else if packetType == PlayerStateDeltaPacket && packetBytes >= PlayerStateDeltaHeaderSize {
+
+				storeAck(binary.LittleEndian.Uint64(packetData[1:]))
+
+				deltaBaseline := binary.LittleEndian.Uint64(packetData[17:])
+
+				for _, baselineState := range playerStateHistory {
+					if binary.LittleEndian.Uint64(baselineState[0:8]) == deltaBaseline {
+						if applyDeltaPacket(deltaState, baselineState, packetData) {
+							storePlayerState(deltaState)
+							atomic.AddUint64(&playerStatePacketsReceived, 1)
+							atomic.AddUint64(&playerStateDeltasReceived, 1)
+							atomic.AddUint64(&playerStateBytesReceived, uint64(packetBytes))
+						}
+						break
+					}
+				}
 
 			}
 
@@ -351,8 +651,31 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 	sequence := uint64(1000)
 
+	// an input packet carries the inputs the server hasn't acked yet, newest first, up to MaxInputsPerPacket.
+	//
+	// inputs still in flight are only resent to a depth that depends on the loss we see (redundancy). once the oldest
+	// unacked input is overdue (older than the smoothed ack rtt plus a tick), every unacked input is resent until acked.
+	//
+	// the server only acks the contiguous prefix of inputs it has, and ignores packets that don't reach back to its ack.
+	// if more than MaxInputsPerPacket inputs are overdue, the packet carries the oldest ones instead of the newest, so the
+	// server catches up in order. this happens with acks disabled too, otherwise one burst of loss would stall the player.
+
 	inputBuffer := make([]Input, InputHistory)
 
+	redundancy := 1
+
+	rtt := 100 * time.Millisecond
+
+	lastAckedSequence := sequence - 1
+
+	atomic.StoreUint64(&ackedSequence, lastAckedSequence)
+
+	lossTime := time.Now()
+	lossPacketsSent := uint64(0)
+	lossPlayerStatesReceived := uint64(0)
+
+	packetsSentByClient := uint64(0)
+
 	ticker := time.NewTicker(time.Millisecond * 10)
 
  	for {
@@ -360,15 +683,92 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 	 	case <-ticker.C:
 
+			now := time.Now()
+
 			input := sampleInput(sequence, t, dt)
 
+			input.sentTime = now
+
 			addInput(sequence, inputBuffer, input)
 
-			inputPacket := writeInputPacket(sessionId, sequence, inputBuffer)
+			// smoothed rtt from the time the newest acked input was first sent
+
+			acked := atomic.LoadUint64(&ackedSequence)
+			if acked > lastAckedSequence && acked < sequence {
+				ackedInput := inputBuffer[acked%InputHistory]
+				if ackedInput.sequence == acked {
+					rtt += (now.Sub(ackedInput.sentTime) - rtt) / 8
+				}
+				lastAckedSequence = acked
+			}
+
+			// once per-second, adapt redundancy to the loss seen over the last second (input packets without a player state reply)
+
+			if now.Sub(lossTime) >= time.Second {
+				sentDelta := packetsSentByClient - lossPacketsSent
+				receivedDelta := atomic.LoadUint64(&playerStatesReceived) - lossPlayerStatesReceived
+				if sentDelta > 0 {
+					loss := 0.0
+					if receivedDelta < sentDelta {
+						loss = 1.0 - float64(receivedDelta)/float64(sentDelta)
+					}
+					redundancy = inputRedundancy(loss)
+				}
+				lossTime = now
+				lossPacketsSent = packetsSentByClient
+				lossPlayerStatesReceived += receivedDelta
+			}
+
+			numInputs := MaxInputsPerPacket
 
-			conn.WriteToUDP(inputPacket, serverAddress)
+			packetSequence := sequence
+
+			oldestUnacked := inputBuffer[(lastAckedSequence+1)%InputHistory]
+			overdue := oldestUnacked.sequence == lastAckedSequence+1 && now.Sub(oldestUnacked.sentTime) > rtt+10*time.Millisecond
+
+			if overdue && sequence-lastAckedSequence > MaxInputsPerPacket {
+				packetSequence = lastAckedSequence + MaxInputsPerPacket
+				inputBuffer[packetSequence%InputHistory].sentTime = now
+			} else if acksEnabled {
+				unacked := int(sequence - lastAckedSequence)
+				numInputs = redundancy
+				if overdue {
+					numInputs = unacked
+				}
+				if numInputs > unacked {
+					numInputs = unacked
+				}
+				if numInputs > MaxInputsPerPacket {
+					numInputs = MaxInputsPerPacket
+				}
+				if numInputs < 1 {
+					numInputs = 1
+				}
+			}
+
+			var inputPacket []byte
+
+			if encodingEnabled && (atomic.LoadUint64(&serverFeatures)&FeatureEncodedInputs) != 0 {
+				inputPacket = writeEncodedInputPacket(sessionId, packetSequence, atomic.LoadUint64(&baseline), numInputs, inputBuffer)
+			}
+
+			if inputPacket == nil {
+				inputPacket = writeInputPacket(sessionId, packetSequence, atomic.LoadUint64(&baseline), numInputs, inputBuffer)
+			}
+
+			packetInputs := int(inputPacket[1+8+8])
+
+			if packetLoss > 0.0 && rand.Float64()*100.0 < packetLoss {
+				atomic.AddUint64(&inputsDropped, 1)
+			} else {
+				conn.WriteToUDP(inputPacket, serverAddress)
+			}
 
 			atomic.AddUint64(&packetsSent, 1)
+			atomic.AddUint64(&inputsSent, uint64(packetInputs))
+			atomic.AddUint64(&inputBytesSent, uint64(len(inputPacket)))
+
+			packetsSentByClient++
 
 			t += dt
 
@@ -6,6 +6,7 @@ require (
 	github.com/cilium/ebpf v0.15.0
 	github.com/maurice2k/tcpserver v1.2.0
 	github.com/stretchr/testify v1.4.0
+	golang.org/x/sys v0.15.0
 )
 
 require (
@@ -13,6 +14,5 @@ require (
 	github.com/maurice2k/ultrapool v1.1.1 // indirect
 	github.com/pmezard/go-difflib v1.0.0 // indirect
 	golang.org/x/exp v0.0.0-20230224173230-c95f2b4c22f2 // indirect
-	golang.org/x/sys v0.15.0 // indirect
 	gopkg.in/yaml.v2 v2.2.7 // indirect
 )
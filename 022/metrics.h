@@ -0,0 +1,103 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+    Per-thread metrics block.
+
+    Each worker thread owns one block and is the only writer, so updates are plain loads and stores instead of atomic
+    read-modify-writes. Counters, gauges and histograms each start on their own cache line, and the block is padded
+    to a cache line, so workers never write to a line that another worker or the main thread is writing to.
+
+    The main thread reads the blocks with relaxed loads once per-second and sums them.
+*/
+
+#define METRICS_CACHE_LINE_SIZE                                                            64
+
+#define METRICS_MAX_COUNTERS                                                               24
+#define METRICS_MAX_GAUGES                                                                  8
+#define METRICS_MAX_HISTOGRAMS                                                              4
+#define METRICS_HISTOGRAM_BUCKETS                                                          32
+
+struct metrics_t
+{
+    uint64_t counters[METRICS_MAX_COUNTERS] __attribute__((aligned(METRICS_CACHE_LINE_SIZE)));
+    uint64_t gauges[METRICS_MAX_GAUGES] __attribute__((aligned(METRICS_CACHE_LINE_SIZE)));
+    uint64_t histograms[METRICS_MAX_HISTOGRAMS][METRICS_HISTOGRAM_BUCKETS] __attribute__((aligned(METRICS_CACHE_LINE_SIZE)));
+} __attribute__((aligned(METRICS_CACHE_LINE_SIZE)));
+
+static inline void metrics_add( struct metrics_t * metrics, int counter, uint64_t value )
+{
+    __atomic_store_n( &metrics->counters[counter], metrics->counters[counter] + value, __ATOMIC_RELAXED );
+}
+
+static inline void metrics_set( struct metrics_t * metrics, int gauge, uint64_t value )
+{
+    __atomic_store_n( &metrics->gauges[gauge], value, __ATOMIC_RELAXED );
+}
+
+static inline int metrics_histogram_bucket( uint64_t value )
+{
+    // bucket zero is for zero, bucket n is for values in [2^(n-1), 2^n)
+
+    int bucket = value ? 64 - __builtin_clzll( value ) : 0;
+    return bucket < METRICS_HISTOGRAM_BUCKETS ? bucket : METRICS_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void metrics_sample( struct metrics_t * metrics, int histogram, uint64_t value )
+{
+    uint64_t * bucket = &metrics->histograms[histogram][metrics_histogram_bucket( value )];
+    __atomic_store_n( bucket, *bucket + 1, __ATOMIC_RELAXED );
+}
+
+static uint64_t metrics_sum_counter( const struct metrics_t * metrics, int num_metrics, int counter )
+{
+    uint64_t sum = 0;
+    for ( int i = 0; i < num_metrics; i++ )
+    {
+        sum += __atomic_load_n( &metrics[i].counters[counter], __ATOMIC_RELAXED );
+    }
+    return sum;
+}
+
+static uint64_t metrics_sum_gauge( const struct metrics_t * metrics, int num_metrics, int gauge )
+{
+    uint64_t sum = 0;
+    for ( int i = 0; i < num_metrics; i++ )
+    {
+        sum += __atomic_load_n( &metrics[i].gauges[gauge], __ATOMIC_RELAXED );
+    }
+    return sum;
+}
+
+static void metrics_sum_histogram( const struct metrics_t * metrics, int num_metrics, int histogram, uint64_t * buckets )
+{
+    memset( buckets, 0, sizeof(uint64_t) * METRICS_HISTOGRAM_BUCKETS );
+    for ( int i = 0; i < num_metrics; i++ )
+    {
+        for ( int j = 0; j < METRICS_HISTOGRAM_BUCKETS; j++ )
+        {
+            buckets[j] += __atomic_load_n( &metrics[i].histograms[histogram][j], __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static void metrics_print_histogram( const char * name, const uint64_t * current, const uint64_t * previous )
+{
+    // prints the non-empty buckets of the delta between two histogram sums
+
+    printf( "%s:", name );
+    for ( int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++ )
+    {
+        uint64_t delta = current[i] - previous[i];
+        if ( delta == 0 )
+            continue;
+        if ( i == 0 )
+            printf( " [0] %" PRId64, delta );
+        else
+            printf( " [%" PRId64 ",%" PRId64 "] %" PRId64, (uint64_t) 1 << ( i - 1 ), ( (uint64_t) 1 << i ) - 1, delta );
+    }
+    printf( "\n" );
+}
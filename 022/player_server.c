@@ -18,29 +18,91 @@
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 #include <xdp/libxdp.h>
+#include <xdp/xsk.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
 #include "shared.h"
+#include "session_table.h"
+#include "metrics.h"
 
 struct bpf_t
 {
     int interface_index;
+    int num_cpus;
+    int players_per_cpu;
+    struct bpf_object * object;
     struct xdp_program * program;
     bool attached_native;
     bool attached_skb;
     int counters_fd;
     int inputs_processed_fd;
     int server_stats_fd;
+    int server_config_fd;
+    int xsk_map_fd;
+    int worker_load_fd;
+    int cpu_map_fd;
+    int tx_port_fd;
+    int cpumap_program_fd;
+    int trace_buffer_fd;
+    int player_state_age_fd;
+    int worker_latency_fd;
+    int input_buffer_state_fd;
+    int input_buffer_size;
 };
 
 static struct bpf_t bpf;
 
-int bpf_init( struct bpf_t * bpf, const char * interface_name )
+/*
+    Size the input buffers to hold INPUT_BUFFER_MAX_DELAY_MS of input for every player on the cpu. Each input packet
+    is one record, and lost packets only add inputs to the next record, so one input per-record is the steady state.
+    Ring buffers must be a power of two number of pages.
+*/
+
+#define INPUT_RECORD_BYTES                                      ( 8 + 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) )          // ring buffer record header + one input record
+
+static int input_buffer_size( int players_per_cpu )
+{
+    uint64_t bytes = (uint64_t) players_per_cpu * INPUTS_PER_SECOND * INPUT_BUFFER_MAX_DELAY_MS / 1000 * INPUT_RECORD_BYTES;
+
+    uint64_t size = MIN_INPUT_BUFFER_SIZE;
+    while ( size < bytes && size < MAX_INPUT_BUFFER_SIZE )
+    {
+        size <<= 1;
+    }
+
+    return (int) size;
+}
+
+static int bpf_set_max_entries( struct bpf_object * object, const char * map_name, int max_entries )
+{
+    struct bpf_map * map = bpf_object__find_map_by_name( object, map_name );
+    if ( !map )
+    {
+        printf( "\nerror: could not find map '%s'\n\n", map_name );
+        return 1;
+    }
+    if ( bpf_map__set_max_entries( map, max_entries ) != 0 )
+    {
+        printf( "\nerror: could not set max entries for map '%s'\n\n", map_name );
+        return 1;
+    }
+    return 0;
+}
+
+int bpf_init( struct bpf_t * bpf, const char * interface_name, int num_cpus, int players_per_cpu )
 {
     // we can only run xdp programs as root
 
@@ -94,10 +156,53 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
 
     printf( "loading player_server_xdp...\n" );
 
-    bpf->program = xdp_program__open_file( "player_server_xdp.o", "xdp", NULL );
+    bpf->num_cpus = num_cpus;
+    bpf->players_per_cpu = players_per_cpu;
+
+    bpf->object = bpf_object__open_file( "player_server_xdp.o", NULL );
+    if ( libbpf_get_error( bpf->object ) )
+    {
+        printf( "\nerror: could not open player_server_xdp.o\n\n" );
+        bpf->object = NULL;
+        return 1;
+    }
+
+    // size the per-cpu maps for this machine. maps pinned by a previous run may have a different size, so remove them first.
+    // input buffer state goes too, so the high water marks are for this run's input buffer size
+
+    const char * resized_maps[] = { "session_map", "input_buffer_map", "player_state_map", "inputs_processed_map", "xsk_map", "worker_load_map", "cpu_map", "worker_latency_map", "input_buffer_state_map" };
+
+    for ( int i = 0; i < (int) ( sizeof(resized_maps) / sizeof(resized_maps[0]) ); i++ )
+    {
+        char pin_path[256];
+        snprintf( pin_path, sizeof(pin_path), "/sys/fs/bpf/%s", resized_maps[i] );
+        unlink( pin_path );
+    }
+
+    if ( bpf_set_max_entries( bpf->object, "session_map", num_cpus * players_per_cpu ) != 0 ||
+         bpf_set_max_entries( bpf->object, "input_buffer_map", num_cpus ) != 0 ||
+         bpf_set_max_entries( bpf->object, "player_state_map", num_cpus ) != 0 ||
+         bpf_set_max_entries( bpf->object, "inputs_processed_map", num_cpus ) != 0 ||
+         bpf_set_max_entries( bpf->object, "xsk_map", num_cpus ) != 0 ||
+         bpf_set_max_entries( bpf->object, "worker_load_map", num_cpus ) != 0 ||
+         bpf_set_max_entries( bpf->object, "cpu_map", num_cpus ) != 0 ||
+         bpf_set_max_entries( bpf->object, "worker_latency_map", num_cpus ) != 0 )
+    {
+        return 1;
+    }
+
+    struct bpf_map * player_state_inner = bpf_map__inner_map( bpf_object__find_map_by_name( bpf->object, "player_state_map" ) );
+    if ( !player_state_inner || bpf_map__set_max_entries( player_state_inner, players_per_cpu ) != 0 )
+    {
+        printf( "\nerror: could not set players per-cpu\n\n" );
+        return 1;
+    }
+
+    bpf->program = xdp_program__from_bpf_obj( bpf->object, "xdp" );
     if ( libxdp_get_error( bpf->program ) ) 
     {
         printf( "\nerror: could not load player_server_xdp program\n\n");
+        bpf->program = NULL;
         return 1;
     }
 
@@ -165,11 +270,167 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
         return 1;
     }
 
+    // get the file handle to the server config
+
+    bpf->server_config_fd = bpf_obj_get( "/sys/fs/bpf/server_config" );
+    if ( bpf->server_config_fd <= 0 )
+    {
+        printf( "\nerror: could not get server config: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    // get the file handle to the AF_XDP socket map
+
+    bpf->xsk_map_fd = bpf_obj_get( "/sys/fs/bpf/xsk_map" );
+    if ( bpf->xsk_map_fd <= 0 )
+    {
+        printf( "\nerror: could not get xsk map: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    // get the file handle to the trace buffer
+
+    bpf->trace_buffer_fd = bpf_obj_get( "/sys/fs/bpf/trace_buffer" );
+    if ( bpf->trace_buffer_fd <= 0 )
+    {
+        printf( "\nerror: could not get trace buffer: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    // get the file handles to the latency histograms
+
+    bpf->player_state_age_fd = bpf_obj_get( "/sys/fs/bpf/player_state_age_map" );
+    bpf->worker_latency_fd = bpf_obj_get( "/sys/fs/bpf/worker_latency_map" );
+    if ( bpf->player_state_age_fd <= 0 || bpf->worker_latency_fd <= 0 )
+    {
+        printf( "\nerror: could not get latency histograms: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bpf->input_buffer_state_fd = bpf_obj_get( "/sys/fs/bpf/input_buffer_state_map" );
+    if ( bpf->input_buffer_state_fd <= 0 )
+    {
+        printf( "\nerror: could not get input buffer state: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    // get the file handles for steering inputs to the least loaded worker cpu
+
+    bpf->worker_load_fd = bpf_obj_get( "/sys/fs/bpf/worker_load_map" );
+    bpf->cpu_map_fd = bpf_obj_get( "/sys/fs/bpf/cpu_map" );
+    bpf->tx_port_fd = bpf_obj_get( "/sys/fs/bpf/tx_port" );
+    if ( bpf->worker_load_fd <= 0 || bpf->cpu_map_fd <= 0 || bpf->tx_port_fd <= 0 )
+    {
+        printf( "\nerror: could not get steering maps: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    struct bpf_program * cpumap_program = bpf_object__find_program_by_name( bpf->object, "server_xdp_cpumap" );
+    if ( !cpumap_program )
+    {
+        printf( "\nerror: could not find server_xdp_cpumap program\n\n" );
+        return 1;
+    }
+
+    bpf->cpumap_program_fd = bpf_program__fd( cpumap_program );
+
+    // create the input buffer and player state map for each cpu
+
+    int input_buffer_outer_fd = bpf_obj_get( "/sys/fs/bpf/input_buffer_map" );
+    int player_state_outer_fd = bpf_obj_get( "/sys/fs/bpf/player_state_map" );
+    if ( input_buffer_outer_fd <= 0 || player_state_outer_fd <= 0 )
+    {
+        printf( "\nerror: could not get input buffer and player state maps: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bpf->input_buffer_size = input_buffer_size( players_per_cpu );
+
+    const double input_buffer_mb = bpf->input_buffer_size / ( 1024.0 * 1024.0 );
+    const double player_state_mb = (double) players_per_cpu * sizeof(struct player_state_reply) / ( 1024.0 * 1024.0 );
+
+    printf( "input buffers: %d x %.1fMB = %.1fMB (%d players per-cpu at %d inputs per-second, %dms max queueing delay)\n",
+        num_cpus, input_buffer_mb, num_cpus * input_buffer_mb, players_per_cpu, INPUTS_PER_SECOND, INPUT_BUFFER_MAX_DELAY_MS );
+
+    printf( "player state maps: %d x %.1fMB = %.1fMB\n", num_cpus, player_state_mb, num_cpus * player_state_mb );
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        char name[16];
+
+        snprintf( name, sizeof(name), "input_buffer_%d", i );
+        int input_buffer_fd = bpf_map_create( BPF_MAP_TYPE_RINGBUF, name, 0, 0, bpf->input_buffer_size, NULL );
+        if ( input_buffer_fd < 0 )
+        {
+            printf( "\nerror: could not create input buffer for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+
+        snprintf( name, sizeof(name), "player_state_%d", i );
+        int player_state_fd = bpf_map_create( BPF_MAP_TYPE_LRU_HASH, name, sizeof(__u64), sizeof(struct player_state_reply), players_per_cpu, NULL );
+        if ( player_state_fd < 0 )
+        {
+            printf( "\nerror: could not create player state map for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+
+        __u32 key = i;
+        if ( bpf_map_update_elem( input_buffer_outer_fd, &key, &input_buffer_fd, BPF_ANY ) != 0 ||
+             bpf_map_update_elem( player_state_outer_fd, &key, &player_state_fd, BPF_ANY ) != 0 )
+        {
+            printf( "\nerror: could not add maps for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+
+        // the outer maps hold a reference to the inner maps
+
+        close( input_buffer_fd );
+        close( player_state_fd );
+    }
+
+    close( input_buffer_outer_fd );
+    close( player_state_outer_fd );
+
+    printf( "created input buffers and player state maps for %d cpus, %d players per-cpu\n", num_cpus, players_per_cpu );
+
     printf( "ready\n" );
 
     return 0;
 }
 
+#define CPU_MAP_QUEUE_SIZE                                                                  2048
+
+int bpf_enable_steering( struct bpf_t * bpf )
+{
+    // each worker cpu runs server_xdp_cpumap on the input packets steered to it
+
+    for ( int i = 0; i < bpf->num_cpus; i++ )
+    {
+        struct bpf_cpumap_val value;
+        memset( &value, 0, sizeof(value) );
+        value.qsize = CPU_MAP_QUEUE_SIZE;
+        value.bpf_prog.fd = bpf->cpumap_program_fd;
+        __u32 key = i;
+        if ( bpf_map_update_elem( bpf->cpu_map_fd, &key, &value, BPF_ANY ) != 0 )
+        {
+            printf( "\nerror: could not add cpu %d to cpu map: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+    }
+
+    // player state replies from the worker cpu go back out the same interface
+
+    __u32 key = 0;
+    __u32 interface_index = bpf->interface_index;
+    if ( bpf_map_update_elem( bpf->tx_port_fd, &key, &interface_index, BPF_ANY ) != 0 )
+    {
+        printf( "\nerror: could not set tx port: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    return 0;
+}
+
 void bpf_shutdown( struct bpf_t * bpf )
 {
     assert( bpf );
@@ -186,10 +447,107 @@ void bpf_shutdown( struct bpf_t * bpf )
         }
         xdp_program__close( bpf->program );
     }
+
+    if ( bpf->object != NULL )
+    {
+        bpf_object__close( bpf->object );
+    }
 }
 
 volatile bool quit;
 
+static const char * drop_reason_names[NUM_DROP_REASONS] = { "unknown session", "old input", "ring full", "missing player state", "truncated packet", "af_xdp unsupported" };
+
+static void calculate_latency_percentiles( const uint64_t * buckets, struct latency_percentiles * percentiles )
+{
+    memset( percentiles, 0, sizeof(struct latency_percentiles) );
+
+    uint64_t total = 0;
+    for ( int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++ )
+    {
+        total += buckets[i];
+    }
+
+    if ( total == 0 )
+        return;
+
+    // report the upper bound of the bucket each percentile falls in
+
+    const uint64_t p50_count = ( total * 500 + 999 ) / 1000;
+    const uint64_t p99_count = ( total * 990 + 999 ) / 1000;
+    const uint64_t p999_count = ( total * 999 + 999 ) / 1000;
+
+    uint64_t count = 0;
+    for ( int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++ )
+    {
+        uint64_t previous_count = count;
+        count += buckets[i];
+        uint64_t value = latency_histogram_value( i + 1 < LATENCY_HISTOGRAM_BUCKETS ? i + 1 : i );
+        if ( previous_count < p50_count && count >= p50_count )
+            percentiles->p50 = value;
+        if ( previous_count < p99_count && count >= p99_count )
+            percentiles->p99 = value;
+        if ( previous_count < p999_count && count >= p999_count )
+            percentiles->p999 = value;
+    }
+}
+
+// user + system time of a worker process in clock ticks, from /proc/<pid>/stat
+
+static uint64_t worker_cpu_ticks( pid_t pid )
+{
+    char filename[64];
+    snprintf( filename, sizeof(filename), "/proc/%d/stat", (int) pid );
+    FILE * file = fopen( filename, "r" );
+    if ( !file )
+        return 0;
+
+    char buffer[1024];
+    size_t bytes = fread( buffer, 1, sizeof(buffer) - 1, file );
+    fclose( file );
+    buffer[bytes] = '\0';
+
+    // the command name can contain spaces, so skip past its closing paren. utime and stime are fields 14 and 15
+
+    char * p = strrchr( buffer, ')' );
+    if ( !p )
+        return 0;
+
+    unsigned long long utime = 0, stime = 0;
+    if ( sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime ) != 2 )
+        return 0;
+
+    return utime + stime;
+}
+
+static int print_trace_event( void * ctx, void * data, size_t data_sz )
+{
+    (void) ctx;
+
+    if ( data_sz < sizeof(struct trace_event) )
+        return 0;
+
+    struct trace_event * event = (struct trace_event*) data;
+
+    switch ( event->type )
+    {
+        case TRACE_EVENT_JOIN:
+            printf( "trace: %" PRId64 " cpu %d join session %016" PRIx64 "\n", (uint64_t) event->timestamp, event->cpu, (uint64_t) event->session_id );
+            break;
+
+        case TRACE_EVENT_INPUT:
+            printf( "trace: %" PRId64 " cpu %d input session %016" PRIx64 " (n=%d)\n", (uint64_t) event->timestamp, event->cpu, (uint64_t) event->session_id, event->num_inputs );
+            break;
+
+        case TRACE_EVENT_DROP:
+            printf( "trace: %" PRId64 " cpu %d drop session %016" PRIx64 " (%s)\n", (uint64_t) event->timestamp, event->cpu, (uint64_t) event->session_id,
+                event->drop_reason < NUM_DROP_REASONS ? drop_reason_names[event->drop_reason] : "unknown" );
+            break;
+    }
+
+    return 0;
+}
+
 void interrupt_handler( int signal )
 {
     (void) signal; quit = true;
@@ -222,106 +580,1155 @@ int pin_thread_to_cpu( int cpu )
     return pthread_setaffinity_np( current_thread, sizeof(cpu_set_t), &cpuset );
 }
 
-int main( int argc, char *argv[] )
+/*
+    NUMA topology.
+
+    XDP runs on the CPU that services the RX queue, and it sends inputs to the ring buffer for that CPU,
+    so the worker for input_buffer_i is fed from cpu i's node. Workers are pinned to that CPU as before, but now
+    their memory is allocated node-local via set_mempolicy, and we warn when the NIC is on a different node.
+*/
+
+#define MAX_NUMA_NODES                                                                        64
+
+struct numa_t
 {
-    signal( SIGINT,  interrupt_handler );
-    signal( SIGTERM, clean_shutdown_handler );
-    signal( SIGHUP,  clean_shutdown_handler );
+    int num_nodes;
+    int nic_node;
+    int num_cpus;
+    int * cpu_node;
+};
 
-    if ( argc != 2 )
-    {
-        printf( "\nusage: server <interface name>\n\n" );
-        return 1;
-    }
+static struct numa_t numa;
 
-    const char * interface_name = argv[1];
+static void numa_init( struct numa_t * numa, const char * interface_name, int num_cpus )
+{
+    memset( numa, 0, sizeof(struct numa_t) );
+
+    numa->num_cpus = num_cpus;
+    numa->cpu_node = (int*) calloc( num_cpus, sizeof(int) );
 
-    if ( bpf_init( &bpf, interface_name ) != 0 )
+    numa->nic_node = -1;
+
+    char filename[256];
+    snprintf( filename, sizeof(filename), "/sys/class/net/%s/device/numa_node", interface_name );
+    FILE * file = fopen( filename, "r" );
+    if ( file )
     {
-        cleanup();
-        return 1;
+        if ( fscanf( file, "%d", &numa->nic_node ) != 1 )
+        {
+            numa->nic_node = -1;
+        }
+        fclose( file );
     }
 
-    // fork workers
+    // each node lists its cpus as ranges, eg. "0-15,32-47". cpus not found in any node stay on node 0
 
-    for ( int i = 0; i < MAX_CPUS; i++ )
-    {   
-        pid_t c = fork();
-        if ( c == 0 )
-        { 
-            // child worker process
-            printf( "starting player server worker on cpu #%d\n", i );
-            fflush( stdout );
-            char cpu_string[64];
-            sprintf( cpu_string, "%d", i );
-            char * args[] = { "taskset", "-c", cpu_string, "./player_server_worker", cpu_string, 0 };
-            execv( "/usr/bin/taskset", args );
-            exit(0); 
-        } 
-    }
+    for ( int node = 0; node < MAX_NUMA_NODES; node++ )
+    {
+        snprintf( filename, sizeof(filename), "/sys/devices/system/node/node%d/cpulist", node );
+        file = fopen( filename, "r" );
+        if ( !file )
+            continue;
 
-    // main loop
+        numa->num_nodes = node + 1;
 
-    unsigned int num_cpus = libbpf_num_possible_cpus();
+        int first, last;
+        while ( fscanf( file, "%d", &first ) == 1 )
+        {
+            last = first;
+            int c = fgetc( file );
+            if ( c == '-' )
+            {
+                if ( fscanf( file, "%d", &last ) != 1 )
+                    break;
+                c = fgetc( file );
+            }
+            for ( int cpu = first; cpu <= last && cpu < num_cpus; cpu++ )
+            {
+                numa->cpu_node[cpu] = node;
+            }
+            if ( c != ',' )
+                break;
+        }
 
-    uint64_t previous_inputs_processed = 0;
-    uint64_t previous_player_state_packets_sent = 0;
+        fclose( file );
+    }
 
-    while ( !quit )
+    if ( numa->num_nodes == 0 )
     {
-        usleep( 1000000 );
-
-        // track inputs processed
+        numa->num_nodes = 1;
+    }
 
-        uint64_t current_inputs_processed = 0;
+    printf( "numa: %d nodes, %s is on node %d\n", numa->num_nodes, interface_name, numa->nic_node );
 
-        for ( int i = 0; i < MAX_CPUS; i++ )
+    for ( int cpu = 0; cpu < num_cpus; cpu++ )
+    {
+        printf( "numa: worker #%d -> cpu %d, node %d\n", cpu, cpu, numa->cpu_node[cpu] );
+        if ( numa->nic_node >= 0 && numa->cpu_node[cpu] != numa->nic_node )
         {
-            uint64_t value = 0;
-            bpf_map_lookup_elem( bpf.inputs_processed_fd, &i, &value );
-            current_inputs_processed += value;
+            printf( "warning: cpu %d is on node %d, but %s is on node %d. inputs on this cpu cross nodes\n", cpu, numa->cpu_node[cpu], interface_name, numa->nic_node );
         }
+    }
+}
 
-        // track player state packets sent
+// allocations faulted in by the calling thread after this come from the given node, or any node if it is full
 
-        struct counters values[num_cpus];
-        memset( &values, 0, sizeof(values) );
+static int numa_set_preferred_node( int node )
+{
+    unsigned long nodemask = 1UL << node;
+    return syscall( SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8 );
+}
 
-        int key = 0;
-        bpf_map_lookup_elem( bpf.counters_fd, &key, values );
+static int numa_reset_policy()
+{
+    return syscall( SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0 );
+}
 
-        uint64_t current_player_state_packets_sent = 0;
+/*
+    AF_XDP input mode.
 
-        for ( int i = 0; i < MAX_CPUS; i++ )
-        {
-            current_player_state_packets_sent += values[i].player_state_packets_sent;
-        }
+    Instead of copying inputs into a ring buffer, XDP redirects the whole input packet into an AF_XDP socket per-queue.
+    The worker simulates the player straight out of the UMEM frame, then writes the player state packet back into
+    the same frame and sends it from the TX ring. Copy mode works on any driver (including veth), zero copy needs driver support.
+*/
 
-        // print out important stats
+#define AF_XDP_NUM_FRAMES                                                                   4096
+#define AF_XDP_FRAME_SIZE                                                   XSK_UMEM__DEFAULT_FRAME_SIZE
+#define AF_XDP_BATCH_SIZE                                                                     64
 
-        uint64_t inputs_processed_delta = current_inputs_processed - previous_inputs_processed;
-        uint64_t player_state_delta = current_player_state_packets_sent - previous_player_state_packets_sent;
+#define PACKET_HEADER_BYTES                   ( sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) )
 
-        printf( "inputs processed delta: %" PRId64 ", player state delta: %" PRId64 "\n", inputs_processed_delta, player_state_delta );
+struct af_xdp_worker_t
+{
+    int queue;
+    void * umem_area;
+    struct xsk_umem * umem;
+    struct xsk_socket * xsk;
+    struct xsk_ring_prod fill;
+    struct xsk_ring_cons completion;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    uint64_t free_frames[AF_XDP_NUM_FRAMES];
+    int num_free_frames;
+    struct session_table_t * session_table;
+    uint64_t * next_input_sequence;                                     // by slab index
+    time_t next_expiry_time;
+    uint64_t * last_t;                                                  // by slab index
+    uint8_t * idle_seconds;
+    uint64_t * expired_session_id;
+    pthread_t thread;
+    struct metrics_t metrics;
+};
 
-        previous_inputs_processed = current_inputs_processed;
-        previous_player_state_packets_sent = current_player_state_packets_sent;
+#define COUNTER_INPUTS_PROCESSED                                                            0
+#define COUNTER_PLAYER_STATE_PACKETS_SENT                                                   1
+#define COUNTER_SESSIONS_EXPIRED                                                            2
+#define COUNTER_SESSION_TABLE_FULL                                                          3          // inputs dropped because a new player didn't fit
 
-        // upload stats to the xdp program to be sent down to clients
+#define PLAYER_TIMEOUT                                                                     15          // seconds, like PlayerTimeout in the Go worker
 
-        struct server_stats stats;
-        memset( &stats, 0, sizeof(stats) );
-        stats.inputs_processed = current_inputs_processed;
-        stats.player_state_packets_sent = current_player_state_packets_sent;
+#define GAUGE_SESSIONS                                                                      0
 
-        int err = bpf_map_update_elem( bpf.server_stats_fd, &key, &stats, BPF_ANY );
-        if ( err != 0 )
-        {
-            printf( "\nerror: failed to update server stats: %s\n\n", strerror(errno) );
-            quit = true;
+#define HISTOGRAM_PACKETS_PER_BATCH                                                         0
+
+static struct af_xdp_worker_t * af_xdp_worker;
+
+static int num_af_xdp_workers;
+
+static void af_xdp_refill( struct af_xdp_worker_t * worker )
+{
+    while ( worker->num_free_frames >= AF_XDP_BATCH_SIZE )
+    {
+        uint32_t index = 0;
+        if ( xsk_ring_prod__reserve( &worker->fill, AF_XDP_BATCH_SIZE, &index ) != AF_XDP_BATCH_SIZE )
             break;
+        for ( int i = 0; i < AF_XDP_BATCH_SIZE; i++ )
+        {
+            *xsk_ring_prod__fill_addr( &worker->fill, index++ ) = worker->free_frames[--worker->num_free_frames];
         }
+        xsk_ring_prod__submit( &worker->fill, AF_XDP_BATCH_SIZE );
     }
+}
+
+static void af_xdp_complete( struct af_xdp_worker_t * worker )
+{
+    uint32_t index = 0;
+    uint32_t completed = xsk_ring_cons__peek( &worker->completion, AF_XDP_BATCH_SIZE, &index );
+    for ( uint32_t i = 0; i < completed; i++ )
+    {
+        worker->free_frames[worker->num_free_frames++] = *xsk_ring_cons__comp_addr( &worker->completion, index++ );
+    }
+    xsk_ring_cons__release( &worker->completion, completed );
+}
+
+// one's complement sums are over 16 bit words as they sit in memory, like csum_bytes in XDP. 2^16 is 1 in one's
+// complement arithmetic, so the words can be added 32 bits at a time and folded at the end
+
+static uint64_t af_xdp_csum_bytes( const uint8_t * p, int bytes )
+{
+    uint64_t sum = 0;
+    int i = 0;
+    for ( ; i + 8 <= bytes; i += 8 )
+    {
+        uint64_t v;
+        memcpy( &v, p + i, 8 );
+        sum += ( v & 0xFFFFFFFF ) + ( v >> 32 );
+    }
+    for ( ; i + 1 < bytes; i += 2 )
+    {
+        uint16_t v;
+        memcpy( &v, p + i, 2 );
+        sum += v;
+    }
+    if ( i < bytes )
+    {
+        sum += p[i];
+    }
+    return sum;
+}
+
+static uint16_t af_xdp_csum_fold( uint64_t sum )
+{
+    while ( sum >> 16 )
+    {
+        sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+    }
+    return (uint16_t) ~sum;
+}
+
+/*
+    Turn the packet around in place, the same way reflect_packet does in XDP. The UDP checksum is the payload sum plus
+    the pseudo header and UDP header. Swapping addresses doesn't change the IPv4 header checksum, so only the length
+    change is applied to it, incrementally (RFC 1624).
+*/
+
+static void af_xdp_reflect_packet( uint8_t * packet, int payload_bytes )
+{
+    struct ethhdr * eth = (struct ethhdr*) packet;
+    struct iphdr  * ip  = (struct iphdr*) ( packet + sizeof( struct ethhdr ) );
+    struct udphdr * udp = (struct udphdr*) ( (uint8_t*) ip + sizeof( struct iphdr ) );
+
+    uint64_t sum = af_xdp_csum_bytes( (uint8_t*) udp + sizeof(struct udphdr), payload_bytes );
+
+    uint16_t a = udp->source;
+    udp->source = udp->dest;
+    udp->dest = a;
+    udp->len = htons( sizeof(struct udphdr) + payload_bytes );
+
+    uint32_t b = ip->saddr;
+    ip->saddr = ip->daddr;
+    ip->daddr = b;
+
+    const uint16_t tot_len = htons( sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes );
+    ip->check = af_xdp_csum_fold( (uint16_t) ~ip->check + (uint16_t) ~ip->tot_len + tot_len );
+    ip->tot_len = tot_len;
+
+    uint8_t c[ETH_ALEN];
+    memcpy( c, eth->h_source, ETH_ALEN );
+    memcpy( eth->h_source, eth->h_dest, ETH_ALEN );
+    memcpy( eth->h_dest, c, ETH_ALEN );
+
+    // pseudo header addresses, protocol and length, then the UDP header itself with a zero checksum
+
+    sum += af_xdp_csum_bytes( (uint8_t*) &ip->saddr, 8 );
+    sum += htons( IPPROTO_UDP );
+    sum += udp->len;
+    sum += udp->source;
+    sum += udp->dest;
+    sum += udp->len;
+
+    const uint16_t check = af_xdp_csum_fold( sum );
+    udp->check = check ? check : 0xFFFF;
+}
+
+static int af_xdp_process_input( struct af_xdp_worker_t * worker, uint8_t * packet, int packet_bytes )
+{
+    // XDP has already validated the headers. the worker is the only consumer of inputs for sessions on its queue, so it
+    // keeps the input sequence for each player, and only advances it for inputs it has simulated. the reply acks that.
+    // there are no new inputs when the packet doesn't reach back to the oldest one missing, and the reply just carries the ack
+
+    if ( packet_bytes < PACKET_HEADER_BYTES + MIN_INPUT_PACKET_SIZE )
+        return 0;
+
+    uint8_t * payload = packet + PACKET_HEADER_BYTES;
+
+    // the simulation only needs the dt of each input. encoded input packets have the dts together up front
+
+    const bool encoded = payload[0] == ENCODED_INPUT_PACKET;
+    const int dt_stride = encoded ? 8 : 8 + INPUT_SIZE;
+
+    uint64_t session_id, sequence, t;
+    memcpy( &session_id, payload + 1, 8 );
+    memcpy( &sequence, payload + 1 + 8, 8 );
+    memcpy( &t, payload + 1 + 8 + 8 + 1, 8 );
+
+    const int num_inputs = payload[1 + 8 + 8];
+    if ( num_inputs < 1 || num_inputs > MAX_INPUTS_PER_PACKET )
+        return 0;
+
+    struct player_state * state = session_table_get( worker->session_table, session_id );
+    if ( !state )
+    {
+        // first player update
+        state = session_table_insert( worker->session_table, session_id );
+        if ( !state )
+        {
+            // printed once per-second by the main thread
+            metrics_add( &worker->metrics, COUNTER_SESSION_TABLE_FULL, 1 );
+            return 0;
+        }
+        int slab_index = session_table_slab_index( worker->session_table, state );
+        worker->next_input_sequence[slab_index] = FIRST_INPUT_SEQUENCE;
+        worker->last_t[slab_index] = 0;
+        worker->idle_seconds[slab_index] = 0;
+    }
+
+    // same rules as new_input_count in XDP
+
+    uint64_t * next_input_sequence = worker->next_input_sequence + session_table_slab_index( worker->session_table, state );
+
+    if ( sequence < *next_input_sequence )
+        return 0;
+
+    uint64_t n = sequence - *next_input_sequence + 1;
+    if ( n > INPUT_HISTORY )
+    {
+        // the client can't resend inputs this old, so they are lost
+        n = num_inputs;
+    }
+    else if ( n > (uint64_t) num_inputs )
+    {
+        n = 0;
+    }
+
+    if ( packet_bytes < PACKET_HEADER_BYTES + INPUT_PACKET_HEADER_SIZE + dt_stride * n )
+        return 0;
+
+    if ( n > 0 )
+    {
+        *next_input_sequence = sequence + 1;
+    }
+
+    // inputs are newest first. process them oldest first
+
+    uint8_t * inputs = payload + INPUT_PACKET_HEADER_SIZE;
+
+    for ( int j = 1; j < (int) n; j++ )
+    {
+        uint64_t dt;
+        memcpy( &dt, inputs + dt_stride * j, 8 );
+        t -= dt;
+    }
+
+    for ( int j = (int) n - 1; j >= 0; j-- )
+    {
+        uint64_t dt;
+        memcpy( &dt, inputs + dt_stride * j, 8 );
+
+        for ( int i = 0; i < PLAYER_STATE_SIZE; i++ )
+        {
+            state->data[i] ^= (uint8_t) t + (uint8_t) i;
+        }
+
+        state->t = t + dt;
+
+        t += dt;
+    }
+
+    metrics_add( &worker->metrics, COUNTER_INPUTS_PROCESSED, n );
+
+    // write the player state packet into the same frame. there is no baseline history here, so it is always the full state.
+    // the reply can be larger than the input packet now that inputs are only resent until acked, but it still fits in the frame
+
+    payload[0] = PLAYER_STATE_PACKET;
+
+    const uint64_t ack = *next_input_sequence - 1;
+
+    memcpy( payload + 1, &ack, 8 );
+
+    memcpy( payload + 1 + 8, state, 8 + PLAYER_STATE_SIZE );
+
+    af_xdp_reflect_packet( packet, PLAYER_STATE_PACKET_SIZE );
+
+    metrics_add( &worker->metrics, COUNTER_PLAYER_STATE_PACKETS_SENT, 1 );
+
+    return PACKET_HEADER_BYTES + PLAYER_STATE_PACKET_SIZE;
+}
+
+/*
+    Players that stop sending input are removed from the session table after PLAYER_TIMEOUT seconds, so their slab
+    index goes back on the free list. Once per-second the worker compares each player's t with the t it saw the second
+    before. A player whose t hasn't moved has been idle for another second.
+*/
+
+static void af_xdp_expire_players( struct af_xdp_worker_t * worker )
+{
+    struct session_table_t * table = worker->session_table;
+
+    // collect first. deleting shifts entries back, so the scan would miss some
+
+    int num_expired = 0;
+
+    for ( uint64_t i = 0; i <= table->mask; i++ )
+    {
+        const struct session_table_entry_t * entry = table->entries + i;
+        if ( entry->distance == 0 )
+            continue;
+
+        const uint32_t slab_index = entry->slab_index;
+        const uint64_t t = table->slab[slab_index].t;
+
+        if ( t != worker->last_t[slab_index] )
+        {
+            worker->last_t[slab_index] = t;
+            worker->idle_seconds[slab_index] = 0;
+            continue;
+        }
+
+        if ( ++worker->idle_seconds[slab_index] >= PLAYER_TIMEOUT )
+        {
+            worker->expired_session_id[num_expired++] = entry->session_id;
+        }
+    }
+
+    // the slab entry is zeroed by the next insert that takes it
+
+    for ( int i = 0; i < num_expired; i++ )
+    {
+        session_table_delete( table, worker->expired_session_id[i] );
+    }
+
+    metrics_add( &worker->metrics, COUNTER_SESSIONS_EXPIRED, num_expired );
+}
+
+void * af_xdp_worker_thread_function( void * context )
+{
+    struct af_xdp_worker_t * worker = (struct af_xdp_worker_t*) context;
+
+    pin_thread_to_cpu( worker->queue );
+
+    struct pollfd fds;
+    fds.fd = xsk_socket__fd( worker->xsk );
+    fds.events = POLLIN;
+
+    uint64_t reply_addr[AF_XDP_BATCH_SIZE];
+    uint32_t reply_bytes[AF_XDP_BATCH_SIZE];
+
+    while ( !quit )
+    {
+        af_xdp_complete( worker );
+
+        af_xdp_refill( worker );
+
+        const time_t current_time = time( NULL );
+        if ( current_time >= worker->next_expiry_time )
+        {
+            af_xdp_expire_players( worker );
+            worker->next_expiry_time = current_time + 1;
+        }
+
+        uint32_t rx_index = 0;
+        uint32_t received = xsk_ring_cons__peek( &worker->rx, AF_XDP_BATCH_SIZE, &rx_index );
+        if ( received == 0 )
+        {
+            poll( &fds, 1, 100 );
+            continue;
+        }
+
+        metrics_sample( &worker->metrics, HISTOGRAM_PACKETS_PER_BATCH, received );
+
+        int num_replies = 0;
+
+        for ( uint32_t i = 0; i < received; i++ )
+        {
+            const struct xdp_desc * desc = xsk_ring_cons__rx_desc( &worker->rx, rx_index++ );
+            uint8_t * packet = (uint8_t*) xsk_umem__get_data( worker->umem_area, desc->addr );
+            int bytes = af_xdp_process_input( worker, packet, desc->len );
+            if ( bytes > 0 )
+            {
+                reply_addr[num_replies] = desc->addr;
+                reply_bytes[num_replies] = bytes;
+                num_replies++;
+            }
+            else
+            {
+                worker->free_frames[worker->num_free_frames++] = desc->addr;
+            }
+        }
+
+        xsk_ring_cons__release( &worker->rx, received );
+
+        metrics_set( &worker->metrics, GAUGE_SESSIONS, worker->session_table->size );
+
+        if ( num_replies == 0 )
+            continue;
+
+        uint32_t tx_index = 0;
+        while ( xsk_ring_prod__reserve( &worker->tx, num_replies, &tx_index ) != num_replies && !quit )
+        {
+            // tx ring is full. kick it and wait for completions
+            sendto( xsk_socket__fd( worker->xsk ), NULL, 0, MSG_DONTWAIT, NULL, 0 );
+            af_xdp_complete( worker );
+        }
+
+        for ( int i = 0; i < num_replies; i++ )
+        {
+            struct xdp_desc * desc = xsk_ring_prod__tx_desc( &worker->tx, tx_index++ );
+            desc->addr = reply_addr[i];
+            desc->len = reply_bytes[i];
+        }
+
+        if ( quit )
+            break;
+
+        xsk_ring_prod__submit( &worker->tx, num_replies );
+
+        sendto( xsk_socket__fd( worker->xsk ), NULL, 0, MSG_DONTWAIT, NULL, 0 );
+    }
+
+    return NULL;
+}
+
+int af_xdp_worker_init( struct af_xdp_worker_t * worker, const char * interface_name, int queue, bool zero_copy )
+{
+    memset( worker, 0, sizeof(struct af_xdp_worker_t) );
+
+    worker->queue = queue;
+
+    // umem and the session table slab are touched first here, so make them local to the queue's node
+
+    numa_set_preferred_node( numa.cpu_node[queue] );
+
+    if ( posix_memalign( &worker->umem_area, getpagesize(), AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE ) != 0 )
+    {
+        printf( "\nerror: could not allocate umem for queue %d\n\n", queue );
+        return 1;
+    }
+
+    struct xsk_umem_config umem_config;
+    memset( &umem_config, 0, sizeof(umem_config) );
+    umem_config.fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    umem_config.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    umem_config.frame_size = AF_XDP_FRAME_SIZE;
+
+    int err = xsk_umem__create( &worker->umem, worker->umem_area, AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE, &worker->fill, &worker->completion, &umem_config );
+    if ( err != 0 )
+    {
+        printf( "\nerror: could not create umem for queue %d: %s\n\n", queue, strerror(-err) );
+        return 1;
+    }
+
+    struct xsk_socket_config socket_config;
+    memset( &socket_config, 0, sizeof(socket_config) );
+    socket_config.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    socket_config.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    socket_config.libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;      // IMPORTANT: player_server_xdp does the redirect
+    socket_config.bind_flags = zero_copy ? XDP_ZEROCOPY : XDP_COPY;
+
+    err = xsk_socket__create( &worker->xsk, interface_name, queue, worker->umem, &worker->rx, &worker->tx, &socket_config );
+    if ( err != 0 )
+    {
+        printf( "could not create AF_XDP socket for queue %d: %s\n", queue, strerror(-err) );
+        return 1;
+    }
+
+    err = xsk_socket__update_xskmap( worker->xsk, bpf.xsk_map_fd );
+    if ( err != 0 )
+    {
+        printf( "\nerror: could not add AF_XDP socket for queue %d to xsk map: %s\n\n", queue, strerror(-err) );
+        return 1;
+    }
+
+    for ( int i = 0; i < AF_XDP_NUM_FRAMES; i++ )
+    {
+        worker->free_frames[i] = (uint64_t) i * AF_XDP_FRAME_SIZE;
+    }
+    worker->num_free_frames = AF_XDP_NUM_FRAMES;
+
+    af_xdp_refill( worker );
+
+    worker->session_table = session_table_create( bpf.players_per_cpu );
+
+    worker->next_input_sequence = (uint64_t*) calloc( bpf.players_per_cpu, sizeof(uint64_t) );
+    worker->last_t = (uint64_t*) calloc( bpf.players_per_cpu, sizeof(uint64_t) );
+    worker->idle_seconds = (uint8_t*) calloc( bpf.players_per_cpu, 1 );
+    worker->expired_session_id = (uint64_t*) malloc( sizeof(uint64_t) * bpf.players_per_cpu );
+    if ( !worker->next_input_sequence || !worker->last_t || !worker->idle_seconds || !worker->expired_session_id )
+    {
+        printf( "\nerror: could not allocate session expiry for queue %d\n\n", queue );
+        return 1;
+    }
+
+    printf( "session slab for queue %d on %s\n", queue, session_table_pages_name( worker->session_table->slab_pages ) );
+
+    return 0;
+}
+
+void af_xdp_worker_shutdown( struct af_xdp_worker_t * worker )
+{
+    if ( worker->xsk )
+    {
+        uint32_t key = worker->queue;
+        bpf_map_delete_elem( bpf.xsk_map_fd, &key );
+        xsk_socket__delete( worker->xsk );
+        worker->xsk = NULL;
+    }
+    if ( worker->umem )
+    {
+        xsk_umem__delete( worker->umem );
+        worker->umem = NULL;
+    }
+    if ( worker->umem_area )
+    {
+        free( worker->umem_area );
+        worker->umem_area = NULL;
+    }
+    if ( worker->session_table )
+    {
+        session_table_destroy( worker->session_table );
+        worker->session_table = NULL;
+    }
+    free( worker->next_input_sequence );
+    free( worker->last_t );
+    free( worker->idle_seconds );
+    free( worker->expired_session_id );
+    worker->next_input_sequence = NULL;
+    worker->last_t = NULL;
+    worker->idle_seconds = NULL;
+    worker->expired_session_id = NULL;
+}
+
+int main( int argc, char *argv[] )
+{
+    signal( SIGINT,  interrupt_handler );
+    signal( SIGTERM, clean_shutdown_handler );
+    signal( SIGHUP,  clean_shutdown_handler );
+
+    if ( argc < 2 || argc > 9 )
+    {
+        printf( "\nusage: server <interface name> [ringbuf|steer|afxdp|afxdp_zc] [num cpus] [players per-cpu] [trace sample rate] [always|coalesce] [wakeup budget us] [wakeup threshold bytes]\n\n" );
+        return 1;
+    }
+
+    const char * interface_name = argv[1];
+
+    struct server_config config;
+    memset( &config, 0, sizeof(config) );
+    config.input_mode = INPUT_MODE_RING_BUFFER;
+    config.wakeup_policy = WAKEUP_POLICY_ALWAYS;
+    config.wakeup_threshold_bytes = WAKEUP_THRESHOLD_BYTES;
+    config.wakeup_budget_ns = WAKEUP_BUDGET_US * 1000ULL;
+
+    bool zero_copy = false;
+
+    if ( argc >= 3 )
+    {
+        if ( strcmp( argv[2], "afxdp" ) == 0 )
+        {
+            config.input_mode = INPUT_MODE_AF_XDP;
+        }
+        else if ( strcmp( argv[2], "afxdp_zc" ) == 0 )
+        {
+            config.input_mode = INPUT_MODE_AF_XDP;
+            zero_copy = true;
+        }
+        else if ( strcmp( argv[2], "steer" ) == 0 )
+        {
+            config.input_steering = INPUT_STEERING_LEAST_LOADED;
+        }
+        else if ( strcmp( argv[2], "ringbuf" ) != 0 )
+        {
+            printf( "\nerror: unknown input mode '%s'\n\n", argv[2] );
+            return 1;
+        }
+    }
+
+    // by default, one worker per-cpu on this machine
+
+    int num_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+    int players_per_cpu = PLAYERS_PER_CPU;
+
+    if ( argc >= 4 )
+    {
+        num_cpus = atoi( argv[3] );
+        if ( num_cpus <= 0 )
+        {
+            printf( "\nerror: invalid number of cpus '%s'\n\n", argv[3] );
+            return 1;
+        }
+    }
+
+    if ( argc >= 5 )
+    {
+        players_per_cpu = atoi( argv[4] );
+        if ( players_per_cpu <= 0 )
+        {
+            printf( "\nerror: invalid players per-cpu '%s'\n\n", argv[4] );
+            return 1;
+        }
+    }
+
+    if ( argc >= 6 )
+    {
+        config.trace_sample_rate = atoi( argv[5] );
+        printf( "tracing 1 in %d events\n", config.trace_sample_rate );
+    }
+
+    if ( argc >= 7 )
+    {
+        if ( strcmp( argv[6], "coalesce" ) == 0 )
+        {
+            config.wakeup_policy = WAKEUP_POLICY_COALESCE;
+        }
+        else if ( strcmp( argv[6], "always" ) != 0 )
+        {
+            printf( "\nerror: unknown wakeup policy '%s'\n\n", argv[6] );
+            return 1;
+        }
+    }
+
+    if ( argc >= 8 )
+    {
+        int wakeup_budget_us = atoi( argv[7] );
+        if ( wakeup_budget_us <= 0 )
+        {
+            printf( "\nerror: invalid wakeup budget '%s'\n\n", argv[7] );
+            return 1;
+        }
+        config.wakeup_budget_ns = wakeup_budget_us * 1000ULL;
+    }
+
+    if ( argc >= 9 )
+    {
+        int wakeup_threshold_bytes = atoi( argv[8] );
+        if ( wakeup_threshold_bytes <= 0 || wakeup_threshold_bytes > MAX_INPUT_BUFFER_SIZE )
+        {
+            printf( "\nerror: invalid wakeup threshold '%s'\n\n", argv[8] );
+            return 1;
+        }
+        config.wakeup_threshold_bytes = wakeup_threshold_bytes;
+    }
+
+    if ( config.wakeup_policy == WAKEUP_POLICY_COALESCE )
+    {
+        printf( "coalescing input buffer wakeups: %d bytes or %" PRId64 "us\n", config.wakeup_threshold_bytes, (uint64_t) ( config.wakeup_budget_ns / 1000 ) );
+    }
+
+    printf( "%d cpus, %d players per-cpu\n", num_cpus, players_per_cpu );
+
+    if ( bpf_init( &bpf, interface_name, num_cpus, players_per_cpu ) != 0 )
+    {
+        cleanup();
+        return 1;
+    }
+
+    numa_init( &numa, interface_name, num_cpus );
+
+    config.num_cpus = num_cpus;
+
+    // a wakeup threshold past half the input buffer would leave the worker asleep while it fills
+
+    if ( config.wakeup_threshold_bytes > (__u32) bpf.input_buffer_size / 2 )
+    {
+        config.wakeup_threshold_bytes = bpf.input_buffer_size / 2;
+        if ( config.wakeup_policy == WAKEUP_POLICY_COALESCE )
+        {
+            printf( "wakeup threshold reduced to %d bytes for the input buffer size\n", config.wakeup_threshold_bytes );
+        }
+    }
+
+    if ( config.input_steering == INPUT_STEERING_LEAST_LOADED )
+    {
+        printf( "steering inputs to the least loaded worker cpu at join\n" );
+
+        if ( bpf_enable_steering( &bpf ) != 0 )
+        {
+            cleanup();
+            return 1;
+        }
+    }
+
+    // the metrics block in each worker must start on its own cache line, which calloc doesn't guarantee
+
+    af_xdp_worker = (struct af_xdp_worker_t*) aligned_alloc( METRICS_CACHE_LINE_SIZE, sizeof(struct af_xdp_worker_t) * num_cpus );
+    memset( af_xdp_worker, 0, sizeof(struct af_xdp_worker_t) * num_cpus );
+
+    // start AF_XDP workers, one per-queue
+
+    if ( config.input_mode == INPUT_MODE_AF_XDP )
+    {
+        for ( int i = 0; i < num_cpus; i++ )
+        {
+            if ( af_xdp_worker_init( &af_xdp_worker[i], interface_name, i, zero_copy ) != 0 )
+            {
+                // queues without a socket would drop every input steered to them, so don't run with some of them
+
+                printf( "\nerror: could only create %d of %d AF_XDP sockets on '%s'\n\n", num_af_xdp_workers, num_cpus, interface_name );
+                for ( int j = 0; j <= i; j++ )
+                {
+                    af_xdp_worker_shutdown( &af_xdp_worker[j] );
+                }
+                num_af_xdp_workers = 0;
+                numa_reset_policy();
+                cleanup();
+                return 1;
+            }
+            num_af_xdp_workers++;
+        }
+
+        numa_reset_policy();
+
+        printf( "created %d AF_XDP sockets (%s mode)\n", num_af_xdp_workers, zero_copy ? "zero copy" : "copy" );
+
+        for ( int i = 0; i < num_af_xdp_workers; i++ )
+        {
+            pthread_create( &af_xdp_worker[i].thread, NULL, af_xdp_worker_thread_function, &af_xdp_worker[i] );
+        }
+    }
+
+    // tell the xdp program where to send inputs
+
+    int config_key = 0;
+    if ( bpf_map_update_elem( bpf.server_config_fd, &config_key, &config, BPF_ANY ) != 0 )
+    {
+        printf( "\nerror: failed to update server config: %s\n\n", strerror(errno) );
+        cleanup();
+        return 1;
+    }
+
+    // fork workers. taskset execs the worker in place, so the child pid is the worker pid
+
+    pid_t * worker_pids = (pid_t*) calloc( num_cpus, sizeof(pid_t) );
+
+    for ( int i = 0; i < num_cpus && config.input_mode == INPUT_MODE_RING_BUFFER; i++ )
+    {   
+        pid_t c = fork();
+        if ( c == 0 )
+        { 
+            // child worker process
+            printf( "starting player server worker on cpu #%d (node %d)\n", i, numa.cpu_node[i] );
+            fflush( stdout );
+            // the memory policy is inherited across exec, so the worker's player state is allocated on its own node
+            numa_set_preferred_node( numa.cpu_node[i] );
+            char cpu_string[64];
+            sprintf( cpu_string, "%d", i );
+            char * args[] = { "taskset", "-c", cpu_string, "./player_server_worker", cpu_string, 0 };
+            execv( "/usr/bin/taskset", args );
+            exit(0); 
+        } 
+        worker_pids[i] = c;
+    }
+
+    // main loop
+
+    unsigned int num_possible_cpus = libbpf_num_possible_cpus();
+
+    uint64_t previous_inputs_processed = 0;
+    uint64_t previous_player_state_packets_sent = 0;
+
+    uint64_t previous_node_inputs_processed[MAX_NUMA_NODES];
+    memset( previous_node_inputs_processed, 0, sizeof(previous_node_inputs_processed) );
+
+    uint64_t * previous_worker_inputs_processed = (uint64_t*) calloc( num_cpus, sizeof(uint64_t) );
+    uint64_t * current_worker_inputs_processed = (uint64_t*) calloc( num_cpus, sizeof(uint64_t) );
+
+    uint64_t previous_drops[NUM_DROP_REASONS];
+    memset( previous_drops, 0, sizeof(previous_drops) );
+
+    uint64_t previous_input_buffer_wakeups = 0;
+
+    struct input_buffer_state * input_buffer_state_values = (struct input_buffer_state*) malloc( sizeof(struct input_buffer_state) * num_possible_cpus );
+
+    uint64_t * previous_worker_cpu_ticks = (uint64_t*) calloc( num_cpus, sizeof(uint64_t) );
+
+    const double clock_ticks_per_second = sysconf( _SC_CLK_TCK );
+
+    uint64_t previous_packets_per_batch[METRICS_HISTOGRAM_BUCKETS];
+    memset( previous_packets_per_batch, 0, sizeof(previous_packets_per_batch) );
+    uint64_t previous_af_xdp_sessions_expired = 0;
+    uint64_t previous_af_xdp_session_table_full = 0;
+
+    struct latency_histogram * player_state_age_values = (struct latency_histogram*) malloc( sizeof(struct latency_histogram) * num_possible_cpus );
+
+    struct worker_latency previous_latency;
+    struct latency_histogram previous_player_state_age;
+    memset( &previous_latency, 0, sizeof(previous_latency) );
+    memset( &previous_player_state_age, 0, sizeof(previous_player_state_age) );
+
+    struct ring_buffer * trace_buffer = NULL;
+    if ( config.trace_sample_rate > 0 )
+    {
+        trace_buffer = ring_buffer__new( bpf.trace_buffer_fd, print_trace_event, NULL, NULL );
+        if ( !trace_buffer )
+        {
+            printf( "\nerror: could not create trace buffer\n\n" );
+        }
+    }
+
+    while ( !quit )
+    {
+        usleep( 1000000 );
+
+        if ( trace_buffer )
+        {
+            ring_buffer__consume( trace_buffer );
+        }
+
+        // track inputs processed
+
+        uint64_t current_inputs_processed = 0;
+
+        uint64_t current_node_inputs_processed[MAX_NUMA_NODES];
+        memset( current_node_inputs_processed, 0, sizeof(current_node_inputs_processed) );
+
+        for ( int i = 0; i < num_cpus; i++ )
+        {
+            uint64_t value = 0;
+            bpf_map_lookup_elem( bpf.inputs_processed_fd, &i, &value );
+            current_inputs_processed += value;
+            current_node_inputs_processed[numa.cpu_node[i]] += value;
+            current_worker_inputs_processed[i] = value;
+        }
+
+        // track player state packets sent
+
+        struct counters values[num_possible_cpus];
+        memset( &values, 0, sizeof(values) );
+
+        int key = 0;
+        bpf_map_lookup_elem( bpf.counters_fd, &key, values );
+
+        uint64_t current_player_state_packets_sent = 0;
+
+        uint64_t current_input_buffer_wakeups = 0;
+
+        uint64_t current_drops[NUM_DROP_REASONS];
+        memset( current_drops, 0, sizeof(current_drops) );
+
+        for ( int i = 0; i < (int) num_possible_cpus; i++ )
+        {
+            current_player_state_packets_sent += values[i].player_state_packets_sent;
+            current_input_buffer_wakeups += values[i].input_buffer_wakeups;
+            for ( int j = 0; j < NUM_DROP_REASONS; j++ )
+            {
+                current_drops[j] += values[i].drops[j];
+            }
+        }
+
+        for ( int i = 0; i < num_af_xdp_workers; i++ )
+        {
+            uint64_t worker_inputs_processed = metrics_sum_counter( &af_xdp_worker[i].metrics, 1, COUNTER_INPUTS_PROCESSED );
+            current_inputs_processed += worker_inputs_processed;
+            current_node_inputs_processed[numa.cpu_node[af_xdp_worker[i].queue]] += worker_inputs_processed;
+            current_worker_inputs_processed[af_xdp_worker[i].queue] += worker_inputs_processed;
+            current_player_state_packets_sent += metrics_sum_counter( &af_xdp_worker[i].metrics, 1, COUNTER_PLAYER_STATE_PACKETS_SENT );
+        }
+
+        // print out important stats
+
+        uint64_t inputs_processed_delta = current_inputs_processed - previous_inputs_processed;
+        uint64_t player_state_delta = current_player_state_packets_sent - previous_player_state_packets_sent;
+
+        printf( "inputs processed delta: %" PRId64 ", player state delta: %" PRId64 "\n", inputs_processed_delta, player_state_delta );
+
+        printf( "    drops:" );
+        for ( int i = 0; i < NUM_DROP_REASONS; i++ )
+        {
+            printf( "%s %s %" PRId64, i > 0 ? "," : "", drop_reason_names[i], current_drops[i] - previous_drops[i] );
+        }
+        printf( "\n" );
+
+        memcpy( previous_drops, current_drops, sizeof(previous_drops) );
+
+        // ring buffer wakeups and worker cpu usage, to compare wakeup policies. the added latency shows up in queue wait
+
+        if ( config.input_mode == INPUT_MODE_RING_BUFFER )
+        {
+            double total_worker_cpu = 0.0;
+            double max_worker_cpu = 0.0;
+            for ( int i = 0; i < num_cpus; i++ )
+            {
+                uint64_t ticks = worker_cpu_ticks( worker_pids[i] );
+                double worker_cpu = ( ticks - previous_worker_cpu_ticks[i] ) * 100.0 / clock_ticks_per_second;
+                total_worker_cpu += worker_cpu;
+                if ( worker_cpu > max_worker_cpu )
+                    max_worker_cpu = worker_cpu;
+                previous_worker_cpu_ticks[i] = ticks;
+            }
+
+            printf( "    input buffer wakeups: %" PRId64 " per-second, worker cpu: avg %.1f%%, max %.1f%%\n",
+                current_input_buffer_wakeups - previous_input_buffer_wakeups, total_worker_cpu / num_cpus, max_worker_cpu );
+
+            // high water mark per input buffer, as a percentage of its size. near 100% means inputs were close to being dropped
+
+            memset( input_buffer_state_values, 0, sizeof(struct input_buffer_state) * num_possible_cpus );
+            bpf_map_lookup_elem( bpf.input_buffer_state_fd, &key, input_buffer_state_values );
+            printf( "    input buffer high water (%%):" );
+            for ( int i = 0; i < num_cpus && i < (int) num_possible_cpus; i++ )
+            {
+                printf( " %.1f", input_buffer_state_values[i].high_water_bytes * 100.0 / bpf.input_buffer_size );
+            }
+            printf( "\n" );
+        }
+
+        previous_input_buffer_wakeups = current_input_buffer_wakeups;
+
+        if ( num_af_xdp_workers > 0 )
+        {
+            uint64_t sessions = 0;
+            uint64_t current_sessions_expired = 0;
+            uint64_t current_session_table_full = 0;
+            uint64_t current_packets_per_batch[METRICS_HISTOGRAM_BUCKETS];
+            memset( current_packets_per_batch, 0, sizeof(current_packets_per_batch) );
+            for ( int i = 0; i < num_af_xdp_workers; i++ )
+            {
+                uint64_t worker_packets_per_batch[METRICS_HISTOGRAM_BUCKETS];
+                metrics_sum_histogram( &af_xdp_worker[i].metrics, 1, HISTOGRAM_PACKETS_PER_BATCH, worker_packets_per_batch );
+                for ( int j = 0; j < METRICS_HISTOGRAM_BUCKETS; j++ )
+                {
+                    current_packets_per_batch[j] += worker_packets_per_batch[j];
+                }
+                sessions += metrics_sum_gauge( &af_xdp_worker[i].metrics, 1, GAUGE_SESSIONS );
+                current_sessions_expired += metrics_sum_counter( &af_xdp_worker[i].metrics, 1, COUNTER_SESSIONS_EXPIRED );
+                current_session_table_full += metrics_sum_counter( &af_xdp_worker[i].metrics, 1, COUNTER_SESSION_TABLE_FULL );
+            }
+            printf( "    af_xdp sessions: %" PRId64 ", expired: %" PRId64 "\n", sessions, current_sessions_expired - previous_af_xdp_sessions_expired );
+            if ( current_session_table_full != previous_af_xdp_session_table_full )
+            {
+                printf( "    error: af_xdp session table is full, dropped %" PRId64 " inputs from new players\n", current_session_table_full - previous_af_xdp_session_table_full );
+            }
+            previous_af_xdp_sessions_expired = current_sessions_expired;
+            previous_af_xdp_session_table_full = current_session_table_full;
+            metrics_print_histogram( "    af_xdp packets per batch", current_packets_per_batch, previous_packets_per_batch );
+            memcpy( previous_packets_per_batch, current_packets_per_batch, sizeof(previous_packets_per_batch) );
+        }
+
+        // latency histograms. queue wait and simulation come from the workers, player state age from xdp
+
+        struct worker_latency current_latency;
+        struct latency_histogram current_player_state_age;
+        memset( &current_latency, 0, sizeof(current_latency) );
+        memset( &current_player_state_age, 0, sizeof(current_player_state_age) );
+
+        for ( int i = 0; i < num_cpus; i++ )
+        {
+            struct worker_latency worker_latency;
+            __u32 worker_key = i;
+            if ( bpf_map_lookup_elem( bpf.worker_latency_fd, &worker_key, &worker_latency ) != 0 )
+                continue;
+            for ( int j = 0; j < LATENCY_HISTOGRAM_BUCKETS; j++ )
+            {
+                current_latency.queue_wait.buckets[j] += worker_latency.queue_wait.buckets[j];
+                current_latency.simulation.buckets[j] += worker_latency.simulation.buckets[j];
+            }
+        }
+
+        memset( player_state_age_values, 0, sizeof(struct latency_histogram) * num_possible_cpus );
+        bpf_map_lookup_elem( bpf.player_state_age_fd, &key, player_state_age_values );
+        for ( int i = 0; i < (int) num_possible_cpus; i++ )
+        {
+            for ( int j = 0; j < LATENCY_HISTOGRAM_BUCKETS; j++ )
+            {
+                current_player_state_age.buckets[j] += player_state_age_values[i].buckets[j];
+            }
+        }
+
+        uint64_t queue_wait_delta[LATENCY_HISTOGRAM_BUCKETS];
+        uint64_t simulation_delta[LATENCY_HISTOGRAM_BUCKETS];
+        uint64_t player_state_age_delta[LATENCY_HISTOGRAM_BUCKETS];
+        for ( int j = 0; j < LATENCY_HISTOGRAM_BUCKETS; j++ )
+        {
+            queue_wait_delta[j] = current_latency.queue_wait.buckets[j] - previous_latency.queue_wait.buckets[j];
+            simulation_delta[j] = current_latency.simulation.buckets[j] - previous_latency.simulation.buckets[j];
+            player_state_age_delta[j] = current_player_state_age.buckets[j] - previous_player_state_age.buckets[j];
+        }
+
+        struct latency_percentiles queue_wait, simulation, player_state_age;
+        calculate_latency_percentiles( queue_wait_delta, &queue_wait );
+        calculate_latency_percentiles( simulation_delta, &simulation );
+        calculate_latency_percentiles( player_state_age_delta, &player_state_age );
+
+        printf( "    latency p50/p99/p999 (us): queue wait %.1f/%.1f/%.1f, simulation %.1f/%.1f/%.1f, player state age %.1f/%.1f/%.1f\n",
+            queue_wait.p50 / 1000.0, queue_wait.p99 / 1000.0, queue_wait.p999 / 1000.0,
+            simulation.p50 / 1000.0, simulation.p99 / 1000.0, simulation.p999 / 1000.0,
+            player_state_age.p50 / 1000.0, player_state_age.p99 / 1000.0, player_state_age.p999 / 1000.0 );
+
+        previous_latency = current_latency;
+        previous_player_state_age = current_player_state_age;
+
+        if ( numa.num_nodes > 1 )
+        {
+            for ( int i = 0; i < numa.num_nodes; i++ )
+            {
+                printf( "    node %d inputs processed delta: %" PRId64 "\n", i, current_node_inputs_processed[i] - previous_node_inputs_processed[i] );
+            }
+        }
+
+        // track load per-worker. in steer mode this is what joins use to pick the least loaded worker
+
+        uint64_t min_worker_load = UINT64_MAX;
+        uint64_t max_worker_load = 0;
+
+        for ( int i = 0; i < num_cpus; i++ )
+        {
+            uint64_t load = current_worker_inputs_processed[i] - previous_worker_inputs_processed[i];
+            if ( load < min_worker_load )
+                min_worker_load = load;
+            if ( load > max_worker_load )
+                max_worker_load = load;
+            if ( config.input_steering == INPUT_STEERING_LEAST_LOADED )
+            {
+                __u32 worker_key = i;
+                bpf_map_update_elem( bpf.worker_load_fd, &worker_key, &load, BPF_ANY );
+            }
+        }
+
+        printf( "    worker load: min %" PRId64 ", max %" PRId64 ", avg %.1f inputs per-second\n", min_worker_load, max_worker_load, inputs_processed_delta / (double) num_cpus );
+
+        memcpy( previous_worker_inputs_processed, current_worker_inputs_processed, sizeof(uint64_t) * num_cpus );
+
+        previous_inputs_processed = current_inputs_processed;
+        memcpy( previous_node_inputs_processed, current_node_inputs_processed, sizeof(previous_node_inputs_processed) );
+        previous_player_state_packets_sent = current_player_state_packets_sent;
+
+        // upload stats to the xdp program to be sent down to clients
+
+        struct server_stats stats;
+        memset( &stats, 0, sizeof(stats) );
+        stats.inputs_processed = current_inputs_processed;
+        stats.player_state_packets_sent = current_player_state_packets_sent;
+        stats.queue_wait = queue_wait;
+        stats.simulation = simulation;
+        stats.player_state_age = player_state_age;
+
+        int err = bpf_map_update_elem( bpf.server_stats_fd, &key, &stats, BPF_ANY );
+        if ( err != 0 )
+        {
+            printf( "\nerror: failed to update server stats: %s\n\n", strerror(errno) );
+            quit = true;
+            break;
+        }
+    }
+
+    for ( int i = 0; i < num_af_xdp_workers; i++ )
+    {
+        pthread_join( af_xdp_worker[i].thread, NULL );
+        af_xdp_worker_shutdown( &af_xdp_worker[i] );
+    }
+
+    if ( trace_buffer )
+    {
+        ring_buffer__free( trace_buffer );
+    }
+
+    free( af_xdp_worker );
+    free( worker_pids );
+    free( input_buffer_state_values );
+    free( previous_worker_cpu_ticks );
+    free( player_state_age_values );
+    free( previous_worker_inputs_processed );
+    free( current_worker_inputs_processed );
 
     cleanup();
 
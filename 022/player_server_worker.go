@@ -1,6 +1,7 @@
 package main
 
 import (
+	"errors"
 	"fmt"
 	"time"
 	"os"
@@ -8,6 +9,8 @@ import (
 	"runtime"
 	"strconv"
 	"syscall"
+	"sync/atomic"
+	"math/bits"
 	"encoding/binary"
     "bufio"
     "net"
@@ -15,18 +18,32 @@ import (
 
 	"github.com/cilium/ebpf"
 	"github.com/cilium/ebpf/ringbuf"
+	"golang.org/x/sys/unix"
 )
 
 const PlayerInputChanSize = 100000
 const PlayerStateSize = 8 + 1000
 const PlayerTimeout = 15
-const InputSize = 8 + 8 + 8 + 100
+const InputSize = 8 + 100
+const InputHeaderSize = 8 + 8 + 8 + 8
+const PlayerStatePacket = 6
+const PlayerStateDeltaPacket = 7
+const PlayerStatePacketSize = 1 + 8 + PlayerStateSize
+const PlayerStateDeltaHeaderSize = 1 + 8 + 8 + 8 + 2
+const PlayerStateDeltaRangeHeaderSize = 2 + 2
+const PlayerStateReplySize = 8 + 2 + 4 + PlayerStatePacketSize
+const PlayerStateHistory = 32
+const LatencyHistogramBuckets = 256
+const WakeupPolicyCoalesce = 1
 
 type PlayerData struct {
 	lastInputTime uint64
 	sessionId     uint64
 	inputChan     chan []byte
 	state         []byte
+	history       [][]byte
+	historyIndex  int
+	reply         []byte
 	conn          net.Conn
 	reader        *bufio.Reader
 }
@@ -37,10 +54,169 @@ var playerStateMap *ebpf.Map
 var inputsProcessed uint64
 var inputsProcessedMap *ebpf.Map
 
+// log-linear latency histograms in nanoseconds, matching struct worker_latency in shared.h
+
+type WorkerLatency struct {
+	QueueWait  [LatencyHistogramBuckets]uint64
+	Simulation [LatencyHistogramBuckets]uint64
+}
+
+var latency WorkerLatency
+var workerLatencyMap *ebpf.Map
+
+// matches struct server_config in shared.h
+
+type ServerConfig struct {
+	InputMode            uint32
+	InputSteering        uint32
+	NumCpus              uint32
+	TraceSampleRate      uint32
+	WakeupPolicy         uint32
+	WakeupThresholdBytes uint32
+	WakeupBudgetNs       uint64
+}
+
+// same clock as bpf_ktime_get_ns
+
+func monotonicTime() uint64 {
+	var ts unix.Timespec
+	unix.ClockGettime(unix.CLOCK_MONOTONIC, &ts)
+	return uint64(ts.Nano())
+}
+
+func latencyHistogramBucket(value uint64) int {
+	if value < 8 {
+		return int(value)
+	}
+	e := bits.Len64(value) - 1
+	bucket := (e-2)*8 + int((value>>(e-3))&7)
+	if bucket >= LatencyHistogramBuckets {
+		bucket = LatencyHistogramBuckets - 1
+	}
+	return bucket
+}
+
+func recordLatency(histogram *[LatencyHistogramBuckets]uint64, start uint64, end uint64) {
+	if end < start {
+		end = start
+	}
+	atomic.AddUint64(&histogram[latencyHistogramBucket(end-start)], 1)
+}
+
+func findBaseline(player *PlayerData, baseline uint64) []byte {
+	if baseline == 0 {
+		return nil
+	}
+	for _, state := range player.history {
+		if binary.LittleEndian.Uint64(state[0:8]) == baseline {
+			return state
+		}
+	}
+	return nil
+}
+
+// writeDeltaPacket encodes the byte ranges of state that differ from baselineState. returns zero if the delta is not smaller than the full state
+
+func writeDeltaPacket(packet []byte, state []byte, baselineState []byte) int {
+
+	packet[0] = PlayerStateDeltaPacket
+	binary.LittleEndian.PutUint64(packet[1:9], 0)
+	copy(packet[9:17], state[0:8])
+	copy(packet[17:25], baselineState[0:8])
+
+	index := PlayerStateDeltaHeaderSize
+	numRanges := 0
+
+	i := 0
+	for i < PlayerStateSize {
+
+		if state[i] == baselineState[i] {
+			i++
+			continue
+		}
+
+		// a new range costs a range header, so merge changes separated by fewer unchanged bytes than that
+
+		start := i
+		end := i + 1
+		for j := end; j < PlayerStateSize && j < end+PlayerStateDeltaRangeHeaderSize; j++ {
+			if state[j] != baselineState[j] {
+				end = j + 1
+			}
+		}
+
+		length := end - start
+		if index+PlayerStateDeltaRangeHeaderSize+length >= PlayerStatePacketSize {
+			return 0
+		}
+
+		binary.LittleEndian.PutUint16(packet[index:], uint16(start))
+		binary.LittleEndian.PutUint16(packet[index+2:], uint16(length))
+		copy(packet[index+PlayerStateDeltaRangeHeaderSize:], state[start:end])
+		index += PlayerStateDeltaRangeHeaderSize + length
+		numRanges++
+
+		i = end
+	}
+
+	binary.LittleEndian.PutUint16(packet[25:], uint16(numRanges))
+
+	return index
+}
+
+// checksumBytes is the unfolded one's complement sum of data as little endian 16 bit words, matching csum_bytes in player_server_xdp.c.
+// at most 1024 words of 0xFFFF, so it can't overflow
+
+func checksumBytes(data []byte) uint32 {
+	sum := uint32(0)
+	i := 0
+	for ; i+1 < len(data); i += 2 {
+		sum += uint32(binary.LittleEndian.Uint16(data[i:]))
+	}
+	if i < len(data) {
+		sum += uint32(data[i])
+	}
+	return sum
+}
+
+// writePlayerStateReply precomputes the reply packet so XDP only has to copy it. falls back to the full state if the baseline acked by the client is not in the history
+// bytes [1:9] of either packet are the last input sequence processed for the client, which XDP fills in when it sends the reply
+// the checksum of everything after those bytes is precomputed too, so XDP only has to add the first 10 bytes and the headers
+
+func writePlayerStateReply(player *PlayerData, baseline uint64) {
+
+	packet := player.reply[14:]
+
+	packetBytes := 0
+
+	baselineState := findBaseline(player, baseline)
+	if baselineState != nil {
+		packetBytes = writeDeltaPacket(packet, player.state, baselineState)
+	}
+
+	if packetBytes == 0 {
+		packet[0] = PlayerStatePacket
+		binary.LittleEndian.PutUint64(packet[1:9], 0)
+		copy(packet[9:], player.state)
+		packetBytes = PlayerStatePacketSize
+	}
+
+	binary.LittleEndian.PutUint64(player.reply[0:8], monotonicTime())
+	binary.LittleEndian.PutUint16(player.reply[8:10], uint16(packetBytes))
+	binary.LittleEndian.PutUint32(player.reply[10:14], checksumBytes(packet[10:packetBytes]))
+
+	copy(player.history[player.historyIndex%PlayerStateHistory], player.state)
+	player.historyIndex++
+}
+
 func processInput(input []byte) {
 
 	sessionId := binary.LittleEndian.Uint64(input[:])
 
+	if len(input) >= InputHeaderSize {
+		recordLatency(&latency.QueueWait, binary.LittleEndian.Uint64(input[8:]), monotonicTime())
+	}
+
 	player := playerMap[sessionId]
 
 	if player == nil {
@@ -52,6 +228,11 @@ func processInput(input []byte) {
 		player.sessionId = sessionId
 		player.inputChan = make(chan []byte, PlayerInputChanSize)
 		player.state = make([]byte, PlayerStateSize)
+		player.history = make([][]byte, PlayerStateHistory)
+		for i := range player.history {
+			player.history[i] = make([]byte, PlayerStateSize)
+		}
+		player.reply = make([]byte, PlayerStateReplySize)
         conn, err := net.Dial("tcp", "127.0.0.1:50000")
         if err != nil {
             fmt.Printf("\nerror: could not connect to zone database: %v\n\n", err)
@@ -71,17 +252,34 @@ func processInput(input []byte) {
 
 				player.lastInputTime = uint64(time.Now().Unix())
 
-				t := binary.LittleEndian.Uint64(input[8:])
+				// each record holds the n inputs missing on the server, newest first. process them oldest first
 
-				dt := binary.LittleEndian.Uint64(input[16:])
+				n := (len(input) - InputHeaderSize) / InputSize
 
-				// fmt.Printf("player %x process input: t = %x, dt = %x [cpu #%d]\n", player.sessionId, t, dt, cpu)
+				t := binary.LittleEndian.Uint64(input[16:])
 
-				for i := range player.state {
-					player.state[i] ^= byte(t) + byte(i)
+				for j := 1; j < n; j++ {
+					t -= binary.LittleEndian.Uint64(input[InputHeaderSize+j*InputSize:])
 				}
 
-				binary.LittleEndian.PutUint64(player.state[0:8], t+dt)
+				simulationStart := monotonicTime()
+
+				for j := n - 1; j >= 0; j-- {
+
+					dt := binary.LittleEndian.Uint64(input[InputHeaderSize+j*InputSize:])
+
+					// fmt.Printf("player %x process input: t = %x, dt = %x [cpu #%d]\n", player.sessionId, t, dt, cpu)
+
+					for i := range player.state {
+						player.state[i] ^= byte(t) + byte(i)
+					}
+
+					binary.LittleEndian.PutUint64(player.state[0:8], t+dt)
+
+					t += dt
+				}
+
+				recordLatency(&latency.Simulation, simulationStart, monotonicTime())
 
 	            player.conn.Write([]byte(string("ping\n")))
 
@@ -96,12 +294,14 @@ func processInput(input []byte) {
 		        	panic("expected pong")
 		        }
 
-				err = playerStateMap.Put(sessionId, player.state)
+				writePlayerStateReply(player, binary.LittleEndian.Uint64(input[24:]))
+
+				err = playerStateMap.Put(sessionId, player.reply)
 				if err != nil {
 					panic(err)
 				}
 
-				inputsProcessed++
+				inputsProcessed += uint64(n)
 
 				runtime.Gosched()
 			}
@@ -148,6 +348,37 @@ func main() {
 	}
 	defer inputsProcessedMap.Close()
 
+	// get worker latency map
+
+	workerLatencyMap, err = ebpf.LoadPinnedMap("/sys/fs/bpf/worker_latency_map", nil)
+	if err != nil {
+		fmt.Printf("error: could not get worker latency map: %v\n", err)
+		os.Exit(1)
+	}
+	defer workerLatencyMap.Close()
+
+	// get server config. when XDP coalesces ring buffer wakeups, the last inputs before a lull are submitted without one,
+	// so the worker never sleeps longer than the wakeup budget before checking the ring buffer again
+
+	serverConfigMap, err := ebpf.LoadPinnedMap("/sys/fs/bpf/server_config", nil)
+	if err != nil {
+		fmt.Printf("error: could not get server config map: %v\n", err)
+		os.Exit(1)
+	}
+	defer serverConfigMap.Close()
+
+	var serverConfig ServerConfig
+	err = serverConfigMap.Lookup(uint32(0), &serverConfig)
+	if err != nil {
+		fmt.Printf("error: could not lookup server config: %v\n", err)
+		os.Exit(1)
+	}
+
+	wakeupBudget := time.Duration(0)
+	if serverConfig.WakeupPolicy == WakeupPolicyCoalesce {
+		wakeupBudget = time.Duration(serverConfig.WakeupBudgetNs)
+	}
+
 	// get player state map for our CPU
 
 	player_state_outer, err := ebpf.LoadPinnedMap("/sys/fs/bpf/player_state_map", nil)
@@ -214,6 +445,15 @@ func main() {
 			if err != nil {
 				panic(err)
 			}
+			var snapshot WorkerLatency
+			for i := 0; i < LatencyHistogramBuckets; i++ {
+				snapshot.QueueWait[i] = atomic.LoadUint64(&latency.QueueWait[i])
+				snapshot.Simulation[i] = atomic.LoadUint64(&latency.Simulation[i])
+			}
+			err = workerLatencyMap.Put(&cpu_uint32, &snapshot)
+			if err != nil {
+				panic(err)
+			}
 	 	}
 	}()
 
@@ -222,7 +462,13 @@ func main() {
 	go func() {
 		
 		for {
+			if wakeupBudget != 0 {
+				input_buffer.SetDeadline(time.Now().Add(wakeupBudget))
+			}
 			record, err := input_buffer.Read()
+			if errors.Is(err, os.ErrDeadlineExceeded) {
+				continue
+			}
 			if err != nil {
 				fmt.Printf("error: failed to read from ring buffer: %v\n", err)
 				os.Exit(1)
@@ -4,7 +4,7 @@
     USAGE:
 
         clang -Ilibbpf/src -g -O2 -target bpf -c player_server_xdp.c -o player_server_xdp.o
-        sudo cat /sys/kernel/debug/tracing/trace_pipe
+        sudo cat /sys/kernel/debug/tracing/trace_pipe          (TRACE_LEVEL_PRINTK only)
 */
 
 #include <linux/in.h>
@@ -32,13 +32,19 @@
 # error "Endianness detection needs to be set up for your compiler?!"
 #endif
 
-#define DEBUG 1
+#define TRACE_LEVEL_NONE                                                                    0           // no tracing at all
+#define TRACE_LEVEL_EVENTS                                                                  1           // sampled trace events to trace_buffer, enabled at runtime
+#define TRACE_LEVEL_PRINTK                                                                  2           // bpf_printk everything. slow!
 
-#if DEBUG
+#define TRACE_LEVEL TRACE_LEVEL_EVENTS
+
+#define ENCODED_INPUTS                                                                      1           // accept XOR encoded input packets. set to zero and clients fall back to plain input packets
+
+#if TRACE_LEVEL >= TRACE_LEVEL_PRINTK
 #define debug_printf bpf_printk
-#else // #if DEBUG
+#else // #if TRACE_LEVEL >= TRACE_LEVEL_PRINTK
 #define debug_printf(...) do { } while (0)
-#endif // #if DEBUG
+#endif // #if TRACE_LEVEL >= TRACE_LEVEL_PRINTK
 
 struct {
     __uint( type, BPF_MAP_TYPE_LRU_PERCPU_HASH );
@@ -57,42 +63,13 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } server_stats SEC(".maps");
 
+// IMPORTANT: the outer map sizes below are defaults. player_server sizes them for the number of CPUs at load time,
+// and creates an input buffer and player state map per-CPU. the inner map definitions are just templates for those
+
 struct inner_input_buffer_map {
     __uint( type, BPF_MAP_TYPE_RINGBUF );
-    __uint( max_entries, 256 * 1024 * 1024 );
-}
-input_buffer_0 SEC(".maps"),
-input_buffer_1 SEC(".maps"),
-input_buffer_2 SEC(".maps"),
-input_buffer_3 SEC(".maps"),
-input_buffer_4 SEC(".maps"),
-input_buffer_5 SEC(".maps"),
-input_buffer_6 SEC(".maps"),
-input_buffer_7 SEC(".maps"),
-input_buffer_8 SEC(".maps"),
-input_buffer_9 SEC(".maps"),
-input_buffer_10 SEC(".maps"),
-input_buffer_11 SEC(".maps"),
-input_buffer_12 SEC(".maps"),
-input_buffer_13 SEC(".maps"),
-input_buffer_14 SEC(".maps"),
-input_buffer_15 SEC(".maps"),
-input_buffer_16 SEC(".maps"),
-input_buffer_17 SEC(".maps"),
-input_buffer_18 SEC(".maps"),
-input_buffer_19 SEC(".maps"),
-input_buffer_20 SEC(".maps"),
-input_buffer_21 SEC(".maps"),
-input_buffer_22 SEC(".maps"),
-input_buffer_23 SEC(".maps"),
-input_buffer_24 SEC(".maps"),
-input_buffer_25 SEC(".maps"),
-input_buffer_26 SEC(".maps"),
-input_buffer_27 SEC(".maps"),
-input_buffer_28 SEC(".maps"),
-input_buffer_29 SEC(".maps"),
-input_buffer_30 SEC(".maps"),
-input_buffer_31 SEC(".maps");
+    __uint( max_entries, MIN_INPUT_BUFFER_SIZE );           // the real size is worked out from players per-cpu at load time
+};
 
 struct {
     __uint( type, BPF_MAP_TYPE_ARRAY_OF_MAPS );
@@ -100,81 +77,14 @@ struct {
     __type( key, __u32 );
     __uint( pinning, LIBBPF_PIN_BY_NAME );
     __array( values, struct inner_input_buffer_map );
-} input_buffer_map SEC(".maps") = {
-    .values = { 
-        &input_buffer_0,
-        &input_buffer_1,
-        &input_buffer_2,
-        &input_buffer_3,
-        &input_buffer_4,
-        &input_buffer_5,
-        &input_buffer_6,
-        &input_buffer_7,
-        &input_buffer_8,
-        &input_buffer_9,
-        &input_buffer_10,
-        &input_buffer_11,
-        &input_buffer_12,
-        &input_buffer_13,
-        &input_buffer_14,
-        &input_buffer_15,
-        &input_buffer_16,
-        &input_buffer_17,
-        &input_buffer_18,
-        &input_buffer_19,
-        &input_buffer_20,
-        &input_buffer_21,
-        &input_buffer_22,
-        &input_buffer_23,
-        &input_buffer_24,
-        &input_buffer_25,
-        &input_buffer_26,
-        &input_buffer_27,
-        &input_buffer_28,
-        &input_buffer_29,
-        &input_buffer_30,
-        &input_buffer_31,
-    }
-};
+} input_buffer_map SEC(".maps");
 
 struct inner_player_state_map {
     __uint( type, BPF_MAP_TYPE_LRU_HASH );
     __type( key, __u64 );
-    __type( value, struct player_state );
+    __type( value, struct player_state_reply );
     __uint( max_entries, PLAYERS_PER_CPU );
-} 
-player_state_0 SEC(".maps"),
-player_state_1 SEC(".maps"),
-player_state_2 SEC(".maps"),
-player_state_3 SEC(".maps"),
-player_state_4 SEC(".maps"),
-player_state_5 SEC(".maps"),
-player_state_6 SEC(".maps"),
-player_state_7 SEC(".maps"),
-player_state_8 SEC(".maps"),
-player_state_9 SEC(".maps"),
-player_state_10 SEC(".maps"),
-player_state_11 SEC(".maps"),
-player_state_12 SEC(".maps"),
-player_state_13 SEC(".maps"),
-player_state_14 SEC(".maps"),
-player_state_15 SEC(".maps"),
-player_state_16 SEC(".maps"),
-player_state_17 SEC(".maps"),
-player_state_18 SEC(".maps"),
-player_state_19 SEC(".maps"),
-player_state_20 SEC(".maps"),
-player_state_21 SEC(".maps"),
-player_state_22 SEC(".maps"),
-player_state_23 SEC(".maps"),
-player_state_24 SEC(".maps"),
-player_state_25 SEC(".maps"),
-player_state_26 SEC(".maps"),
-player_state_27 SEC(".maps"),
-player_state_28 SEC(".maps"),
-player_state_29 SEC(".maps"),
-player_state_30 SEC(".maps"),
-player_state_31 SEC(".maps");
+};
 
 struct {
     __uint( type, BPF_MAP_TYPE_ARRAY_OF_MAPS );
@@ -182,42 +92,7 @@ struct {
     __type( key, __u32 );
     __uint( pinning, LIBBPF_PIN_BY_NAME );
     __array( values, struct inner_player_state_map );
-} player_state_map SEC(".maps") = {
-    .values = { 
-        &player_state_0,
-        &player_state_1,
-        &player_state_2,
-        &player_state_3,
-        &player_state_4,
-        &player_state_5,
-        &player_state_6,
-        &player_state_7,
-        &player_state_8,
-        &player_state_9,
-        &player_state_10,
-        &player_state_11,
-        &player_state_12,
-        &player_state_13,
-        &player_state_14,
-        &player_state_15,
-        &player_state_16,
-        &player_state_17,
-        &player_state_18,
-        &player_state_19,
-        &player_state_20,
-        &player_state_21,
-        &player_state_22,
-        &player_state_23,
-        &player_state_24,
-        &player_state_25,
-        &player_state_26,
-        &player_state_27,
-        &player_state_28,
-        &player_state_29,
-        &player_state_30,
-        &player_state_31,
-    }
-};
+} player_state_map SEC(".maps");
 
 struct {
     __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
@@ -235,350 +110,1236 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } inputs_processed_map SEC(".maps");
 
-static void reflect_packet( void * data, int payload_bytes )
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct server_config );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} server_config SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_XSKMAP );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, __u32 );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} xsk_map SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, __u64 );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} worker_load_map SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_CPUMAP );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, struct bpf_cpumap_val );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} cpu_map SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_DEVMAP );
+    __uint( max_entries, 1 );
+    __type( key, __u32 );
+    __type( value, __u32 );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} tx_port SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_RINGBUF );
+    __uint( max_entries, TRACE_BUFFER_SIZE );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} trace_buffer SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct latency_histogram );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} player_state_age_map SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, struct worker_latency );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} worker_latency_map SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct input_buffer_state );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} input_buffer_state_map SEC(".maps");
+
+#if ENCODED_INPUTS
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct input_record );
+} input_record_map SEC(".maps");
+
+#endif // #if ENCODED_INPUTS
+
+static __always_inline void trace_event( __u8 type, __u8 drop_reason, __u64 session_id, __u16 num_inputs )
+{
+#if TRACE_LEVEL >= TRACE_LEVEL_EVENTS
+    int zero = 0;
+    struct server_config * config = (struct server_config*) bpf_map_lookup_elem( &server_config, &zero );
+    if ( !config || config->trace_sample_rate == 0 )
+    {
+        return;
+    }
+
+    if ( bpf_get_prandom_u32() % config->trace_sample_rate != 0 )
+    {
+        return;
+    }
+
+    struct trace_event * event = (struct trace_event*) bpf_ringbuf_reserve( &trace_buffer, sizeof(struct trace_event), 0 );
+    if ( !event )
+    {
+        return;
+    }
+
+    event->timestamp = bpf_ktime_get_ns();
+    event->session_id = session_id;
+    event->cpu = bpf_get_smp_processor_id();
+    event->type = type;
+    event->drop_reason = drop_reason;
+    event->num_inputs = num_inputs;
+
+    bpf_ringbuf_submit( event, 0 );
+#endif // #if TRACE_LEVEL >= TRACE_LEVEL_EVENTS
+}
+
+static __always_inline void count_drop( int reason, __u64 session_id )
+{
+    int zero = 0;
+    struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
+    if ( counters && reason >= 0 && reason < NUM_DROP_REASONS )
+    {
+        __sync_fetch_and_add( &counters->drops[reason], 1 );
+    }
+
+    trace_event( TRACE_EVENT_DROP, reason, session_id, 0 );
+}
+
+static __always_inline int drop_packet( int reason, __u64 session_id )
+{
+    count_drop( reason, session_id );
+    return XDP_DROP;
+}
+
+/*
+    Input packets can arrive with one VLAN tag, over IPv4 (no options) or IPv6 (no extension headers).
+    Replies are written in place, so the offsets found here are reused for the reply.
+*/
+
+struct vlan_header
+{
+    __be16 tci;
+    __be16 encapsulated_proto;
+};
+
+struct packet_headers
+{
+    __u32 l3_offset;
+    __u32 payload_offset;
+    __u32 ipv6;
+};
+
+#define MAX_PAYLOAD_OFFSET          ( sizeof(struct ethhdr) + sizeof(struct vlan_header) + sizeof(struct ipv6hdr) + sizeof(struct udphdr) )
+
+static __always_inline int parse_headers( void * data, void * data_end, struct packet_headers * headers )
 {
     struct ethhdr * eth = data;
-    struct iphdr  * ip  = data + sizeof( struct ethhdr );
-    struct udphdr * udp = (void*) ip + sizeof( struct iphdr );
+    if ( (void*) eth + sizeof(struct ethhdr) > data_end )
+    {
+        return -1;
+    }
 
-    __u16 a = udp->source;
-    udp->source = udp->dest;
-    udp->dest = a;
-    udp->check = 0;
-    udp->len = bpf_htons( sizeof(struct udphdr) + payload_bytes );
+    __u16 proto = eth->h_proto;
+    __u32 offset = sizeof(struct ethhdr);
+
+    if ( proto == __constant_htons(ETH_P_8021Q) || proto == __constant_htons(ETH_P_8021AD) )
+    {
+        struct vlan_header * vlan = data + offset;
+        if ( (void*) vlan + sizeof(struct vlan_header) > data_end )
+        {
+            return -1;
+        }
+        proto = vlan->encapsulated_proto;
+        offset += sizeof(struct vlan_header);
+    }
+
+    if ( proto == __constant_htons(ETH_P_IP) )
+    {
+        struct iphdr * ip = data + offset;
+        if ( (void*) ip + sizeof(struct iphdr) > data_end || ip->ihl != 5 || ip->protocol != IPPROTO_UDP )
+        {
+            return -1;
+        }
+        headers->ipv6 = 0;
+        headers->l3_offset = offset;
+        offset += sizeof(struct iphdr);
+    }
+    else if ( proto == __constant_htons(ETH_P_IPV6) )
+    {
+        struct ipv6hdr * ip6 = data + offset;
+        if ( (void*) ip6 + sizeof(struct ipv6hdr) > data_end || ip6->nexthdr != IPPROTO_UDP )
+        {
+            return -1;
+        }
+        headers->ipv6 = 1;
+        headers->l3_offset = offset;
+        offset += sizeof(struct ipv6hdr);
+    }
+    else
+    {
+        return -1;
+    }
+
+    struct udphdr * udp = data + offset;
+    if ( (void*) udp + sizeof(struct udphdr) > data_end || udp->dest != __constant_htons(40000) )
+    {
+        return -1;
+    }
+
+    headers->payload_offset = offset + sizeof(struct udphdr);
+
+    return 0;
+}
+
+// one's complement sums are over 16 bit words as they sit in memory, so nothing needs byte swapping
+
+static __always_inline __u16 csum_fold( __u32 sum )
+{
+    sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+    sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+    return (__u16) ~sum;
+}
 
-    __u32 b = ip->saddr;
-    ip->saddr = ip->daddr;
-    ip->daddr = b;
-    ip->tot_len = bpf_htons( sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes );
-    ip->check = 0;
+// caller must have checked p + bytes <= data_end. bytes is a constant, so the loop unrolls
+
+static __always_inline __u32 csum_bytes( __u8 * p, int bytes )
+{
+    __u32 sum = 0;
+    for ( int i = 0; i + 1 < bytes; i += 2 )
+    {
+        sum += *(__u16*) ( p + i );
+    }
+    if ( bytes & 1 )
+    {
+        sum += p[bytes - 1];
+    }
+    return sum;
+}
+
+// RFC 1624: HC' = ~(~HC + ~m + m')
+
+static __always_inline void csum_replace2( __u16 * check, __u16 old_value, __u16 new_value )
+{
+    __u32 sum = (__u16) ~*check;
+    sum += (__u16) ~old_value;
+    sum += new_value;
+    *check = csum_fold( sum );
+}
+
+/*
+    Turn the packet around in place. payload_sum is the one's complement sum of the reply payload, which the caller
+    already has, so the UDP checksum only needs the pseudo header and UDP header added. Swapping addresses doesn't
+    change the IPv4 header checksum, so only the length change is applied to it, incrementally.
+*/
+
+static __always_inline int reflect_packet( void * data, void * data_end, struct packet_headers * headers, int payload_bytes, __u32 payload_sum )
+{
+    struct ethhdr * eth = data;
+    if ( (void*) eth + sizeof(struct ethhdr) > data_end || headers->l3_offset > sizeof(struct ethhdr) + sizeof(struct vlan_header) )
+    {
+        return -1;
+    }
 
     char c[ETH_ALEN];
     memcpy( c, eth->h_source, ETH_ALEN );
     memcpy( eth->h_source, eth->h_dest, ETH_ALEN );
     memcpy( eth->h_dest, c, ETH_ALEN );
 
-    __u16 * p = (__u16*) ip;
-    __u32 checksum = p[0];
-    checksum += p[1];
-    checksum += p[2];
-    checksum += p[3];
-    checksum += p[4];
-    checksum += p[5];
-    checksum += p[6];
-    checksum += p[7];
-    checksum += p[8];
-    checksum += p[9];
-    checksum = ~ ( ( checksum & 0xFFFF ) + ( checksum >> 16 ) );
-    ip->check = checksum;
+    __u16 udp_len = bpf_htons( sizeof(struct udphdr) + payload_bytes );
+
+    __u32 sum = payload_sum;
+
+    struct udphdr * udp;
+
+    if ( headers->ipv6 )
+    {
+        struct ipv6hdr * ip6 = data + headers->l3_offset;
+        if ( (void*) ip6 + sizeof(struct ipv6hdr) + sizeof(struct udphdr) > data_end )
+        {
+            return -1;
+        }
+
+        struct in6_addr a = ip6->saddr;
+        ip6->saddr = ip6->daddr;
+        ip6->daddr = a;
+        ip6->payload_len = udp_len;
+
+        sum += csum_bytes( (__u8*) &ip6->saddr, sizeof(struct in6_addr) * 2 );
+
+        udp = (void*) ip6 + sizeof(struct ipv6hdr);
+    }
+    else
+    {
+        struct iphdr * ip = data + headers->l3_offset;
+        if ( (void*) ip + sizeof(struct iphdr) + sizeof(struct udphdr) > data_end )
+        {
+            return -1;
+        }
+
+        __u32 b = ip->saddr;
+        ip->saddr = ip->daddr;
+        ip->daddr = b;
+
+        __u16 tot_len = bpf_htons( sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes );
+        csum_replace2( &ip->check, ip->tot_len, tot_len );
+        ip->tot_len = tot_len;
+
+        sum += csum_bytes( (__u8*) &ip->saddr, 8 );
+
+        udp = (void*) ip + sizeof(struct iphdr);
+    }
+
+    __u16 port = udp->source;
+    udp->source = udp->dest;
+    udp->dest = port;
+    udp->len = udp_len;
+
+    // pseudo header protocol and length, then the UDP header itself with a zero checksum
+
+    sum += bpf_htons( IPPROTO_UDP );
+    sum += udp_len;
+    sum += udp->source;
+    sum += udp->dest;
+    sum += udp->len;
+
+    __u16 check = csum_fold( sum );
+    udp->check = check ? check : 0xFFFF;
+
+    return 0;
 }
 
-static __u64 get_server_time()
+/*
+    Pick the ring buffer wakeup flags for the next input record, and track the input buffer high water mark.
+
+    Each input ring buffer is only written from its own cpu, so the last forced wakeup time and high water mark are kept per-cpu.
+    Call this once the record is reserved, just before it's submitted, so a record that didn't fit doesn't count a wakeup.
+    The reserved record is already in the ring's available data, so its size is taken off to get what was queued ahead of it.
+    Wakeups are counted the same way for both policies: the default submit wakes the worker when it has caught up
+    (nothing was queued), coalescing only on a forced wakeup.
+*/
+
+static __always_inline __u64 input_wakeup_flags( void * input_buffer, __u64 record_bytes )
 {
-    return bpf_ktime_get_boot_ns();
+    int zero = 0;
+
+    struct server_config * config = (struct server_config*) bpf_map_lookup_elem( &server_config, &zero );
+    if ( !config )
+    {
+        return 0;
+    }
+
+    struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
+    if ( !counters )
+    {
+        return 0;
+    }
+
+    struct input_buffer_state * state = (struct input_buffer_state*) bpf_map_lookup_elem( &input_buffer_state_map, &zero );
+    if ( !state )
+    {
+        return 0;
+    }
+
+    // each record has an 8 byte header, and is padded to 8 bytes
+
+    __u64 reserved_bytes = ( record_bytes + 8 + 7 ) & ~7ULL;
+
+    __u64 queued_bytes = bpf_ringbuf_query( input_buffer, BPF_RB_AVAIL_DATA );
+
+    queued_bytes = queued_bytes > reserved_bytes ? queued_bytes - reserved_bytes : 0;
+
+    if ( queued_bytes > state->high_water_bytes )
+    {
+        state->high_water_bytes = queued_bytes;
+    }
+
+    if ( config->wakeup_policy != WAKEUP_POLICY_COALESCE )
+    {
+        if ( queued_bytes == 0 )
+        {
+            __sync_fetch_and_add( &counters->input_buffer_wakeups, 1 );
+        }
+        return 0;
+    }
+
+    __u64 current_time = bpf_ktime_get_ns();
+
+    if ( queued_bytes >= config->wakeup_threshold_bytes || current_time - state->last_wakeup_time >= config->wakeup_budget_ns )
+    {
+        state->last_wakeup_time = current_time;
+        __sync_fetch_and_add( &counters->input_buffer_wakeups, 1 );
+        return BPF_RB_FORCE_WAKEUP;
+    }
+
+    return BPF_RB_NO_WAKEUP;
 }
 
-SEC("xdp") int server_xdp_filter( struct xdp_md *ctx ) 
-{ 
-    void * data = (void*) (long) ctx->data; 
+// send the input(s) down to userspace via ring buffer
 
-    void * data_end = (void*) (long) ctx->data_end; 
+// IMPORTANT: missing inputs are sent down in a single record: [session_id][receive time][t][baseline][dt,input]*n, newest input first.
+// the input packet may carry more inputs than are new (inputs are resent until acked), so only the first n are pushed
 
-    struct ethhdr * eth = data;
+static __always_inline int push_inputs( void * input_buffer, __u8 * payload, void * data_end, __u64 session_id, __u64 n )
+{
+    __u64 receive_time = bpf_ktime_get_ns();
 
-    if ( (void*)eth + sizeof(struct ethhdr) < data_end )
+    if ( n == 1 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) <= data_end )
     {
-        if ( eth->h_proto == __constant_htons(ETH_P_IP) ) // IPV4
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + 8 + INPUT_SIZE, 0 );
+        if ( !event )
         {
-            struct iphdr * ip = data + sizeof(struct ethhdr);
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
 
-            if ( (void*)ip + sizeof(struct iphdr) < data_end )
-            {
-                if ( ip->protocol == IPPROTO_UDP ) // UDP
-                {
-                    struct udphdr * udp = (void*) ip + sizeof(struct iphdr);
-
-                    if ( (void*)udp + sizeof(struct udphdr) <= data_end )
-                    {
-                        if ( udp->dest == __constant_htons(40000) )
-                        {
-                            __u8 * payload = (void*) udp + sizeof(struct udphdr);
-                            int payload_bytes = data_end - (void*)payload;
-                            if ( (void*)payload + 1 <= data_end )
-                            {
-                                int packet_type = payload[0];
-
-                                if ( packet_type == JOIN_REQUEST_PACKET && (void*) payload + sizeof(struct join_request_packet) <= data_end )
-                                {
-                                    debug_printf( "received join request packet" );
-
-                                    struct join_request_packet * request = (struct join_request_packet*) payload;
-
-                                    struct session_data session;
-                                    session.next_input_sequence = 1000;
-                                    if ( bpf_map_update_elem( &session_map, &request->session_id, &session, BPF_NOEXIST ) == 0 )
-                                    {
-                                        debug_printf( "created session 0x%llx", request->session_id );
-                                    }
-
-                                    reflect_packet( data, sizeof(struct join_response_packet) );
-
-                                    struct join_response_packet * response = (struct join_response_packet*) payload;
-
-                                    response->packet_type = JOIN_RESPONSE_PACKET;
-                                    response->server_time = get_server_time();
-
-                                    bpf_xdp_adjust_tail( ctx, -( JOIN_REQUEST_PACKET_SIZE - JOIN_RESPONSE_PACKET_SIZE ) );
-
-                                    return XDP_TX;
-                                }
-                                else if ( packet_type == INPUT_PACKET && (void*) payload + INPUT_PACKET_SIZE <= data_end )
-                                {
-                                    __u64 session_id = (__u64) payload[1];
-                                    session_id |= ( (__u64) payload[2] ) << 8;
-                                    session_id |= ( (__u64) payload[3] ) << 16;
-                                    session_id |= ( (__u64) payload[4] ) << 24;
-                                    session_id |= ( (__u64) payload[5] ) << 32;
-                                    session_id |= ( (__u64) payload[6] ) << 40;
-                                    session_id |= ( (__u64) payload[7] ) << 48;
-                                    session_id |= ( (__u64) payload[8] ) << 56;
-
-                                    struct session_data * session = (struct session_data*) bpf_map_lookup_elem( &session_map, &session_id );
-                                    if ( session == NULL )
-                                    {
-                                        debug_printf( "could not find session 0x%llx", session_id );
-                                        return XDP_DROP;
-                                    }
-
-                                    int cpu = bpf_get_smp_processor_id();
-
-                                    // send the input(s) down to userspace via perf buffer
-
-                                    __u64 sequence = (__u64) payload[9];
-                                    sequence |= ( (__u64) payload[10] ) << 8;
-                                    sequence |= ( (__u64) payload[11] ) << 16;
-                                    sequence |= ( (__u64) payload[12] ) << 24;
-                                    sequence |= ( (__u64) payload[13] ) << 32;
-                                    sequence |= ( (__u64) payload[14] ) << 40;
-                                    sequence |= ( (__u64) payload[15] ) << 48;
-                                    sequence |= ( (__u64) payload[16] ) << 56;
-
-                                    __u64 t = (__u64) payload[17];
-                                    t |= ( (__u64) payload[18] ) << 8;
-                                    t |= ( (__u64) payload[19] ) << 16;
-                                    t |= ( (__u64) payload[20] ) << 24;
-                                    t |= ( (__u64) payload[21] ) << 32;
-                                    t |= ( (__u64) payload[22] ) << 40;
-                                    t |= ( (__u64) payload[23] ) << 48;
-                                    t |= ( (__u64) payload[24] ) << 56;
-
-                                    __u64 dt = (__u64) payload[25];
-                                    dt |= ( (__u64) payload[26] ) << 8;
-                                    dt |= ( (__u64) payload[27] ) << 16;
-                                    dt |= ( (__u64) payload[28] ) << 24;
-                                    dt |= ( (__u64) payload[29] ) << 32;
-                                    dt |= ( (__u64) payload[30] ) << 40;
-                                    dt |= ( (__u64) payload[31] ) << 48;
-                                    dt |= ( (__u64) payload[32] ) << 56;
-
-                                    if ( sequence >= session->next_input_sequence )
-                                    {
-                                        __u64 n = ( sequence - session->next_input_sequence ) + 1;
-                                        if ( n > 10 )
-                                        {
-                                            n = 10;
-                                        }
-
-                                        debug_printf( "process input %lld (n=%d)", sequence, n );
-
-                                        session->next_input_sequence = sequence + 1;
-
-                                        void * input_buffer = bpf_map_lookup_elem( &input_buffer_map, &cpu );
-                                        if ( !input_buffer )
-                                        {
-                                            debug_printf( "could not find input buffer for cpu %d", cpu );
-                                            return XDP_DROP;
-                                        }
-
-                                        if ( n == 1 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) <= data_end )
-                                        {
-                                            __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + INPUT_SIZE, 0 );
-                                            if ( !event )
-                                            {
-                                                debug_printf( "dropped input :(" );
-                                                return XDP_DROP;
-                                            }
-                                            
-                                            memcpy( event, payload + 1, 8 );
-                                            memcpy( event + 8, payload + 1 + 8 + 8 , 8 + 8 + INPUT_SIZE );
-
-                                            bpf_ringbuf_submit( event, 0 );
-                                        }
-                                        // todo: update these to ringbuf
-                                        /*
-                                        else if ( n == 2 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 );
-                                        }
-                                        else if ( n == 3 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 );
-                                        }
-                                        else if ( n == 4 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 );
-                                        }
-                                        else if ( n == 5 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 );
-                                        }
-                                        else if ( n == 6 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 );
-                                        }
-                                        else if ( n == 7 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 );
-                                        }
-                                        else if ( n == 8 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 );
-                                        }
-                                        else if ( n == 9 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 );
-                                        }
-                                        else if ( n == 10 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 );
-                                        }
-                                        */
-                                    }
-                                    else
-                                    {
-                                        debug_printf( "input packet is old" );
-                                        return XDP_DROP;
-                                    }
-
-                                    // respond with a player state packet for the client's local player
-
-                                    void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
-                                    if ( !cpu_player_state_map )
-                                    {
-                                        debug_printf( "could not find player state map for cpu %d", cpu );
-                                        return XDP_DROP;
-                                    }
-
-                                    __u8 * player_state = (__u8*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
-                                    if ( !player_state )
-                                    {
-                                        debug_printf( "could not find player state for session 0x%llx", session_id );
-                                        return XDP_DROP;
-                                    }
-
-                                    payload[0] = PLAYER_STATE_PACKET;
-
-                                    for ( int i = 0; i < 8 + PLAYER_STATE_SIZE; i++ )
-                                    {
-                                        payload[1+i] = player_state[i];
-                                    }
-  
-                                    int zero = 0;
-                                    struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
-                                    if ( !counters ) 
-                                    {
-                                        return XDP_DROP; // can't happen
-                                    }
-
-                                    __sync_fetch_and_add( &counters->player_state_packets_sent, 1 );
-
-                                    reflect_packet( data, PLAYER_STATE_PACKET_SIZE );
-
-                                    bpf_xdp_adjust_tail( ctx, -( INPUT_PACKET_SIZE - PLAYER_STATE_PACKET_SIZE ) );
-
-                                    return XDP_TX;
-                                }
-                                else if ( packet_type == STATS_REQUEST_PACKET && (void*) payload + STATS_REQUEST_PACKET_SIZE <= data_end )
-                                {
-                                    debug_printf( "received stats request packet" );
-
-                                    struct stats_request_packet * packet = (struct stats_request_packet*) payload;
-
-                                    int zero = 0;
-                                    struct server_stats * stats = (struct server_stats*) bpf_map_lookup_elem( &server_stats, &zero );
-                                    if ( !stats ) 
-                                    {
-                                        return XDP_DROP; // can't happen
-                                    }
-
-                                    packet->packet_type = STATS_RESPONSE_PACKET;
-                                    packet->inputs_processed = stats->inputs_processed;
-                                    packet->player_state_packets_sent = stats->player_state_packets_sent;
-
-                                    reflect_packet( data, sizeof(struct stats_request_packet) );
-
-                                    return XDP_TX;
-                                }
-                                else
-                                {
-                                    debug_printf( "packet is too small (%d bytes)", payload_bytes );
-                                }
-                            }
-
-                            return XDP_DROP;
-                        }
-                    }
-                }
-            }
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + 8 + INPUT_SIZE );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + 8 + INPUT_SIZE ) );
+    }
+    else if ( n == 2 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 2 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 2 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 ) );
+    }
+    else if ( n == 3 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 3 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
         }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 3 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 ) );
+    }
+    else if ( n == 4 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 4 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 4 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 ) );
+    }
+    else if ( n == 5 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 5 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 5 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 ) );
+    }
+    else if ( n == 6 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 6 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 6 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 ) );
+    }
+    else if ( n == 7 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 7 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 7 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 ) );
+    }
+    else if ( n == 8 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 8 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 8 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 ) );
+    }
+    else if ( n == 9 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 9 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 9 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 ) );
+    }
+    else if ( n == 10 && (void*) payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * 10 <= data_end )
+    {
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, payload + 1, 8 );
+        memcpy( event + 8, &receive_time, 8 );
+        memcpy( event + 16, payload + 1 + 8 + 8 + 1, 8 + 8 + ( 8 + INPUT_SIZE ) * 10 );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 ) );
+    }
+    else
+    {
+        // the packet is shorter than the inputs it claims to carry
+        count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+        return -1;
+    }
+
+    return 0;
+}
+
+#if ENCODED_INPUTS
+
+// apply the XOR runs for one older input. each iteration consumes one encoded byte, so the loop is bounded by MAX_ENCODED_INPUT_BYTES
+
+static __always_inline int decode_input_runs( __u8 * input, __u8 * encoded, void * data_end, int encoded_bytes )
+{
+    int offset = 0;
+    int literal = 0;
+    int expect_length = 0;
+
+    for ( int k = 0; k < MAX_ENCODED_INPUT_BYTES; k++ )
+    {
+        if ( k >= encoded_bytes )
+        {
+            break;
+        }
+
+        if ( (void*) encoded + k + 1 > data_end )
+        {
+            return -1;
+        }
+
+        __u8 value = encoded[k];
+
+        if ( literal > 0 )
+        {
+            if ( offset < 0 || offset >= INPUT_SIZE )
+            {
+                return -1;
+            }
+            input[offset] ^= value;
+            offset++;
+            literal--;
+        }
+        else if ( expect_length )
+        {
+            literal = value;
+            expect_length = 0;
+        }
+        else
+        {
+            offset += value;
+            expect_length = 1;
+        }
+    }
+
+    return literal == 0 ? 0 : -1;
+}
+
+// decode the n newest inputs of an ENCODED_INPUT_PACKET into the same record layout as push_inputs, then copy it to the ring buffer
+
+static __always_inline int push_encoded_inputs( void * input_buffer, __u8 * payload, void * data_end, __u64 session_id, __u64 n )
+{
+    if ( n < 1 || n > MAX_INPUTS_PER_PACKET || (void*) payload + INPUT_PACKET_HEADER_SIZE > data_end )
+    {
+        count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+        return -1;
+    }
+
+    __u64 num_inputs = payload[17];
+    if ( num_inputs < n || num_inputs > MAX_INPUTS_PER_PACKET )
+    {
+        count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+        return -1;
+    }
+
+    int zero = 0;
+    struct input_record * record = (struct input_record*) bpf_map_lookup_elem( &input_record_map, &zero );
+    if ( !record )
+    {
+        return -1; // can't happen
+    }
+
+    record->session_id = session_id;
+    record->receive_time = bpf_ktime_get_ns();
+    memcpy( &record->t, payload + 1 + 8 + 8 + 1, 8 );
+    memcpy( &record->baseline, payload + 1 + 8 + 8 + 1 + 8, 8 );
+
+    __u8 * dts = payload + INPUT_PACKET_HEADER_SIZE;
+
+    for ( int j = 0; j < MAX_INPUTS_PER_PACKET; j++ )
+    {
+        if ( j >= n )
+        {
+            break;
+        }
+        if ( (void*) dts + 8 * ( j + 1 ) > data_end )
+        {
+            count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+            return -1;
+        }
+        memcpy( &record->inputs[j].dt, dts + 8 * j, 8 );
+    }
+
+    __u8 * newest = dts + 8 * num_inputs;
+    if ( (void*) newest + INPUT_SIZE > data_end )
+    {
+        count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+        return -1;
+    }
+
+    memcpy( record->inputs[0].input, newest, INPUT_SIZE );
+
+    // older inputs are only decoded if they are new to the server
+
+    __u8 * encoded = newest + INPUT_SIZE;
+
+    for ( int j = 1; j < MAX_INPUTS_PER_PACKET; j++ )
+    {
+        if ( j >= n )
+        {
+            break;
+        }
+
+        if ( (void*) encoded + 1 > data_end )
+        {
+            count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+            return -1;
+        }
+
+        int encoded_bytes = encoded[0];
+
+        encoded++;
+
+        memcpy( record->inputs[j].input, record->inputs[0].input, INPUT_SIZE );
+
+        if ( decode_input_runs( record->inputs[j].input, encoded, data_end, encoded_bytes ) != 0 )
+        {
+            count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+            return -1;
+        }
+
+        encoded += encoded_bytes;
+    }
+
+    // reserve and submit instead of bpf_ringbuf_output, so the wakeup flags are picked once the record is in the ring.
+    // the reserve size must be constant, so there is one per input count
+
+#pragma unroll
+    for ( int j = 1; j <= MAX_INPUTS_PER_PACKET; j++ )
+    {
+        if ( j != n )
+        {
+            continue;
+        }
+
+        __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * j, 0 );
+        if ( !event )
+        {
+            debug_printf( "dropped input :(" );
+            count_drop( DROP_REASON_RING_FULL, session_id );
+            return -1;
+        }
+
+        memcpy( event, record, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * j );
+
+        bpf_ringbuf_submit( event, input_wakeup_flags( input_buffer, 8 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * j ) );
+    }
+
+    return 0;
+}
+
+#endif // #if ENCODED_INPUTS
+
+/*
+    The number of new inputs in an input packet, counting back from its newest input to the oldest one the session is
+    missing. Zero when the packet doesn't reach back that far: the gap isn't skipped, nothing is pushed, and the reply
+    acks what we already have so the client resends from the oldest missing input.
+*/
+
+static __always_inline __u64 new_input_count( struct session_data * session, __u64 sequence, __u64 num_inputs )
+{
+    __u64 n = ( sequence - session->next_input_sequence ) + 1;
+
+    if ( n > INPUT_HISTORY )
+    {
+        // the client can't resend inputs this old, so they are lost
+
+        return num_inputs;
+    }
+
+    if ( n > num_inputs )
+    {
+        debug_printf( "input gap %lld-%lld", session->next_input_sequence, sequence - num_inputs );
+        return 0;
+    }
+
+    debug_printf( "process input %lld (n=%d)", sequence, n );
+
+    return n;
+}
+
+static __always_inline int push_packet_inputs( void * input_buffer, __u8 * payload, void * data_end, __u64 session_id, __u64 n )
+{
+#if ENCODED_INPUTS
+    if ( payload[0] == ENCODED_INPUT_PACKET )
+    {
+        return push_encoded_inputs( input_buffer, payload, data_end, session_id, n );
+    }
+#endif // #if ENCODED_INPUTS
+
+    return push_inputs( input_buffer, payload, data_end, session_id, n );
+}
+
+// respond with a player state packet for the client's local player, written in place over the input packet
+
+static __always_inline int write_player_state_reply( struct xdp_md * ctx, struct packet_headers * headers, __u64 session_id, int cpu, __u64 ack )
+{
+    void * data = (void*) (long) ctx->data;
+
+    void * data_end = (void*) (long) ctx->data_end;
+
+    if ( headers->payload_offset > MAX_PAYLOAD_OFFSET )
+    {
+        return -1;
+    }
+
+    __u8 * payload = data + headers->payload_offset;
+
+    if ( (void*) payload + MIN_INPUT_PACKET_SIZE > data_end )
+    {
+        count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+        return -1;
+    }
+
+    void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
+    if ( !cpu_player_state_map )
+    {
+        debug_printf( "could not find player state map for cpu %d", cpu );
+        count_drop( DROP_REASON_MISSING_PLAYER_STATE, session_id );
+        return -1;
+    }
+
+    struct player_state_reply * reply = (struct player_state_reply*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
+    if ( !reply )
+    {
+        debug_printf( "could not find player state for session 0x%llx", session_id );
+        count_drop( DROP_REASON_MISSING_PLAYER_STATE, session_id );
+        return -1;
+    }
+
+    // the worker has already encoded the reply as a full or delta player state packet, so just copy it
+
+    int packet_bytes = reply->packet_bytes;
+    if ( packet_bytes < PLAYER_STATE_DELTA_HEADER_SIZE || packet_bytes > PLAYER_STATE_PACKET_SIZE )
+    {
+        debug_printf( "player state reply for session 0x%llx is not ready", session_id );
+        count_drop( DROP_REASON_MISSING_PLAYER_STATE, session_id );
+        return -1;
+    }
+
+    // track how old the player state is when it goes out
+
+    int zero = 0;
+    struct latency_histogram * player_state_age = (struct latency_histogram*) bpf_map_lookup_elem( &player_state_age_map, &zero );
+    if ( player_state_age )
+    {
+        int bucket = latency_histogram_bucket( bpf_ktime_get_ns() - reply->update_time );
+        __sync_fetch_and_add( &player_state_age->buckets[bucket & ( LATENCY_HISTOGRAM_BUCKETS - 1 )], 1 );
+    }
+
+    // resize the packet to the reply in one step (the input packet is usually smaller now that inputs are only resent
+    // until acked), then copy the reply in with a single bulk store
+
+    int input_packet_bytes = data_end - (void*) payload;
+    if ( packet_bytes != input_packet_bytes && bpf_xdp_adjust_tail( ctx, packet_bytes - input_packet_bytes ) != 0 )
+    {
+        debug_printf( "could not resize packet for player state reply" );
+        count_drop( DROP_REASON_TRUNCATED_PACKET, session_id );
+        return -1;
+    }
+
+    if ( bpf_xdp_store_bytes( ctx, headers->payload_offset, reply->packet_data, packet_bytes ) != 0 )
+    {
+        return -1;
+    }
+
+    data = (void*) (long) ctx->data;
+    data_end = (void*) (long) ctx->data_end;
+    payload = data + headers->payload_offset;
+    if ( (void*) payload + 1 + 8 + 1 > data_end )
+    {
+        return -1;
+    }
+
+    memcpy( payload + 1, &ack, 8 );
+
+    // the worker summed everything after the packet type and ack, so only the first 10 bytes are summed here
+
+    __u32 payload_sum = reply->packet_checksum + csum_bytes( payload, 1 + 8 + 1 );
+
+    struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
+    if ( !counters ) 
+    {
+        return -1; // can't happen
+    }
+
+    __sync_fetch_and_add( &counters->player_state_packets_sent, 1 );
+
+    return reflect_packet( data, data_end, headers, packet_bytes, payload_sum );
+}
+
+// load is inputs processed per-second on each worker cpu, updated by player_server once per-second, plus joins since then
+
+static __always_inline __u32 pick_least_loaded_cpu( __u32 num_cpus )
+{
+    __u32 best_cpu = 0;
+    __u64 best_load = ~0ULL;
+    for ( __u32 i = 0; i < MAX_STEERING_CPUS; i++ )
+    {
+        if ( i >= num_cpus )
+        {
+            break;
+        }
+        __u64 * load = (__u64*) bpf_map_lookup_elem( &worker_load_map, &i );
+        if ( load && *load < best_load )
+        {
+            best_load = *load;
+            best_cpu = i;
+        }
+    }
+    return best_cpu;
+}
+
+static __u64 get_server_time()
+{
+    return bpf_ktime_get_boot_ns();
+}
+
+SEC("xdp") int server_xdp_filter( struct xdp_md *ctx ) 
+{ 
+    void * data = (void*) (long) ctx->data; 
+
+    void * data_end = (void*) (long) ctx->data_end; 
+
+    struct packet_headers headers;
+    if ( parse_headers( data, data_end, &headers ) != 0 || headers.payload_offset > MAX_PAYLOAD_OFFSET )
+    {
+        return XDP_PASS;
+    }
+
+    __u8 * payload = data + headers.payload_offset;
+    int payload_bytes = data_end - (void*)payload;
+    if ( (void*)payload + 1 > data_end )
+    {
+        return drop_packet( DROP_REASON_TRUNCATED_PACKET, 0 );
+    }
+
+    int packet_type = payload[0];
+
+    if ( packet_type == JOIN_REQUEST_PACKET && (void*) payload + sizeof(struct join_request_packet) <= data_end )
+    {
+        debug_printf( "received join request packet" );
+
+        struct join_request_packet * request = (struct join_request_packet*) payload;
+
+        struct session_data session;
+        session.next_input_sequence = FIRST_INPUT_SEQUENCE;
+        session.worker_cpu = 0;
+
+        int zero = 0;
+        struct server_config * config = (struct server_config*) bpf_map_lookup_elem( &server_config, &zero );
+        if ( config && config->input_steering == INPUT_STEERING_LEAST_LOADED )
+        {
+            session.worker_cpu = pick_least_loaded_cpu( config->num_cpus ) + 1;
+        }
+
+        if ( bpf_map_update_elem( &session_map, &request->session_id, &session, BPF_NOEXIST ) == 0 )
+        {
+            debug_printf( "created session 0x%llx", request->session_id );
+
+            trace_event( TRACE_EVENT_JOIN, 0, request->session_id, 0 );
+
+            if ( session.worker_cpu != 0 )
+            {
+                __u32 worker_cpu = session.worker_cpu - 1;
+                __u64 * load = (__u64*) bpf_map_lookup_elem( &worker_load_map, &worker_cpu );
+                if ( load )
+                {
+                    __sync_fetch_and_add( load, STEERING_JOIN_LOAD );
+                }
+            }
+        }
+
+        struct join_response_packet * response = (struct join_response_packet*) payload;
+
+        response->packet_type = JOIN_RESPONSE_PACKET;
+        response->server_time = get_server_time();
+#if ENCODED_INPUTS
+        response->features = FEATURE_ENCODED_INPUTS;
+#else // #if ENCODED_INPUTS
+        response->features = 0;
+#endif // #if ENCODED_INPUTS
+
+        __u32 payload_sum = csum_bytes( payload, JOIN_RESPONSE_PACKET_SIZE );
+
+        if ( bpf_xdp_adjust_tail( ctx, -( payload_bytes - JOIN_RESPONSE_PACKET_SIZE ) ) != 0 )
+        {
+            return XDP_DROP;
+        }
+
+        if ( reflect_packet( (void*) (long) ctx->data, (void*) (long) ctx->data_end, &headers, JOIN_RESPONSE_PACKET_SIZE, payload_sum ) != 0 )
+        {
+            return XDP_DROP;
+        }
+
+        return XDP_TX;
+    }
+    else if ( ( packet_type == INPUT_PACKET || ( ENCODED_INPUTS && packet_type == ENCODED_INPUT_PACKET ) ) && (void*) payload + MIN_INPUT_PACKET_SIZE <= data_end )
+    {
+        __u64 session_id = (__u64) payload[1];
+        session_id |= ( (__u64) payload[2] ) << 8;
+        session_id |= ( (__u64) payload[3] ) << 16;
+        session_id |= ( (__u64) payload[4] ) << 24;
+        session_id |= ( (__u64) payload[5] ) << 32;
+        session_id |= ( (__u64) payload[6] ) << 40;
+        session_id |= ( (__u64) payload[7] ) << 48;
+        session_id |= ( (__u64) payload[8] ) << 56;
+
+        struct session_data * session = (struct session_data*) bpf_map_lookup_elem( &session_map, &session_id );
+        if ( session == NULL )
+        {
+            debug_printf( "could not find session 0x%llx", session_id );
+            return drop_packet( DROP_REASON_UNKNOWN_SESSION, session_id );
+        }
+
+        int cpu = bpf_get_smp_processor_id();
+
+        __u64 sequence = (__u64) payload[9];
+        sequence |= ( (__u64) payload[10] ) << 8;
+        sequence |= ( (__u64) payload[11] ) << 16;
+        sequence |= ( (__u64) payload[12] ) << 24;
+        sequence |= ( (__u64) payload[13] ) << 32;
+        sequence |= ( (__u64) payload[14] ) << 40;
+        sequence |= ( (__u64) payload[15] ) << 48;
+        sequence |= ( (__u64) payload[16] ) << 56;
+
+        __u64 num_inputs = payload[17];
+        if ( num_inputs < 1 || num_inputs > MAX_INPUTS_PER_PACKET )
+        {
+            debug_printf( "bad input count %lld", num_inputs );
+            return drop_packet( DROP_REASON_TRUNCATED_PACKET, session_id );
+        }
+
+        __u64 t = (__u64) payload[18];
+        t |= ( (__u64) payload[19] ) << 8;
+        t |= ( (__u64) payload[20] ) << 16;
+        t |= ( (__u64) payload[21] ) << 24;
+        t |= ( (__u64) payload[22] ) << 32;
+        t |= ( (__u64) payload[23] ) << 40;
+        t |= ( (__u64) payload[24] ) << 48;
+        t |= ( (__u64) payload[25] ) << 56;
+
+        __u64 dt = (__u64) payload[34];
+        dt |= ( (__u64) payload[35] ) << 8;
+        dt |= ( (__u64) payload[36] ) << 16;
+        dt |= ( (__u64) payload[37] ) << 24;
+        dt |= ( (__u64) payload[38] ) << 32;
+        dt |= ( (__u64) payload[39] ) << 40;
+        dt |= ( (__u64) payload[40] ) << 48;
+        dt |= ( (__u64) payload[41] ) << 56;
+
+        int zero = 0;
+        struct server_config * config = (struct server_config*) bpf_map_lookup_elem( &server_config, &zero );
+
+        // the sequence only advances once the inputs are handed to a worker, so it's advanced by whoever consumes them.
+        // redirected packets are counted on the other side, and a failed redirect leaves the sequence where it was
+
+        if ( config && config->input_mode == INPUT_MODE_AF_XDP )
+        {
+            if ( headers.ipv6 || headers.payload_offset != sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) )
+            {
+                // the AF_XDP worker only builds untagged IPv4 replies, and no ring buffer workers run in AF_XDP mode
+
+                return drop_packet( DROP_REASON_AF_XDP_UNSUPPORTED, session_id );
+            }
+
+            // pass the whole input packet to the AF_XDP worker for this queue. the worker keeps its own input sequence
+            // per-player, drops old inputs and replies with the player state packet from the same frame
+
+            return bpf_redirect_map( &xsk_map, ctx->rx_queue_index, XDP_DROP );
+        }
+
+        if ( session->worker_cpu != 0 && session->worker_cpu - 1 != (__u32) cpu && config && config->input_steering == INPUT_STEERING_LEAST_LOADED )
+        {
+            // steer the input packet to the worker cpu picked at join. server_xdp_cpumap runs there and pushes
+            // the inputs to that cpu's ring buffer, so each ring buffer only has a producer on its own cpu
+
+            return bpf_redirect_map( &cpu_map, session->worker_cpu - 1, XDP_DROP );
+        }
+
+        if ( sequence < session->next_input_sequence )
+        {
+            debug_printf( "input packet is old" );
+            return drop_packet( DROP_REASON_OLD_INPUT, session_id );
+        }
+
+        __u64 n = new_input_count( session, sequence, num_inputs );
+
+        trace_event( TRACE_EVENT_INPUT, 0, session_id, n );
+
+        void * input_buffer = bpf_map_lookup_elem( &input_buffer_map, &cpu );
+        if ( !input_buffer )
+        {
+            debug_printf( "could not find input buffer for cpu %d", cpu );
+            return XDP_DROP;
+        }
+
+        if ( n > 0 )
+        {
+            // push_inputs drops the packet if it's shorter than n inputs, or the ring buffer is full
+
+            if ( push_packet_inputs( input_buffer, payload, data_end, session_id, n ) != 0 )
+            {
+                return XDP_DROP;
+            }
+
+            session->next_input_sequence = sequence + 1;
+        }
+
+        // ack only the contiguous prefix of inputs pushed to the worker
+
+        if ( write_player_state_reply( ctx, &headers, session_id, cpu, session->next_input_sequence - 1 ) != 0 )
+        {
+            return XDP_DROP;
+        }
+
+        return XDP_TX;
+    }
+    else if ( packet_type == STATS_REQUEST_PACKET && (void*) payload + STATS_REQUEST_PACKET_SIZE <= data_end )
+    {
+        debug_printf( "received stats request packet" );
+
+        struct stats_request_packet * packet = (struct stats_request_packet*) payload;
+
+        int zero = 0;
+        struct server_stats * stats = (struct server_stats*) bpf_map_lookup_elem( &server_stats, &zero );
+        if ( !stats ) 
+        {
+            return XDP_DROP; // can't happen
+        }
+
+        packet->packet_type = STATS_RESPONSE_PACKET;
+        packet->inputs_processed = stats->inputs_processed;
+        packet->player_state_packets_sent = stats->player_state_packets_sent;
+        packet->queue_wait = stats->queue_wait;
+        packet->simulation = stats->simulation;
+        packet->player_state_age = stats->player_state_age;
+
+        if ( payload_bytes != STATS_RESPONSE_PACKET_SIZE && bpf_xdp_adjust_tail( ctx, STATS_RESPONSE_PACKET_SIZE - payload_bytes ) != 0 )
+        {
+            return XDP_DROP;
+        }
+
+        data = (void*) (long) ctx->data;
+        data_end = (void*) (long) ctx->data_end;
+        payload = data + headers.payload_offset;
+        if ( (void*) payload + STATS_RESPONSE_PACKET_SIZE > data_end )
+        {
+            return XDP_DROP;
+        }
+
+        if ( reflect_packet( data, data_end, &headers, STATS_RESPONSE_PACKET_SIZE, csum_bytes( payload, STATS_RESPONSE_PACKET_SIZE ) ) != 0 )
+        {
+            return XDP_DROP;
+        }
+
+        return XDP_TX;
+    }
+    else
+    {
+        debug_printf( "packet is too small (%d bytes)", payload_bytes );
+    }
+
+    return drop_packet( DROP_REASON_TRUNCATED_PACKET, 0 );
+}
+
+/*
+    Runs on the worker cpu for input packets steered there by server_xdp_filter.
+
+    Headers were validated before the redirect. The session map is per-cpu, and this cpu's copy of the session tracks the
+    inputs pushed to this cpu's ring buffer, so old inputs are dropped and the sequence advanced here, after the push.
+    The player state reply can't be sent with XDP_TX from a cpumap program, so it goes out through the tx_port devmap.
+*/
+
+SEC("xdp/cpumap") int server_xdp_cpumap( struct xdp_md *ctx )
+{
+    void * data = (void*) (long) ctx->data; 
+
+    void * data_end = (void*) (long) ctx->data_end; 
+
+    struct packet_headers headers;
+    if ( parse_headers( data, data_end, &headers ) != 0 || headers.payload_offset > MAX_PAYLOAD_OFFSET )
+    {
+        return drop_packet( DROP_REASON_TRUNCATED_PACKET, 0 );
+    }
+
+    __u8 * payload = data + headers.payload_offset;
+    if ( (void*) payload + MIN_INPUT_PACKET_SIZE > data_end )
+    {
+        return drop_packet( DROP_REASON_TRUNCATED_PACKET, 0 );
+    }
+
+    struct input_header * header = (struct input_header*) ( payload + 1 );
+
+    __u64 session_id = header->session_id;
+
+    __u64 sequence = header->sequence;
+
+    __u64 num_inputs = header->num_inputs;
+
+    struct session_data * session = (struct session_data*) bpf_map_lookup_elem( &session_map, &session_id );
+    if ( session == NULL )
+    {
+        return drop_packet( DROP_REASON_UNKNOWN_SESSION, session_id );
+    }
+
+    // the join ran on the rss cpu, so this cpu's copy of the session starts out zeroed
+
+    if ( session->next_input_sequence == 0 )
+    {
+        session->next_input_sequence = FIRST_INPUT_SEQUENCE;
+    }
+
+    if ( sequence < session->next_input_sequence )
+    {
+        debug_printf( "input packet is old" );
+        return drop_packet( DROP_REASON_OLD_INPUT, session_id );
+    }
+
+    __u64 n = new_input_count( session, sequence, num_inputs );
+
+    int cpu = bpf_get_smp_processor_id();
+
+    void * input_buffer = bpf_map_lookup_elem( &input_buffer_map, &cpu );
+    if ( !input_buffer )
+    {
+        debug_printf( "could not find input buffer for cpu %d", cpu );
+        return XDP_DROP;
+    }
+
+    if ( n > 0 )
+    {
+        if ( push_packet_inputs( input_buffer, payload, data_end, session_id, n ) != 0 )
+        {
+            return XDP_DROP;
+        }
+
+        session->next_input_sequence = sequence + 1;
+    }
+
+    if ( write_player_state_reply( ctx, &headers, session_id, cpu, session->next_input_sequence - 1 ) != 0 )
+    {
+        return XDP_DROP;
     }
 
-    return XDP_PASS;
+    return bpf_redirect_map( &tx_port, 0, XDP_DROP );
 }
 
 char _license[] SEC("license") = "GPL";
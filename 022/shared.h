@@ -11,27 +11,79 @@
 #define STATS_REQUEST_PACKET                                                                4
 #define STATS_RESPONSE_PACKET                                                               5
 #define PLAYER_STATE_PACKET                                                                 6
+#define PLAYER_STATE_DELTA_PACKET                                                           7
+#define ENCODED_INPUT_PACKET                                                                8
 
 #define INPUT_SIZE                                                                        100
-#define INPUTS_PER_PACKET                                                                  10
-#define INPUT_PACKET_SIZE            ( 1 + 8 + 8 + 8 + (INPUT_SIZE + 8) * INPUTS_PER_PACKET )
+#define MAX_INPUTS_PER_PACKET                                                              10
+#define INPUT_PACKET_HEADER_SIZE                                    ( 1 + 8 + 8 + 1 + 8 + 8 )
+#define INPUT_PACKET_SIZE        ( INPUT_PACKET_HEADER_SIZE + (INPUT_SIZE + 8) * MAX_INPUTS_PER_PACKET )
+#define MIN_INPUT_PACKET_SIZE                    ( INPUT_PACKET_HEADER_SIZE + INPUT_SIZE + 8 )
+#define INPUT_HISTORY                                                                    1024          // inputs the client keeps to resend
+#define FIRST_INPUT_SEQUENCE                                                             1000          // the client's first input
 
 #define PLAYER_DATA_SIZE                                                                 1024
 
 #define PLAYER_STATE_SIZE                                                                1000
 
 #define JOIN_REQUEST_PACKET_SIZE                             ( 1 + 8 + 8 + PLAYER_DATA_SIZE )
-#define JOIN_RESPONSE_PACKET_SIZE                                           ( 1 + 8 + 8 + 8 )
-#define STATS_REQUEST_PACKET_SIZE                                               ( 1 + 8 + 8 )
-#define STATS_RESPONSE_PACKET_SIZE                                              ( 1 + 8 + 8 )
+#define JOIN_RESPONSE_PACKET_SIZE                                       ( 1 + 8 + 8 + 8 + 1 )
+#define STATS_REQUEST_PACKET_SIZE                                       ( 1 + 8 + 8 + 8 * 9 )
+#define STATS_RESPONSE_PACKET_SIZE                                      ( 1 + 8 + 8 + 8 * 9 )
 
 #define MAX_SESSIONS                                                                   100000
 
-#define MAX_CPUS                                                                           32
+#define MAX_CPUS                                                                           32          // default, override on the player_server command line
 
-#define PLAYERS_PER_CPU                                                                   500
+#define PLAYERS_PER_CPU                                                                   500          // default, override on the player_server command line
 
-#define PLAYER_STATE_PACKET_SIZE                                ( 1 + 8 + PLAYER_STATE_SIZE )
+#define INPUTS_PER_SECOND                                                                 100          // per-player, the client tick rate
+
+#define INPUT_BUFFER_MAX_DELAY_MS                                                         100          // input buffers are sized to hold this much input for every player on the cpu
+
+#define MIN_INPUT_BUFFER_SIZE                                                     ( 64 * 1024 )
+#define MAX_INPUT_BUFFER_SIZE                                               ( 256 * 1024 * 1024 )
+
+#define PLAYER_STATE_PACKET_SIZE                            ( 1 + 8 + 8 + PLAYER_STATE_SIZE )
+
+#define PLAYER_STATE_DELTA_HEADER_SIZE                                  ( 1 + 8 + 8 + 8 + 2 )
+#define PLAYER_STATE_HISTORY                                                               32
+
+#define FEATURE_ENCODED_INPUTS                                                              1          // server accepts ENCODED_INPUT_PACKET
+
+#define MAX_ENCODED_INPUT_BYTES                                                           255          // per older input, so the length fits in a byte
+
+#define INPUT_MODE_RING_BUFFER                                                              0
+#define INPUT_MODE_AF_XDP                                                                   1
+
+#define INPUT_STEERING_RSS                                                                  0
+#define INPUT_STEERING_LEAST_LOADED                                                         1
+
+#define WAKEUP_POLICY_ALWAYS                                                                0          // default ring buffer wakeups: the worker is woken whenever it has caught up
+#define WAKEUP_POLICY_COALESCE                                                              1          // submit with BPF_RB_NO_WAKEUP, force a wakeup past a threshold or time budget
+
+#define WAKEUP_THRESHOLD_BYTES                                                  ( 64 * 1024 )          // default, override on the player_server command line
+#define WAKEUP_BUDGET_US                                                                  100          // default, override on the player_server command line
+
+#define MAX_STEERING_CPUS                                                                 256          // bound for the least loaded worker search at join
+
+#define STEERING_JOIN_LOAD                                                                100          // inputs per-second a new player adds to its worker's load
+
+#define DROP_REASON_UNKNOWN_SESSION                                                         0
+#define DROP_REASON_OLD_INPUT                                                               1
+#define DROP_REASON_RING_FULL                                                               2
+#define DROP_REASON_MISSING_PLAYER_STATE                                                    3
+#define DROP_REASON_TRUNCATED_PACKET                                                        4
+#define DROP_REASON_AF_XDP_UNSUPPORTED                                                      5          // VLAN tagged or IPv6 input in AF_XDP mode
+#define NUM_DROP_REASONS                                                                    6
+
+#define TRACE_EVENT_JOIN                                                                    1
+#define TRACE_EVENT_INPUT                                                                   2
+#define TRACE_EVENT_DROP                                                                    3
+
+#define TRACE_BUFFER_SIZE                                                       ( 1024 * 1024 )
+
+#define LATENCY_HISTOGRAM_BUCKETS                                                         256
 
 #pragma pack(push, 1)
 
@@ -49,6 +101,14 @@ struct join_response_packet
     __u64 session_id;
     __u64 send_time;
     __u64 server_time;
+    __u8 features;
+};
+
+struct latency_percentiles
+{
+    __u64 p50;
+    __u64 p99;
+    __u64 p999;
 };
 
 struct stats_request_packet
@@ -56,17 +116,24 @@ struct stats_request_packet
     __u8 packet_type;
     __u64 inputs_processed;
     __u64 player_state_packets_sent;
+    struct latency_percentiles queue_wait;
+    struct latency_percentiles simulation;
+    struct latency_percentiles player_state_age;
 };
 
 struct server_stats
 {
     __u64 inputs_processed;
     __u64 player_state_packets_sent;
+    struct latency_percentiles queue_wait;
+    struct latency_percentiles simulation;
+    struct latency_percentiles player_state_age;
 };
 
 struct session_data 
 {
     __u64 next_input_sequence;
+    __u32 worker_cpu;               // worker cpu + 1 when inputs are steered, zero to process inputs on the RSS cpu
 };
 
 struct player_state
@@ -78,8 +145,28 @@ struct player_state
 struct input_header
 {
     __u64 session_id;
-    __u64 sequence;
+    __u64 sequence;                 // sequence of the newest input in the packet
+    __u8 num_inputs;                // inputs in the packet, newest first. the client only sends inputs the server hasn't acked
     __u64 t;
+    __u64 baseline;                 // t of the most recent player state the client has received, zero for none
+};
+
+/*
+    The player state reply is encoded by the worker and copied verbatim into the reply packet by XDP.
+
+    It is either a full PLAYER_STATE_PACKET: [6][ack][t][data], or if the server still has the baseline the client acked,
+    a PLAYER_STATE_DELTA_PACKET: [7][ack][t][baseline t][num ranges (u16)] followed by [offset (u16)][length (u16)][bytes]
+    for each range of the player state (t + data) that changed since the baseline.
+
+    ack is the sequence of the last input pushed to the worker for this client. The worker leaves it zero and XDP writes it.
+*/
+
+struct player_state_reply
+{
+    __u64 update_time;              // bpf_ktime_get_ns() clock (CLOCK_MONOTONIC)
+    __u16 packet_bytes;
+    __u32 packet_checksum;          // one's complement sum of packet_data[10:packet_bytes] as little endian 16 bit words, unfolded
+    __u8 packet_data[PLAYER_STATE_PACKET_SIZE];
 };
 
 struct input_data
@@ -88,11 +175,103 @@ struct input_data
     __u8 input[INPUT_SIZE];
 };
 
+/*
+    ENCODED_INPUT_PACKET has the same header as INPUT_PACKET, then the dt of every input (newest first), then the newest
+    input in full. Each older input follows as [encoded bytes (u8)] then runs of [skip (u8)][length (u8)][bytes], where
+    skip is the number of bytes unchanged from the newest input and bytes are XORed with it.
+
+    XDP decodes only the new inputs into an input_record before passing them to the worker.
+*/
+
+struct input_record
+{
+    __u64 session_id;
+    __u64 receive_time;
+    __u64 t;
+    __u64 baseline;
+    struct input_data inputs[MAX_INPUTS_PER_PACKET];
+};
+
 struct counters
 {
     __u64 player_state_packets_sent;
+    __u64 drops[NUM_DROP_REASONS];
+    __u64 input_buffer_wakeups;
+};
+
+struct input_buffer_state
+{
+    __u64 last_wakeup_time;
+    __u64 high_water_bytes;         // most input ever queued in this cpu's input buffer
+};
+
+struct server_config
+{
+    __u32 input_mode;
+    __u32 input_steering;
+    __u32 num_cpus;
+    __u32 trace_sample_rate;        // trace 1 in n events, zero to disable
+    __u32 wakeup_policy;
+    __u32 wakeup_threshold_bytes;   // WAKEUP_POLICY_COALESCE: force a wakeup once this much input is queued...
+    __u64 wakeup_budget_ns;         // ...or this long after the last forced wakeup
+};
+
+struct trace_event
+{
+    __u64 timestamp;
+    __u64 session_id;
+    __u32 cpu;
+    __u8 type;
+    __u8 drop_reason;
+    __u16 num_inputs;
+};
+
+/*
+    Log-linear latency histograms in nanoseconds: 8 linear sub-buckets per power of two, up to ~8 seconds.
+*/
+
+struct latency_histogram
+{
+    __u64 buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+struct worker_latency
+{
+    struct latency_histogram queue_wait;
+    struct latency_histogram simulation;
 };
 
 #pragma pack(pop)
 
+static inline int latency_histogram_bucket( __u64 value )
+{
+    if ( value < 8 )
+        return (int) value;
+
+    int e = 0;
+    __u64 v = value;
+    if ( v >> 32 ) { v >>= 32; e += 32; }
+    if ( v >> 16 ) { v >>= 16; e += 16; }
+    if ( v >> 8 )  { v >>= 8;  e += 8;  }
+    if ( v >> 4 )  { v >>= 4;  e += 4;  }
+    if ( v >> 2 )  { v >>= 2;  e += 2;  }
+    if ( v >> 1 )  { e += 1; }
+
+    int bucket = ( e - 2 ) * 8 + (int) ( ( value >> ( e - 3 ) ) & 7 );
+
+    return bucket < LATENCY_HISTOGRAM_BUCKETS ? bucket : LATENCY_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline __u64 latency_histogram_value( int bucket )
+{
+    // lower bound of the values in this bucket
+
+    if ( bucket < 8 )
+        return bucket;
+
+    int e = bucket / 8 + 2;
+
+    return ( (__u64) ( 8 + bucket % 8 ) ) << ( e - 3 );
+}
+
 #endif // #ifndef SHARED_H
@@ -0,0 +1,544 @@
+/*
+    FPS server XDP benchmark (BPF_PROG_TEST_RUN)
+
+    Loads player_server_xdp.o without attaching it to a network interface, primes the session and player state maps,
+    then drives synthetic join, input and stats packets through the XDP program and reports ns per-packet.
+
+    USAGE:
+
+        make xdp_benchmark && sudo ./xdp_benchmark
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <arpa/inet.h>
+#include "shared.h"
+
+#define BENCHMARK_PIN_PATH                                               "/sys/fs/bpf/xdp_benchmark"
+
+#define BENCHMARK_ITERATIONS                                                                100000
+
+#define BENCHMARK_SESSION_ID                                                   0x1234567812345678ULL
+
+#define BENCHMARK_SEQUENCE                                                                  100000
+
+#define MAX_PACKET_SIZE                                                                       1500
+
+#define BENCHMARK_INPUT_BUFFER_SIZE                                           ( 16 * 1024 * 1024 )          // drained every 1000 packets
+
+#define VLAN_HEADER_SIZE                                                                         4
+
+#define PACKET_IPV4                                                                              0
+#define PACKET_IPV4_VLAN                                                                         1
+#define PACKET_IPV6                                                                              2
+
+static const char * packet_layout_names[] = { "", " vlan", " ipv6" };
+
+struct benchmark_t
+{
+    struct bpf_object * object;
+    int program_fd;
+    int session_map_fd;
+    int player_state_fd;
+    struct ring_buffer * input_buffer;
+    int num_cpus;
+};
+
+static struct benchmark_t benchmark;
+
+static int drain_input( void * ctx, void * data, size_t data_sz )
+{
+    (void) ctx; (void) data; (void) data_sz;
+    return 0;
+}
+
+static int write_packet( uint8_t * packet, int layout, const uint8_t * payload, int payload_bytes )
+{
+    struct ethhdr * eth = (struct ethhdr*) packet;
+
+    memset( packet, 0, sizeof(struct ethhdr) + VLAN_HEADER_SIZE + sizeof(struct ipv6hdr) + sizeof(struct udphdr) );
+
+    memset( eth->h_dest, 0x11, ETH_ALEN );
+    memset( eth->h_source, 0x22, ETH_ALEN );
+
+    uint8_t * p = packet + sizeof(struct ethhdr);
+
+    if ( layout == PACKET_IPV4_VLAN )
+    {
+        eth->h_proto = htons( ETH_P_8021Q );
+        uint16_t tci = htons( 100 );
+        uint16_t proto = htons( ETH_P_IP );
+        memcpy( p, &tci, 2 );
+        memcpy( p + 2, &proto, 2 );
+        p += VLAN_HEADER_SIZE;
+    }
+    else
+    {
+        eth->h_proto = htons( layout == PACKET_IPV6 ? ETH_P_IPV6 : ETH_P_IP );
+    }
+
+    if ( layout == PACKET_IPV6 )
+    {
+        struct ipv6hdr * ip6 = (struct ipv6hdr*) p;
+        ip6->version = 6;
+        ip6->nexthdr = IPPROTO_UDP;
+        ip6->hop_limit = 64;
+        ip6->payload_len = htons( sizeof(struct udphdr) + payload_bytes );
+        ip6->saddr.s6_addr[0] = 0xfd;
+        ip6->saddr.s6_addr[15] = 1;
+        ip6->daddr.s6_addr[0] = 0xfd;
+        ip6->daddr.s6_addr[15] = 2;
+        p += sizeof(struct ipv6hdr);
+    }
+    else
+    {
+        struct iphdr * ip = (struct iphdr*) p;
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_UDP;
+        ip->saddr = htonl( 0x0A000001 );
+        ip->daddr = htonl( 0x0A000002 );
+        ip->tot_len = htons( sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes );
+        p += sizeof(struct iphdr);
+    }
+
+    struct udphdr * udp = (struct udphdr*) p;
+    udp->source = htons( 30000 );
+    udp->dest = htons( 40000 );
+    udp->len = htons( sizeof(struct udphdr) + payload_bytes );
+    p += sizeof(struct udphdr);
+
+    memcpy( p, payload, payload_bytes );
+
+    return (int) ( p - packet ) + payload_bytes;
+}
+
+static int write_join_request_payload( uint8_t * payload )
+{
+    memset( payload, 0, JOIN_REQUEST_PACKET_SIZE );
+    payload[0] = JOIN_REQUEST_PACKET;
+    uint64_t session_id = BENCHMARK_SESSION_ID;
+    memcpy( payload + 1, &session_id, 8 );
+    return JOIN_REQUEST_PACKET_SIZE;
+}
+
+static void write_benchmark_input( uint8_t * input, uint64_t sequence )
+{
+    // inputs from one tick to the next mostly differ in a few bytes (buttons, aim)
+
+    memset( input, 0, INPUT_SIZE );
+    uint32_t value = (uint32_t) sequence;
+    memcpy( input, &value, 4 );
+}
+
+static int encode_input( uint8_t * encoded, const uint8_t * input, const uint8_t * newest )
+{
+    // [skip][length][bytes XOR newest] runs, see ENCODED_INPUT_PACKET in shared.h
+
+    int bytes = 0;
+    int i = 0;
+    while ( i < INPUT_SIZE )
+    {
+        int start = i;
+        while ( i < INPUT_SIZE && input[i] == newest[i] && i - start < 255 )
+            i++;
+        if ( i == INPUT_SIZE )
+            break;
+        int skip = i - start;
+        int length = 0;
+        while ( i < INPUT_SIZE && input[i] != newest[i] && length < 255 )
+        {
+            encoded[bytes + 2 + length] = input[i] ^ newest[i];
+            length++;
+            i++;
+        }
+        encoded[bytes] = (uint8_t) skip;
+        encoded[bytes + 1] = (uint8_t) length;
+        bytes += 2 + length;
+    }
+    return bytes;
+}
+
+static int write_input_payload( uint8_t * payload, uint64_t sequence, int num_inputs, bool encoded )
+{
+    memset( payload, 0, INPUT_PACKET_SIZE );
+    payload[0] = encoded ? ENCODED_INPUT_PACKET : INPUT_PACKET;
+    uint64_t session_id = BENCHMARK_SESSION_ID;
+    uint64_t t = sequence * 10000000;
+    memcpy( payload + 1, &session_id, 8 );
+    memcpy( payload + 1 + 8, &sequence, 8 );
+    payload[1 + 8 + 8] = (uint8_t) num_inputs;
+    memcpy( payload + 1 + 8 + 8 + 1, &t, 8 );
+
+    uint64_t dt = 10000000;
+
+    if ( !encoded )
+    {
+        for ( int i = 0; i < num_inputs; i++ )
+        {
+            memcpy( payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * i, &dt, 8 );
+            write_benchmark_input( payload + INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * i + 8, sequence - i );
+        }
+        return INPUT_PACKET_HEADER_SIZE + ( 8 + INPUT_SIZE ) * num_inputs;
+    }
+
+    int bytes = INPUT_PACKET_HEADER_SIZE;
+    for ( int i = 0; i < num_inputs; i++ )
+    {
+        memcpy( payload + bytes, &dt, 8 );
+        bytes += 8;
+    }
+
+    uint8_t newest[INPUT_SIZE];
+    write_benchmark_input( newest, sequence );
+    memcpy( payload + bytes, newest, INPUT_SIZE );
+    bytes += INPUT_SIZE;
+
+    for ( int i = 1; i < num_inputs; i++ )
+    {
+        uint8_t input[INPUT_SIZE];
+        write_benchmark_input( input, sequence - i );
+        int encoded_bytes = encode_input( payload + bytes + 1, input, newest );
+        assert( encoded_bytes <= MAX_ENCODED_INPUT_BYTES );
+        payload[bytes] = (uint8_t) encoded_bytes;
+        bytes += 1 + encoded_bytes;
+    }
+
+    return bytes;
+}
+
+static int write_stats_request_payload( uint8_t * payload )
+{
+    memset( payload, 0, STATS_REQUEST_PACKET_SIZE );
+    payload[0] = STATS_REQUEST_PACKET;
+    return STATS_REQUEST_PACKET_SIZE;
+}
+
+static int prime_session( uint64_t next_input_sequence )
+{
+    struct session_data values[benchmark.num_cpus];
+    memset( values, 0, sizeof(values) );
+    for ( int i = 0; i < benchmark.num_cpus; i++ )
+    {
+        values[i].next_input_sequence = next_input_sequence;
+    }
+    uint64_t session_id = BENCHMARK_SESSION_ID;
+    return bpf_map_update_elem( benchmark.session_map_fd, &session_id, values, BPF_ANY );
+}
+
+static int prime_player_state()
+{
+    struct player_state_reply reply;
+    memset( &reply, 0, sizeof(reply) );
+    reply.packet_bytes = PLAYER_STATE_PACKET_SIZE;
+    reply.packet_data[0] = PLAYER_STATE_PACKET;
+    uint64_t session_id = BENCHMARK_SESSION_ID;
+    return bpf_map_update_elem( benchmark.player_state_fd, &session_id, &reply, BPF_ANY );
+}
+
+// IMPORTANT: the xdp program modifies the packet in place, so every run gets a fresh copy of the packet (repeat = 1)
+
+static int run_packet( const uint8_t * packet, int packet_bytes, uint64_t * duration, int * result )
+{
+    uint8_t output[MAX_PACKET_SIZE];
+
+    DECLARE_LIBBPF_OPTS( bpf_test_run_opts, opts,
+        .data_in = packet,
+        .data_size_in = packet_bytes,
+        .data_out = output,
+        .data_size_out = sizeof(output),
+        .repeat = 1,
+    );
+
+    int err = bpf_prog_test_run_opts( benchmark.program_fd, &opts );
+    if ( err != 0 )
+    {
+        printf( "\nerror: test run failed: %s\n\n", strerror(errno) );
+        return err;
+    }
+
+    *duration += opts.duration;
+    *result = opts.retval;
+
+    return 0;
+}
+
+static void report( const char * name, uint64_t duration, int iterations, int not_tx )
+{
+    printf( "%-16s %8.1f ns/packet", name, duration / (double) iterations );
+    if ( not_tx > 0 )
+    {
+        printf( " (%d/%d packets not XDP_TX)", not_tx, iterations );
+    }
+    printf( "\n" );
+}
+
+static int benchmark_join()
+{
+    uint8_t payload[MAX_PACKET_SIZE];
+    uint8_t packet[MAX_PACKET_SIZE];
+    int packet_bytes = write_packet( packet, PACKET_IPV4, payload, write_join_request_payload( payload ) );
+
+    uint64_t duration = 0;
+    int not_tx = 0;
+    for ( int i = 0; i < BENCHMARK_ITERATIONS; i++ )
+    {
+        int result = 0;
+        if ( run_packet( packet, packet_bytes, &duration, &result ) != 0 )
+            return 1;
+        if ( result != XDP_TX )
+            not_tx++;
+    }
+
+    report( "join", duration, BENCHMARK_ITERATIONS, not_tx );
+
+    return 0;
+}
+
+static int benchmark_input( int n, bool encoded, int layout )
+{
+    uint8_t payload[MAX_PACKET_SIZE];
+    uint8_t packet[MAX_PACKET_SIZE];
+    int payload_bytes = write_input_payload( payload, BENCHMARK_SEQUENCE, n, encoded );
+    int packet_bytes = write_packet( packet, layout, payload, payload_bytes );
+
+    // each run re-primes the session so the input packet is always n inputs ahead of the server, and carries exactly
+    // the n unacked inputs, like the client does
+
+    uint64_t duration = 0;
+    int not_tx = 0;
+    for ( int i = 0; i < BENCHMARK_ITERATIONS; i++ )
+    {
+        if ( prime_session( BENCHMARK_SEQUENCE - n + 1 ) != 0 )
+        {
+            printf( "\nerror: could not prime session: %s\n\n", strerror(errno) );
+            return 1;
+        }
+        int result = 0;
+        if ( run_packet( packet, packet_bytes, &duration, &result ) != 0 )
+            return 1;
+        if ( result != XDP_TX )
+            not_tx++;
+        if ( ( i % 1000 ) == 0 )
+        {
+            ring_buffer__consume( benchmark.input_buffer );
+        }
+    }
+
+    ring_buffer__consume( benchmark.input_buffer );
+
+    char name[64];
+    snprintf( name, sizeof(name), "%s%s (n=%d)", encoded ? "encoded input" : "input", packet_layout_names[layout], n );
+    report( name, duration, BENCHMARK_ITERATIONS, not_tx );
+    printf( "%-16s %8d bytes payload\n", "", payload_bytes );
+
+    return 0;
+}
+
+static int benchmark_stats()
+{
+    uint8_t payload[MAX_PACKET_SIZE];
+    uint8_t packet[MAX_PACKET_SIZE];
+    int packet_bytes = write_packet( packet, PACKET_IPV4, payload, write_stats_request_payload( payload ) );
+
+    uint64_t duration = 0;
+    int not_tx = 0;
+    for ( int i = 0; i < BENCHMARK_ITERATIONS; i++ )
+    {
+        int result = 0;
+        if ( run_packet( packet, packet_bytes, &duration, &result ) != 0 )
+            return 1;
+        if ( result != XDP_TX )
+            not_tx++;
+    }
+
+    report( "stats", duration, BENCHMARK_ITERATIONS, not_tx );
+
+    return 0;
+}
+
+int benchmark_init( struct benchmark_t * benchmark )
+{
+    if ( geteuid() != 0 )
+    {
+        printf( "\nerror: this program must be run as root\n\n" );
+        return 1;
+    }
+
+    struct rlimit rlim_new = {
+        .rlim_cur   = RLIM_INFINITY,
+        .rlim_max   = RLIM_INFINITY,
+    };
+
+    if ( setrlimit( RLIMIT_MEMLOCK, &rlim_new ) )
+    {
+        printf( "\nerror: could not increase RLIMIT_MEMLOCK limit!\n\n" );
+        return 1;
+    }
+
+    // run on cpu 0 so the xdp program sees cpu 0 and uses player_state_0 and input_buffer_0
+
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( 0, &cpuset );
+    if ( sched_setaffinity( 0, sizeof(cpuset), &cpuset ) != 0 )
+    {
+        printf( "\nerror: could not pin benchmark to cpu 0\n\n" );
+        return 1;
+    }
+
+    benchmark->num_cpus = libbpf_num_possible_cpus();
+
+    // load player_server_xdp.o, with its pinned maps kept apart from any running player server
+
+    mkdir( BENCHMARK_PIN_PATH, 0700 );
+
+    DECLARE_LIBBPF_OPTS( bpf_object_open_opts, open_opts, .pin_root_path = BENCHMARK_PIN_PATH );
+
+    benchmark->object = bpf_object__open_file( "player_server_xdp.o", &open_opts );
+    if ( libbpf_get_error( benchmark->object ) )
+    {
+        printf( "\nerror: could not open player_server_xdp.o\n\n" );
+        benchmark->object = NULL;
+        return 1;
+    }
+
+    if ( bpf_object__load( benchmark->object ) != 0 )
+    {
+        printf( "\nerror: could not load player_server_xdp.o: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    struct bpf_program * program = bpf_object__find_program_by_name( benchmark->object, "server_xdp_filter" );
+    if ( !program )
+    {
+        printf( "\nerror: could not find server_xdp_filter\n\n" );
+        return 1;
+    }
+
+    benchmark->program_fd = bpf_program__fd( program );
+
+    struct bpf_map * session_map = bpf_object__find_map_by_name( benchmark->object, "session_map" );
+    struct bpf_map * player_state_outer = bpf_object__find_map_by_name( benchmark->object, "player_state_map" );
+    struct bpf_map * input_buffer_outer = bpf_object__find_map_by_name( benchmark->object, "input_buffer_map" );
+    if ( !session_map || !player_state_outer || !input_buffer_outer )
+    {
+        printf( "\nerror: could not find maps in player_server_xdp.o\n\n" );
+        return 1;
+    }
+
+    benchmark->session_map_fd = bpf_map__fd( session_map );
+
+    // player_server normally creates the per-cpu inner maps. we only need the ones for cpu 0
+
+    int input_buffer_fd = bpf_map_create( BPF_MAP_TYPE_RINGBUF, "input_buffer_0", 0, 0, BENCHMARK_INPUT_BUFFER_SIZE, NULL );
+    benchmark->player_state_fd = bpf_map_create( BPF_MAP_TYPE_LRU_HASH, "player_state_0", sizeof(__u64), sizeof(struct player_state_reply), PLAYERS_PER_CPU, NULL );
+    if ( input_buffer_fd < 0 || benchmark->player_state_fd < 0 )
+    {
+        printf( "\nerror: could not create input buffer and player state maps: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    __u32 key = 0;
+    if ( bpf_map_update_elem( bpf_map__fd( input_buffer_outer ), &key, &input_buffer_fd, BPF_ANY ) != 0 ||
+         bpf_map_update_elem( bpf_map__fd( player_state_outer ), &key, &benchmark->player_state_fd, BPF_ANY ) != 0 )
+    {
+        printf( "\nerror: could not add input buffer and player state maps for cpu 0: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    benchmark->input_buffer = ring_buffer__new( input_buffer_fd, drain_input, NULL, NULL );
+    if ( !benchmark->input_buffer )
+    {
+        printf( "\nerror: could not create input buffer\n\n" );
+        return 1;
+    }
+
+    if ( prime_session( BENCHMARK_SEQUENCE ) != 0 || prime_player_state() != 0 )
+    {
+        printf( "\nerror: could not prime session and player state: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    return 0;
+}
+
+void benchmark_shutdown( struct benchmark_t * benchmark )
+{
+    if ( benchmark->input_buffer )
+    {
+        ring_buffer__free( benchmark->input_buffer );
+        benchmark->input_buffer = NULL;
+    }
+
+    if ( benchmark->object )
+    {
+        bpf_object__unpin_maps( benchmark->object, NULL );
+        bpf_object__close( benchmark->object );
+        benchmark->object = NULL;
+    }
+
+    rmdir( BENCHMARK_PIN_PATH );
+}
+
+int main( int argc, char *argv[] )
+{
+    if ( benchmark_init( &benchmark ) != 0 )
+    {
+        benchmark_shutdown( &benchmark );
+        return 1;
+    }
+
+    printf( "running %d iterations per-packet type\n\n", BENCHMARK_ITERATIONS );
+
+    int result = benchmark_join();
+
+    for ( int n = 1; n <= MAX_INPUTS_PER_PACKET && result == 0; n++ )
+    {
+        result = benchmark_input( n, false, PACKET_IPV4 );
+    }
+
+    for ( int n = 1; n <= MAX_INPUTS_PER_PACKET && result == 0; n++ )
+    {
+        result = benchmark_input( n, true, PACKET_IPV4 );
+    }
+
+    // the reply is built with the same code for each header layout, so one and all inputs is enough to compare
+
+    for ( int layout = PACKET_IPV4_VLAN; layout <= PACKET_IPV6 && result == 0; layout++ )
+    {
+        result = benchmark_input( 1, false, layout );
+        if ( result == 0 )
+        {
+            result = benchmark_input( MAX_INPUTS_PER_PACKET, false, layout );
+        }
+    }
+
+    if ( result == 0 )
+    {
+        result = benchmark_stats();
+    }
+
+    benchmark_shutdown( &benchmark );
+
+    return result;
+}